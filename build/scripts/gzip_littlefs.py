@@ -4,14 +4,62 @@
 Import('env', 'projenv')
 import os
 import gzip
+import hashlib
+import json
+import re
 import shutil
 import glob
 
-# Complementary function to use gzip
-def gzip_file(src_path, dst_path):
-    with open(src_path, 'rb') as src, gzip.open(dst_path, 'wb') as dst:
-        for chunk in iter(lambda: src.read(4096), b""):
-            dst.write(chunk)
+# Served by the firmware's asset handler as listed in this manifest, see SplitFlapAssets.h
+MANIFEST_NAME = 'assets.json'
+CONTENT_TYPES = {'css': 'text/css', 'html': 'text/html', 'js': 'application/javascript', 'json': 'application/json'}
+# Referenced from the pages, so also served under a name with their hash that never changes and is cached for good
+HASHED_TYPES = ['css', 'js']
+
+# Short content hash, for ETags and hashed names
+def content_hash(data):
+    return hashlib.sha256(data).hexdigest()[:8]
+
+# Point the pages at the hashed names, 'index.js' but not 'index.json' or 'myindex.js'
+def rewrite_references(data, names):
+    text = data.decode('utf-8')
+    for name, hashed_name in names.items():
+        text = re.sub(r'(?<![\w.-])' + re.escape(name) + r'(?![\w.-])', hashed_name, text)
+    return text.encode('utf-8')
+
+# The manifest of everything that was compressed, smallest first as the firmware keeps assets in RAM in this order
+def write_manifest(compressed, data_dir_path):
+    hashed_names = {}
+    for file in compressed:
+        name = os.path.basename(file)
+        stem, extension = os.path.splitext(name)
+        if extension[1:] in HASHED_TYPES:
+            with open(file, 'rb') as src:
+                hashed_names[name] = stem + '.' + content_hash(src.read()) + extension
+
+    assets = []
+    for file in compressed:
+        name = os.path.basename(file)
+        extension = os.path.splitext(name)[1][1:]
+        with open(file, 'rb') as src:
+            data = src.read()
+        if extension == 'html':
+            data = rewrite_references(data, hashed_names)
+        target_file_path = os.path.join(data_dir_path, name + '.gz')
+        with open(target_file_path, 'wb') as dst:
+            dst.write(gzip.compress(data, 9, mtime=0)) # no timestamp, the same content gives the same image
+        print('GZIP: Compressed ' + target_file_path)
+
+        asset = {'file': '/' + name + '.gz', 'type': CONTENT_TYPES.get(extension, 'application/octet-stream'),
+                 'etag': content_hash(data), 'size': os.path.getsize(target_file_path)}
+        assets.append(dict(asset, path='/' + name, immutable=False))
+        if name in hashed_names:
+            assets.append(dict(asset, path='/' + hashed_names[name], immutable=True))
+
+    assets.sort(key=lambda asset: (asset['size'], asset['path']))
+    with open(os.path.join(data_dir_path, MANIFEST_NAME), 'w') as dst:
+        json.dump({'assets': assets}, dst, separators=(',', ':'))
+    print('GZIP: Wrote ' + MANIFEST_NAME + ' with ' + str(len(assets)) + ' assets')
 
 # Compress the files defined in 'build/web/' into '.pio/build/littlefs/'
 def gzip_webfiles(source, target, env):
@@ -47,7 +95,8 @@ def gzip_webfiles(source, target, env):
         files_to_gzip_and_copy.extend(glob.glob(os.path.join(web_dir_path, '*.' + extension)))
 
     all_files = glob.glob(os.path.join(web_dir_path, '*.*'))
-    files_to_copy = list(set(all_files) - set(files_to_only_gzip))
+    files_to_copy = [file for file in set(all_files) - set(files_to_only_gzip)
+                     if os.path.basename(file) != MANIFEST_NAME]
 
     for file in files_to_copy:
         print('GZIP: Copying file: ' + file + ' to the data directory')
@@ -56,14 +105,10 @@ def gzip_webfiles(source, target, env):
     # Compress and move the files
     was_error = False
     try:
-        for source_file_path in list(set(files_to_only_gzip) | set(files_to_gzip_and_copy)):
-            base_file_path = source_file_path
-            target_file_path = os.path.join(data_dir_path, os.path.basename(base_file_path) + '.gz')
-            print('GZIP: Compressed ' + target_file_path)
-            gzip_file(source_file_path, target_file_path)
+        write_manifest(sorted(set(files_to_only_gzip) | set(files_to_gzip_and_copy)), data_dir_path)
     except IOError as e:
         was_error = True
-        print('GZIP: Failed to compress the file: ' + source_file_path)
+        print('GZIP: Failed to compress the files: ' + str(e))
 
     if was_error:
         print('GZIP: Failed/Incomplete.\n')
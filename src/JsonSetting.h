@@ -29,8 +29,8 @@ class JsonSetting {
     JsonSettingType type;
 
     String strDefault;
-    int intDefault;
-    float floatDefault;
+    int intDefault = 0;
+    float floatDefault = 0;
     std::vector<int> intVectorDefault;
 
     String intVectorToString(const std::vector<int> &vec);
@@ -38,5 +38,17 @@ class JsonSetting {
     String lastValidationError;
     bool validateIntVector(String str);
 
+    // Current value, cached by JsonSettings so reads never touch NVS
+    String strValue;
+    int intValue = 0;
+    float floatValue = 0;
+    std::vector<int> intVectorValue;
+    bool dirty = false; // changed since it was last written to NVS
+
+    // Value in NVS, or the default while NVS has none, writing it again would only wear the flash
+    String storedStrValue;
+    int storedIntValue = 0;
+    float storedFloatValue = 0;
+
     friend class JsonSettings;
 };
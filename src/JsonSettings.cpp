@@ -1,34 +1,11 @@
 #include "JsonSettings.h"
 
+#include "SplitFlapTrace.h"
+
 #include <ArduinoJson.h>
 #include <sstream>
 
-String JsonSettings::getString(const char *key) {
-    preferences.begin(name, true);
-    String value = preferences.getString(key, this->find(key).strDefault);
-    preferences.end();
-    return value;
-}
-
-int JsonSettings::getInt(const char *key) {
-    preferences.begin(name, true);
-    int value = preferences.getInt(key, this->find(key).intDefault);
-    preferences.end();
-    return value;
-}
-
-float JsonSettings::getFloat(const char *key) {
-    preferences.begin(name, true);
-    float value = preferences.getFloat(key, this->find(key).floatDefault);
-    preferences.end();
-    return value;
-}
-
-std::vector<int> JsonSettings::getIntVector(const char *key) {
-    preferences.begin(name, true);
-    String value = preferences.getString(key, this->find(key).strDefault);
-    preferences.end();
-
+static std::vector<int> parseIntVector(const String &value) {
     std::vector<int> intVector;
     std::istringstream stream(value.c_str());
     std::string token;
@@ -44,22 +21,48 @@ std::vector<int> JsonSettings::getIntVector(const char *key) {
     return intVector;
 }
 
+String JsonSettings::getString(const char *key) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return find(key).strValue;
+}
+
+int JsonSettings::getInt(const char *key) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return find(key).intValue;
+}
+
+float JsonSettings::getFloat(const char *key) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return find(key).floatValue;
+}
+
+std::vector<int> JsonSettings::getIntVector(const char *key) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return find(key).intVectorValue;
+}
+
 void JsonSettings::putString(const char *key, String value) {
-    preferences.begin(name, false);
-    preferences.putString(key, value);
-    preferences.end();
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    JsonSetting &setting = find(key);
+    bool changed = setting.strValue != value;
+    markDirty(setting, changed);
+    if (changed) {
+        setString(setting, value);
+    }
 }
 
 void JsonSettings::putInt(const char *key, int value) {
-    preferences.begin(name, false);
-    preferences.putInt(key, value);
-    preferences.end();
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    JsonSetting &setting = find(key);
+    markDirty(setting, setting.intValue != value);
+    setting.intValue = value;
 }
 
 void JsonSettings::putFloat(const char *key, float value) {
-    preferences.begin(name, false);
-    preferences.putFloat(key, value);
-    preferences.end();
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    JsonSetting &setting = find(key);
+    markDirty(setting, setting.floatValue != value);
+    setting.floatValue = value;
 }
 
 void JsonSettings::putIntVector(const char *key, std::vector<int> value) {
@@ -74,9 +77,10 @@ void JsonSettings::putIntVector(const char *key, std::vector<int> value) {
 }
 
 JsonDocument JsonSettings::toJson() {
-    JsonDocument settings;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    load();
 
-    preferences.begin(name, true);
+    JsonDocument settings;
 
     for (const auto &pair : map) {
         const String &key = pair.first;
@@ -84,26 +88,21 @@ JsonDocument JsonSettings::toJson() {
 
         switch (setting.type) {
             case JsonSettingType::JST_STR:
-            case JsonSettingType::JST_INT_VECTOR:
-                settings[key] = preferences.getString(key.c_str(), setting.strDefault);
-                break;
-            case JsonSettingType::JST_INT: settings[key] = preferences.getInt(key.c_str(), setting.intDefault); break;
-            case JsonSettingType::JST_FLOAT:
-                settings[key] = preferences.getFloat(key.c_str(), setting.floatDefault);
-                break;
+            case JsonSettingType::JST_INT_VECTOR: settings[key] = setting.strValue; break;
+            case JsonSettingType::JST_INT: settings[key] = setting.intValue; break;
+            case JsonSettingType::JST_FLOAT: settings[key] = setting.floatValue; break;
         }
     }
 
-    preferences.end();
     return settings;
 }
 
 bool JsonSettings::fromJson(JsonDocument settings) {
-    preferences.begin(name, false);
+    std::lock_guard<std::recursive_mutex> guard(lock);
 
     for (JsonPair kv : settings.as<JsonObject>()) {
         const char *key = kv.key().c_str();
-        JsonSetting setting = this->find(key);
+        JsonSetting &setting = this->find(key);
 
         if (! setting.validate(kv.value().as<String>())) {
             lastValidationError = setting.getLastValidationError();
@@ -113,26 +112,193 @@ bool JsonSettings::fromJson(JsonDocument settings) {
 
         switch (setting.type) {
             case JsonSettingType::JST_INT_VECTOR:
-            case JsonSettingType::JST_STR: preferences.putString(key, kv.value().as<String>()); break;
-            case JsonSettingType::JST_INT: preferences.putInt(key, kv.value().as<int>()); break;
-            case JsonSettingType::JST_FLOAT: preferences.putFloat(key, kv.value().as<float>()); break;
+            case JsonSettingType::JST_STR: {
+                String value = kv.value().as<String>();
+                bool changed = setting.strValue != value;
+                markDirty(setting, changed);
+                if (changed) {
+                    setString(setting, value);
+                }
+                break;
+            }
+            case JsonSettingType::JST_INT: {
+                int value = kv.value().as<int>();
+                markDirty(setting, setting.intValue != value);
+                setting.intValue = value;
+                break;
+            }
+            case JsonSettingType::JST_FLOAT: {
+                float value = kv.value().as<float>();
+                markDirty(setting, setting.floatValue != value);
+                setting.floatValue = value;
+                break;
+            }
         }
     }
 
-    preferences.end();
-
     return true;
 }
 
 bool JsonSettings::reset() {
-    preferences.begin("config", false);
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    preferences.begin(name, false);
     preferences.clear();
     preferences.end();
 
-    return fromJson(toJson());
+    // back to the defaults, which is what an empty NVS reads as, so there is nothing to write
+    for (auto &pair : map) {
+        JsonSetting &setting = pair.second;
+        setString(setting, setting.strDefault);
+        setting.intValue = setting.intDefault;
+        setting.floatValue = setting.floatDefault;
+        setting.dirty = false;
+        setStored(setting);
+    }
+    loaded = true;
+    dirty = false;
+
+    return true;
 }
 
-JsonSetting JsonSettings::find(const char *key) {
+void JsonSettings::tick() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (! dirty) {
+        return;
+    }
+
+    unsigned long currentTime = millis();
+    if (currentTime - lastChangeTime < SETTINGS_FLUSH_QUIET_MS &&
+        currentTime - firstChangeTime < SETTINGS_FLUSH_MAX_DELAY_MS) {
+        return; // more changes may be on the way, write them together
+    }
+    flush();
+}
+
+void JsonSettings::flush() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (! dirty) {
+        return;
+    }
+    dirty = false;
+    TRACE_SCOPE("settings.flush");
+
+    bool opened = false;
+    for (auto &pair : map) {
+        const char *key = pair.first.c_str();
+        JsonSetting &setting = pair.second;
+        if (! setting.dirty) {
+            continue;
+        }
+        setting.dirty = false;
+
+        if (isStored(setting)) {
+            stats.unchanged++; // changed and changed back before it was written
+            continue;
+        }
+
+        if (! opened) {
+            preferences.begin(name, false);
+            opened = true;
+            stats.commits++;
+        }
+
+        switch (setting.type) {
+            case JsonSettingType::JST_INT_VECTOR:
+            case JsonSettingType::JST_STR: preferences.putString(key, setting.strValue); break;
+            case JsonSettingType::JST_INT: preferences.putInt(key, setting.intValue); break;
+            case JsonSettingType::JST_FLOAT: preferences.putFloat(key, setting.floatValue); break;
+        }
+        setStored(setting);
+        stats.writes++;
+    }
+
+    if (opened) {
+        preferences.end();
+    }
+}
+
+bool JsonSettings::isDirty() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return dirty;
+}
+
+JsonSettingsStats JsonSettings::getStats() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return stats;
+}
+
+void JsonSettings::load() {
+    if (loaded) {
+        return;
+    }
+    loaded = true;
+
+    preferences.begin(name, true);
+
+    for (auto &pair : map) {
+        const char *key = pair.first.c_str();
+        JsonSetting &setting = pair.second;
+
+        switch (setting.type) {
+            case JsonSettingType::JST_STR:
+            case JsonSettingType::JST_INT_VECTOR:
+                setString(setting, preferences.getString(key, setting.strDefault));
+                break;
+            case JsonSettingType::JST_INT: setting.intValue = preferences.getInt(key, setting.intDefault); break;
+            case JsonSettingType::JST_FLOAT:
+                setting.floatValue = preferences.getFloat(key, setting.floatDefault);
+                break;
+        }
+        setStored(setting);
+    }
+
+    preferences.end();
+}
+
+void JsonSettings::setString(JsonSetting &setting, const String &value) {
+    setting.strValue = value;
+    if (setting.type == JsonSettingType::JST_INT_VECTOR) {
+        setting.intVectorValue = parseIntVector(value);
+    }
+}
+
+void JsonSettings::markDirty(JsonSetting &setting, bool changed) {
+    stats.updates++;
+    if (! changed) {
+        stats.unchanged++;
+        return;
+    }
+    if (setting.dirty) {
+        stats.coalesced++; // the value waiting to be written is replaced before it ever was
+    }
+
+    unsigned long currentTime = millis();
+    if (! dirty) {
+        firstChangeTime = currentTime;
+    }
+    lastChangeTime = currentTime;
+    setting.dirty = true;
+    dirty = true;
+}
+
+bool JsonSettings::isStored(const JsonSetting &setting) {
+    switch (setting.type) {
+        case JsonSettingType::JST_INT: return setting.intValue == setting.storedIntValue;
+        case JsonSettingType::JST_FLOAT: return setting.floatValue == setting.storedFloatValue;
+        default: return setting.strValue == setting.storedStrValue;
+    }
+}
+
+void JsonSettings::setStored(JsonSetting &setting) {
+    setting.storedStrValue = setting.strValue;
+    setting.storedIntValue = setting.intValue;
+    setting.storedFloatValue = setting.floatValue;
+}
+
+JsonSetting &JsonSettings::find(const char *key) {
+    load();
+
     auto it = this->map.find(key);
     if (it == this->map.end()) {
         throw std::runtime_error("Key not found in settings map");
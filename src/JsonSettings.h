@@ -6,7 +6,27 @@
 #include <ArduinoJson.h>
 #include <Preferences.h>
 #include <map>
+#include <mutex>
 
+#define SETTINGS_FLUSH_QUIET_MS      5000  // tick() writes once no value has changed for this long
+#define SETTINGS_FLUSH_MAX_DELAY_MS  60000 // or once a value has waited this long, when changes keep coming
+
+struct JsonSettingsStats
+{
+    unsigned long updates;   // values handed to put* and fromJson
+    unsigned long unchanged; // of those, values that ended up as they were in NVS and were never written
+    unsigned long coalesced; // of those, values replaced by a later update before they were written
+    unsigned long writes;    // values written to NVS
+    unsigned long commits;   // NVS sessions the writes were batched into
+};
+
+// Settings backed by NVS. Every value is read into RAM the first time any setting is used and served from there
+// afterwards, so get* costs a map lookup instead of an NVS open and read. put* and fromJson update the cached value
+// and mark it dirty, flush() writes the dirty values to NVS in one session. Call tick() from loop() to write them
+// behind the request that changed them, once the changes have quietened down.
+//
+// To spare the flash, a value that is set to what it already is never becomes dirty, and a dirty value that is back
+// to what NVS holds by the time it is flushed is not written.
 class JsonSettings {
   public:
     JsonSettings(const char *name, std::map<String, JsonSetting> map) : name(name), map(map) {}
@@ -25,6 +45,11 @@ class JsonSettings {
     bool fromJson(JsonDocument settings);
     bool reset();
 
+    void tick();             // write changed values to NVS after the quiet period, call from loop()
+    void flush();            // write changed values to NVS now, before a restart
+    bool isDirty();          // values changed since the last flush
+    JsonSettingsStats getStats();
+
     String getLastValidationError() { return lastValidationError; }
     String getLastValidationKey() { return lastValidationKey; }
 
@@ -35,7 +60,19 @@ class JsonSettings {
     String lastValidationError;
     String lastValidationKey;
 
-    JsonSetting find(const char *key);
+    std::recursive_mutex lock; // web handlers run in the async TCP task, loop() and the display read from the app task
+    bool loaded = false;
+    bool dirty = false;        // any value is dirty
+    unsigned long firstChangeTime = 0; // millis() when the oldest dirty value changed
+    unsigned long lastChangeTime = 0;  // millis() when the newest dirty value changed
+    JsonSettingsStats stats = {};
+
+    JsonSetting &find(const char *key);
+    void load();               // read every value from NVS, once
+    void setString(JsonSetting &setting, const String &value);
+    void markDirty(JsonSetting &setting, bool changed); // count an update, and mark it for writing if it changed
+    bool isStored(const JsonSetting &setting);          // the value matches what NVS holds
+    void setStored(JsonSetting &setting);
 
     Preferences preferences;
 };
@@ -0,0 +1,111 @@
+#include "SplitFlapAssets.h"
+
+#include "SplitFlapLog.h"
+
+#include <ArduinoJson.h>
+
+bool SplitFlapAssets::load(fs::FS &fs, const char *manifest) {
+    File file = fs.open(manifest, "r");
+    if (! file) {
+        return false;
+    }
+    JsonDocument json;
+    DeserializationError error = deserializeJson(json, file);
+    file.close();
+    if (error) {
+        LOG_WARN("Failed to parse %s: %s", manifest, error.c_str());
+        return false;
+    }
+
+    this->fs = &fs;
+    assets.clear();
+    ramBytes = 0;
+    for (JsonObject entry : json["assets"].as<JsonArray>()) {
+        WebAsset asset;
+        asset.path = entry["path"].as<String>();
+        asset.file = entry["file"].as<String>();
+        asset.contentType = entry["type"].as<String>();
+        asset.etag = "\"" + entry["etag"].as<String>() + "\"";
+        asset.immutable = entry["immutable"] | false;
+        asset.size = entry["size"] | 0;
+        asset.cached = -1;
+        asset.hits = 0;
+        assets.push_back(asset);
+    }
+
+    // Smallest first in the manifest, so the budget holds as many assets as it can
+    for (int i = 0; i < (int) assets.size(); i++) {
+        cache(i);
+    }
+    LOG_INFO("Web assets: %d from %s, %u bytes in RAM", (int) assets.size(), manifest, (unsigned) ramBytes);
+    return ! assets.empty();
+}
+
+void SplitFlapAssets::cache(int index) {
+    WebAsset &asset = assets[index];
+    for (int i = 0; i < index; i++) {
+        if (assets[i].file == asset.file) {
+            asset.cached = assets[i].cached; // the hashed and the stable name of one file
+            return;
+        }
+    }
+    if (asset.size > ASSET_RAM_MAX_SIZE || ramBytes + asset.size > ASSET_RAM_BUDGET) {
+        return;
+    }
+
+    File file = fs->open(asset.file, "r");
+    if (! file) {
+        LOG_WARN("Web asset %s is missing", asset.file.c_str());
+        return;
+    }
+    asset.data.resize(file.size());
+    size_t read = file.read(asset.data.data(), asset.data.size());
+    file.close();
+    if (read != asset.data.size()) {
+        asset.data.clear();
+        return;
+    }
+    ramBytes += asset.data.size();
+    asset.cached = index;
+}
+
+int SplitFlapAssets::find(const String &path) const {
+    for (int i = 0; i < (int) assets.size(); i++) {
+        if (assets[i].path == path) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool SplitFlapAssets::canHandle(AsyncWebServerRequest *request) const {
+    return request->method() == HTTP_GET && find(request->url()) >= 0;
+}
+
+void SplitFlapAssets::handleRequest(AsyncWebServerRequest *request) {
+    int index = find(request->url());
+    if (index < 0) {
+        return request->send(404);
+    }
+    WebAsset &asset = assets[index];
+    asset.hits++;
+
+    // The ETag is the content hash, so a match means the browser already has these bytes
+    AsyncWebServerResponse *response;
+    if (request->hasHeader("If-None-Match") && request->header("If-None-Match").indexOf(asset.etag) >= 0) {
+        stats.notModified++;
+        response = request->beginResponse(304);
+    } else if (asset.cached >= 0) {
+        stats.ramHits++;
+        const std::vector<uint8_t> &data = assets[asset.cached].data;
+        response = request->beginResponse(200, asset.contentType.c_str(), data.data(), data.size());
+        response->addHeader("Content-Encoding", "gzip");
+    } else {
+        stats.fileHits++;
+        response = request->beginResponse(*fs, asset.file, asset.contentType.c_str());
+        response->addHeader("Content-Encoding", "gzip");
+    }
+    response->addHeader("ETag", asset.etag.c_str());
+    response->addHeader("Cache-Control", asset.immutable ? ASSET_CACHE_IMMUTABLE : ASSET_CACHE_REVALIDATE);
+    request->send(response);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <FS.h>
+#include <vector>
+
+#define ASSET_MANIFEST     "/assets.json" // written next to the .gz files by build/scripts/gzip_littlefs.py
+#define ASSET_RAM_MAX_SIZE 8192           // compressed bytes, larger assets are always read from the filesystem
+#define ASSET_RAM_BUDGET   16384          // compressed bytes kept in RAM over all assets
+
+// Hashed names never change content, stable names are kept by the browser but checked with If-None-Match each time
+#define ASSET_CACHE_IMMUTABLE  "public, max-age=31536000, immutable"
+#define ASSET_CACHE_REVALIDATE "no-cache"
+
+// One file of the web interface as listed in the manifest. Hashed and stable names of the same file share its
+// compressed content.
+struct WebAsset
+{
+    String path;         // URL
+    String file;         // gzipped file on the filesystem
+    String contentType;
+    String etag;         // quoted content hash
+    bool immutable;      // served under a hashed name
+    size_t size;         // compressed
+    int cached;          // index of the asset holding the content in RAM, -1 when it is read from the filesystem
+    std::vector<uint8_t> data;
+    unsigned long hits;
+};
+
+struct WebAssetStats
+{
+    unsigned long ramHits;     // answered from RAM
+    unsigned long fileHits;    // answered from the filesystem
+    unsigned long notModified; // answered 304, the browser's copy was current
+};
+
+// Serves the web interface from the build's manifest with one handler instead of a serveStatic per file. Every
+// response carries the content hash as its ETag, a matching If-None-Match gets a 304 without touching the
+// filesystem, and the smallest assets are read into RAM once at boot.
+class SplitFlapAssets : public AsyncWebHandler {
+  public:
+    bool load(fs::FS &fs, const char *manifest = ASSET_MANIFEST); // false without a manifest, nothing is served then
+
+    bool canHandle(AsyncWebServerRequest *request) const override;
+    void handleRequest(AsyncWebServerRequest *request) override;
+
+    const std::vector<WebAsset> &getAssets() const { return assets; }
+    WebAssetStats getStats() const { return stats; }
+    size_t getRamBytes() const { return ramBytes; }
+
+  private:
+    fs::FS *fs = nullptr;
+    std::vector<WebAsset> assets;
+    WebAssetStats stats = {};
+    size_t ramBytes = 0;
+
+    int find(const String &path) const; // index of the asset served at path, -1 if there is none
+    void cache(int index); // reads the asset into RAM if it fits the budget, or shares a copy already read
+};
@@ -0,0 +1,329 @@
+#include "SplitFlapBus.h"
+
+#include "SplitFlapLog.h"
+#include "SplitFlapTrace.h"
+
+#include <algorithm>
+
+void SplitFlapBus::begin(int sdaPin, int sclPin, uint32_t clock) {
+    wire.begin(sdaPin, sclPin);
+    setClock(clock);
+    windowStartTime = micros();
+}
+
+void SplitFlapBus::setClock(uint32_t newClock) {
+    clock = newClock;
+    wire.setClock(clock);
+}
+
+int SplitFlapBus::attach(int address) {
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (devices[i].address == address) {
+            return i;
+        }
+    }
+
+    Device device = {};
+    device.address = address;
+    device.deviceAddress = getDeviceAddress(address);
+    device.channel = getChannel(address);
+    hasMux = hasMux || device.channel != BUS_MUX_NONE;
+    devices.push_back(device);
+    pendingSlots.reserve(devices.size());
+    return devices.size() - 1;
+}
+
+int SplitFlapBus::getDefaultAddress(int module, int count) {
+    if (count <= BUS_EXPANDERS) {
+        return 0x20 + module;
+    }
+    return getMuxAddress(module / BUS_EXPANDERS, 0x20 + module % BUS_EXPANDERS);
+}
+
+bool SplitFlapBus::isValidAddress(int address) {
+    if (address >= BUS_MUX_BASE) {
+        return getChannel(address) < BUS_MUX_CHANNELS && getDeviceAddress(address) >= 0x08;
+    }
+    return address >= 0x08 && address < 100;
+}
+
+String SplitFlapBus::formatAddress(int address) {
+    if (getChannel(address) == BUS_MUX_NONE) {
+        return String(address);
+    }
+    return String(getDeviceAddress(address)) + " on channel " + String(getChannel(address));
+}
+
+void SplitFlapBus::write(int slot, uint16_t data) {
+    std::lock_guard<std::mutex> guard(lock);
+    Device &device = devices[slot];
+    stats.writes++;
+
+    if (batching) {
+        if (! device.hasPending) {
+            pendingSlots.push_back(slot);
+        }
+        device.pending = data;
+        device.hasPending = true;
+        return;
+    }
+
+    if (device.shadowValid && device.shadow == data) {
+        stats.droppedWrites++;
+        return;
+    }
+    transmit(device, data);
+}
+
+void SplitFlapBus::flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    batching = false;
+
+    // Only the devices written in this batch, and channel by channel so the multiplexer switches once per channel
+    if (hasMux && pendingSlots.size() > 1) {
+        std::sort(pendingSlots.begin(), pendingSlots.end(), [this](int a, int b) {
+            return devices[a].channel != devices[b].channel ? devices[a].channel < devices[b].channel : a < b;
+        });
+    }
+
+    for (int slot : pendingSlots) {
+        Device &device = devices[slot];
+        device.hasPending = false;
+
+        if (device.shadowValid && device.shadow == device.pending) {
+            stats.droppedWrites++;
+            continue;
+        }
+        transmit(device, device.pending);
+    }
+    pendingSlots.clear();
+
+    rollWindow();
+}
+
+bool SplitFlapBus::selectChannel(int channel) {
+    if (channel == openChannel || (channel == BUS_MUX_NONE && ! hasMux)) {
+        return true; // without a multiplexer there is nothing to close
+    }
+    hasMux = true; // probing can come before the devices are attached
+
+    unsigned long start = micros();
+    wire.beginTransmission(BUS_MUX_ADDRESS);
+    wire.write(channel == BUS_MUX_NONE ? 0 : 1 << channel); // one bit per channel, none so plain addresses are unique
+    uint8_t error = wire.endTransmission();
+
+    stats.busyUs += micros() - start;
+    stats.transactions++;
+    stats.muxSelects++;
+    if (error > 0) {
+        stats.errors++;
+        openChannel = BUS_MUX_UNKNOWN; // switch again before the next transaction
+        return false;
+    }
+    openChannel = channel;
+    return true;
+}
+
+void SplitFlapBus::transmit(Device &device, uint16_t data) {
+    selectChannel(device.channel);
+    unsigned long start = micros();
+
+    wire.beginTransmission(device.deviceAddress);
+    wire.write(data & 0xFF);        // Send lower byte
+    wire.write((data >> 8) & 0xFF); // Send upper byte
+    uint8_t error = wire.endTransmission();
+
+    stats.busyUs += micros() - start;
+    stats.transactions++;
+
+    // Only trust the shadow while the expander acknowledges, so a failed write is retried by the next one
+    device.shadow = data;
+    device.shadowValid = error == 0;
+    recordResult(device, error);
+}
+
+void SplitFlapBus::recordResult(Device &device, uint8_t error) {
+    if (error > 0) {
+        stats.errors++;
+        device.errors++;
+        device.consecutiveErrors++;
+        device.lastError = error;
+        device.errored = true;
+    } else {
+        if (device.consecutiveErrors > 0) {
+            device.recoveries++;
+        }
+        device.consecutiveErrors = 0;
+        device.errored = false;
+    }
+}
+
+bool SplitFlapBus::read(int slot, uint16_t &data) {
+    std::lock_guard<std::mutex> guard(lock);
+    Device &device = devices[slot];
+    selectChannel(device.channel);
+    unsigned long start = micros();
+
+    uint8_t requestBytes = 2;
+    wire.requestFrom(device.deviceAddress, requestBytes);
+    // Make sure the data is available
+    bool received = wire.available() == 2;
+    if (received) {
+        data = wire.read();         // Read the lower byte
+        data |= (wire.read() << 8); // Read the upper byte and shift it left
+    } else {
+        stats.errors++;
+    }
+
+    stats.busyUs += micros() - start;
+    stats.transactions++;
+    stats.reads++;
+    return received;
+}
+
+bool SplitFlapBus::probe(int address) {
+    TRACE_SCOPE("bus.probe", address);
+    std::lock_guard<std::mutex> guard(lock); // the channel it leaves open is recorded before the next batch goes out
+    if (! selectChannel(getChannel(address))) {
+        return false; // the multiplexer itself does not answer
+    }
+
+    // Try to communicate with the module by requesting 2 bytes
+    uint8_t deviceAddress = getDeviceAddress(address);
+    wire.beginTransmission(deviceAddress);
+    byte error = wire.endTransmission();
+
+    // error codes:
+    // 0: success
+    // 1: data too long to fit in transmit buffer
+    // 2: received NACK on transmit of address
+    // 3: received NACK on transmit of data
+    // 4: other error
+    // 5: timeout
+
+    if (error == 0) {
+        // Module responded, try reading some data to verify full communication
+        wire.requestFrom(deviceAddress, (uint8_t) 2);
+        if (wire.available() == 2) {
+            wire.read(); // Read and discard
+            wire.read(); // Read and discard
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool SplitFlapBus::probeAll() {
+    for (Device &device : devices) {
+        if (! probe(device.address)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SplitFlapBus::reportErrors() {
+    for (Device &device : devices) {
+        if (device.errored && ! device.reportedErrored) {
+            LOG_WARN("Error writing data to module %s, error code: %d", formatAddress(device.address).c_str(),
+                     (int) device.lastError);
+            // Error codes:
+            // 0 = success
+            // 1 = data too long to fit in transmit buffer
+            // 2 = received NACK on transmit of address
+            // 3 = received NACK on transmit of data
+            // 4 = other error
+        }
+
+        if (device.consecutiveErrors >= BUS_ERROR_THRESHOLD && ! device.reportedPersistent) {
+            LOG_ERROR("Module %s has persistent I2C errors", formatAddress(device.address).c_str());
+            device.reportedPersistent = true;
+        }
+
+        if (! device.errored && device.reportedErrored) {
+            LOG_INFO("Module %s communication recovered", formatAddress(device.address).c_str());
+            device.reportedPersistent = false;
+        }
+
+        device.reportedErrored = device.errored;
+    }
+}
+
+SplitFlapBusStats SplitFlapBus::getWindowStats() {
+    rollWindow();
+    return lastWindow;
+}
+
+void SplitFlapBus::rollWindow() {
+    unsigned long now = micros();
+    if (now - windowStartTime < BUS_STATS_WINDOW_US) {
+        return;
+    }
+
+    lastWindow.transactions = stats.transactions - windowStart.transactions;
+    lastWindow.writes = stats.writes - windowStart.writes;
+    lastWindow.droppedWrites = stats.droppedWrites - windowStart.droppedWrites;
+    lastWindow.reads = stats.reads - windowStart.reads;
+    lastWindow.errors = stats.errors - windowStart.errors;
+    lastWindow.busyUs = stats.busyUs - windowStart.busyUs;
+    lastWindow.muxSelects = stats.muxSelects - windowStart.muxSelects;
+    lastWindowUs = now - windowStartTime; // longer than the window when nothing rolled it on time
+
+    windowStart = stats;
+    windowStartTime = now;
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+
+void SplitFlapBus::startTask() {
+    if (task != nullptr) {
+        return;
+    }
+    flushed = xSemaphoreCreateBinary();
+    xTaskCreate(taskEntry, "bus", BUS_TASK_STACK, this, BUS_TASK_PRIORITY, &task);
+}
+
+void SplitFlapBus::flushAsync() {
+    if (task == nullptr) {
+        flush();
+        return;
+    }
+    flushing = true;
+    xTaskNotifyGive(task);
+}
+
+void SplitFlapBus::waitFlush() {
+    if (flushing) {
+        xSemaphoreTake(flushed, portMAX_DELAY);
+        flushing = false;
+    }
+}
+
+void SplitFlapBus::taskEntry(void *arg) {
+    SplitFlapBus *bus = static_cast<SplitFlapBus *>(arg);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // the caller's own notifications are left alone
+        bus->flush();
+        xSemaphoreGive(bus->flushed);
+    }
+}
+
+#else
+
+// No FreeRTOS on the host, the flush runs straight away on a timeline of its own and waitFlush() moves the clock to
+// whichever of the two controllers finished last
+
+void SplitFlapBus::startTask() {}
+
+void SplitFlapBus::flushAsync() {
+    host::beginConcurrent();
+    flush();
+    host::endConcurrent();
+}
+
+void SplitFlapBus::waitFlush() {
+    host::joinConcurrent();
+}
+
+#endif
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <mutex>
+#include <vector>
+
+// I2C clock rates
+#define I2C_STANDARD_CLOCK   100000
+#define I2C_FAST_CLOCK       400000
+#define I2C_FAST_PLUS_CLOCK  1000000 // only when every expander and the wiring keep up, checked at begin
+
+#define BUS_STATS_WINDOW_US  1000000 // transactions per second and utilisation are measured over this window
+#define BUS_ERROR_THRESHOLD  3       // consecutive errors before a module is reported as persistently failing
+
+// TCA9548A multiplexer, for more expanders than the eight PCF8575 addresses. Addresses of 1000 and up are behind it:
+// 1000 + channel * 100 + address, so 1032 is the expander at 32 (0x20) on channel 0 and 1739 the one at 39 (0x27) on
+// channel 7. Expanders wired straight to the bus keep their plain address.
+#ifndef BUS_MUX_ADDRESS
+#define BUS_MUX_ADDRESS      0x70    // A0-A2 low
+#endif
+#define BUS_MUX_BASE         1000
+#define BUS_MUX_CHANNELS     8
+#define BUS_MUX_NONE         -1      // channel of an expander wired straight to the bus
+#define BUS_MUX_UNKNOWN      -2      // open channel before the first switch, or after one failed
+#define BUS_EXPANDERS        8       // PCF8575 addresses, 0x20 to 0x27
+
+#define MAX_BUSES            SOC_I2C_NUM // I2C controllers, 2 on the ESP32 and ESP32-S3, 1 on the ESP32-C3
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define BUS_TASK_PRIORITY    20      // same as the motion task, which waits for it every tick
+#define BUS_TASK_STACK       2048
+#endif
+
+struct SplitFlapBusStats
+{
+    unsigned long transactions;  // I2C transactions on the wire, writes and reads
+    unsigned long writes;        // writes handed to the bus by the modules
+    unsigned long droppedWrites; // writes that matched the shadow and never reached the wire
+    unsigned long reads;
+    unsigned long errors;
+    unsigned long busyUs;        // time spent inside Wire calls
+    unsigned long muxSelects;    // of the transactions, writes switching the multiplexer to another channel
+};
+
+// Transaction layer for the PCF8575 expanders. Keeps a shadow of every expander's outputs so writes that would not
+// change anything never reach the wire, and while a batch is open collects the writes so they go out in one burst
+// when it is flushed. Errors are recorded here and printed later from loop() by reportErrors(), keeping Serial out
+// of the stepping path.
+//
+// With a second controller, the motion engine flushes both buses every tick. startTask() gives a bus a task of its
+// own, then flushAsync() hands the batch to that task and returns straight away so the caller can flush the other bus
+// meanwhile, and waitFlush() waits for it. Each controller clocks its own transfers, so the two overlap. Without the
+// task flushAsync() flushes before returning.
+//
+// Expanders behind a multiplexer are reached by switching it to their channel first. The bus remembers the open
+// channel so consecutive transactions on it cost nothing extra, and a flush sends the held back writes channel by
+// channel, so a tick costs one switch per channel with work on it rather than one per expander.
+//
+// Every transaction holds the bus lock, so a probe from the web server in the middle of a move cannot switch the
+// multiplexer or use Wire under the motion task's feet.
+class SplitFlapBus {
+  public:
+    SplitFlapBus(TwoWire &wire = Wire) : wire(wire) {}
+
+    void begin(int sdaPin, int sclPin, uint32_t clock);
+    void setClock(uint32_t clock);
+    uint32_t getClock() const { return clock; }
+
+    int attach(int address);                 // register an expander, returns its slot
+    void write(int slot, uint16_t data);     // dropped if already on the outputs, held back while a batch is open
+    bool read(int slot, uint16_t &data);
+    bool probe(int address);                 // address and read an expander, true if it answers
+    bool probeAll();                         // probe every attached expander
+
+    void beginBatch() { batching = true; }
+    void flush();                            // write everything held back in one burst and close the batch
+    bool hasPending() const { return ! pendingSlots.empty(); }
+    void startTask();
+    void flushAsync();                       // flush from the bus task, call waitFlush() before the next batch
+    void waitFlush();
+
+    bool hasErrored(int slot) const { return devices[slot].errored; }
+    unsigned long getErrors(int slot) const { return devices[slot].errors; } // failed writes since boot
+    unsigned long getRecoveries(int slot) const { return devices[slot].recoveries; } // successes after a failure
+    void reportErrors();                     // print modules that started or stopped failing since the last call
+
+    const SplitFlapBusStats &getStats() const { return stats; } // totals since boot
+    SplitFlapBusStats getWindowStats();      // totals over the last complete stats window
+    unsigned long getWindowUs() const { return lastWindowUs; } // length of that window
+
+    static int getChannel(int address) {
+        return address >= BUS_MUX_BASE ? (address - BUS_MUX_BASE) / 100 : BUS_MUX_NONE;
+    }
+    static uint8_t getDeviceAddress(int address) { return address >= BUS_MUX_BASE ? address % 100 : address; }
+    static int getMuxAddress(int channel, uint8_t address) { return BUS_MUX_BASE + channel * 100 + address; }
+    static int getDefaultAddress(int module, int count); // 0x20 up, spread over the multiplexer past BUS_EXPANDERS
+    static bool isValidAddress(int address);
+    static String formatAddress(int address); // "32", or "32 on channel 0" behind the multiplexer
+
+  private:
+    struct Device
+    {
+        int address;           // as given to attach, with the channel
+        uint8_t deviceAddress; // on the wire
+        int channel;           // multiplexer channel, BUS_MUX_NONE when wired straight to the bus
+        uint16_t shadow;       // last value the expander acknowledged
+        bool shadowValid;
+        uint16_t pending;      // value held back by an open batch
+        bool hasPending;
+        int consecutiveErrors;
+        unsigned long errors;     // failed writes since boot
+        unsigned long recoveries; // writes that went through after one or more failed
+        uint8_t lastError;
+        bool errored;          // failed the last transaction
+        bool reportedErrored;  // state printed by the last reportErrors()
+        bool reportedPersistent;
+    };
+
+    TwoWire &wire;
+    uint32_t clock = I2C_FAST_CLOCK;
+    std::vector<Device> devices;
+    std::vector<int> pendingSlots;           // devices holding a write back in the open batch
+    bool batching = false;
+    bool hasMux = false;                     // any device behind the multiplexer
+    int openChannel = BUS_MUX_UNKNOWN;   // channel the multiplexer is switched to
+    std::mutex lock;                         // Wire, openChannel and the batch, for the motion, bus and web tasks
+
+    SplitFlapBusStats stats = {};
+    SplitFlapBusStats windowStart = {};      // totals when the current window started
+    SplitFlapBusStats lastWindow = {};
+    unsigned long lastWindowUs = 0;
+    unsigned long windowStartTime = 0;
+
+    bool selectChannel(int channel);         // switch the multiplexer, closing every channel for BUS_MUX_NONE
+    void transmit(Device &device, uint16_t data);
+    void recordResult(Device &device, uint8_t error);
+    void rollWindow();
+
+#ifdef ARDUINO_ARCH_ESP32
+    TaskHandle_t task = nullptr;
+    SemaphoreHandle_t flushed = nullptr;     // given by the task when the batch is out
+    bool flushing = false;                   // a batch was handed to the task and not waited for yet
+
+    static void taskEntry(void *bus);
+#endif
+};
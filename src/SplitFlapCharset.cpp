@@ -0,0 +1,260 @@
+#include "SplitFlapCharset.h"
+
+#include <ArduinoJson.h>
+#include <algorithm>
+#include <vector>
+
+// Array of characters, in order, the first item is located on the magnet on the
+// character drum
+static constexpr char StandardChars[] = {' ', 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L',
+                                         'M', 'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y',
+                                         'Z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
+
+static constexpr char ExtendedChars[] = {
+    ' ', 'A', 'B', 'C', 'D', 'E',  'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+    'P', 'Q', 'R', 'S', 'T', 'U',  'V', 'W', 'X', 'Y', 'Z', '0', '1', '2', '3', '4',
+    '5', '6', '7', '8', '9', '\'', ':', '?', '!', '.', '-', '/', '$', '@', '#', '%',
+};
+
+static_assert(sizeof(StandardChars) == 37, "standard drum has 37 flaps");
+static_assert(sizeof(ExtendedChars) == 48, "extended drum has 48 flaps");
+
+constexpr SplitFlapCharset StandardCharset = {
+    StandardChars, sizeof(StandardChars), CHARSET_INDEX_256(StandardChars, sizeof(StandardChars)), nullptr, 0, nullptr, 0
+};
+
+constexpr SplitFlapCharset ExtendedCharset = {
+    ExtendedChars, sizeof(ExtendedChars), CHARSET_INDEX_256(ExtendedChars, sizeof(ExtendedChars)), nullptr, 0, nullptr, 0
+};
+
+// Drum described by CHARSET_FILE, filled in by loadCustomCharset
+static char customChars[CHARSET_MAX_FLAPS];
+static uint16_t customPositions[CHARSET_MAX_FLAPS];
+static uint32_t customGlyphs[CHARSET_MAX_GLYPHS];
+static SplitFlapCharset CustomCharset = {customChars, 0, {}, nullptr, 0, customGlyphs, 0};
+static bool customLoaded = false;
+
+static_assert(StandardCharset.index[(uint8_t) 'a'] == 1, "lower case shares the upper case flap");
+static_assert(ExtendedCharset.index[(uint8_t) '%'] == 47, "last flap of the extended drum");
+static_assert(StandardCharset.index[(uint8_t) '%'] == CHARSET_UNKNOWN, "not on the standard drum");
+
+const SplitFlapCharset &getCharset(int charset) {
+    if (charset == CHARSET_CUSTOM && customLoaded) {
+        return CustomCharset;
+    }
+    return charset == 48 ? ExtendedCharset : StandardCharset;
+}
+
+#define MALFORMED_UTF8 0xFFFFFFFF
+
+// Code point of the UTF-8 character at p, which is moved past it. Malformed bytes are skipped one at a time.
+static uint32_t nextCodePoint(const char *&p, const char *end) {
+    uint8_t lead = *p++;
+    int length = lead < 0x80 ? 0 : (lead >> 5) == 0x6 ? 1 : (lead >> 4) == 0xE ? 2 : (lead >> 3) == 0x1E ? 3 : -1;
+    if (length < 0 || end - p < length) {
+        return MALFORMED_UTF8;
+    }
+
+    uint32_t codePoint = length == 0 ? lead : lead & (0x3F >> length);
+    for (int i = 0; i < length; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return MALFORMED_UTF8;
+        }
+        codePoint = (codePoint << 6) | (p[i] & 0x3F);
+    }
+    p += length;
+    return codePoint;
+}
+
+static void appendUtf8(String &text, uint32_t codePoint) {
+    if (codePoint < 0x80) {
+        text += (char) codePoint;
+    } else if (codePoint < 0x800) {
+        text += (char) (0xC0 | (codePoint >> 6));
+        text += (char) (0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+        text += (char) (0xE0 | (codePoint >> 12));
+        text += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        text += (char) (0x80 | (codePoint & 0x3F));
+    } else {
+        text += (char) (0xF0 | (codePoint >> 18));
+        text += (char) (0x80 | ((codePoint >> 12) & 0x3F));
+        text += (char) (0x80 | ((codePoint >> 6) & 0x3F));
+        text += (char) (0x80 | (codePoint & 0x3F));
+    }
+}
+
+static int codeOf(uint32_t codePoint, const uint32_t *glyphs, int numGlyphs) {
+    if (codePoint < CHARSET_GLYPH_BASE) {
+        return codePoint;
+    }
+    const uint32_t *glyph = std::lower_bound(glyphs, glyphs + numGlyphs, codePoint);
+    if (glyph == glyphs + numGlyphs || *glyph != codePoint) {
+        return CHARSET_NOT_A_GLYPH;
+    }
+    return CHARSET_GLYPH_BASE + (glyph - glyphs);
+}
+
+String SplitFlapCharset::encode(const String &text) const {
+    const char *p = text.c_str();
+    const char *end = p + text.length();
+    if (std::all_of(p, end, [](char c) { return (uint8_t) c < 0x80; })) {
+        return text; // plain ASCII is already one code per character
+    }
+
+    String codes;
+    codes.reserve(text.length());
+    while (p < end) {
+        codes += (char) codeOf(nextCodePoint(p, end), glyphs, numGlyphs);
+    }
+    return codes;
+}
+
+String SplitFlapCharset::decode(const String &codes) const {
+    String text;
+    text.reserve(codes.length());
+    for (unsigned int i = 0; i < codes.length(); i++) {
+        uint8_t code = codes[i];
+        if (code >= CHARSET_GLYPH_BASE && code - CHARSET_GLYPH_BASE < numGlyphs) {
+            appendUtf8(text, glyphs[code - CHARSET_GLYPH_BASE]);
+        } else {
+            text += (char) code;
+        }
+    }
+    return text;
+}
+
+// Code point of a string holding exactly one UTF-8 character, or -1
+static int32_t singleCodePoint(const char *text) {
+    if (text == nullptr || *text == '\0') {
+        return -1;
+    }
+    const char *p = text;
+    const char *end = text + strlen(text);
+    uint32_t codePoint = nextCodePoint(p, end);
+    return p == end && codePoint != MALFORMED_UTF8 ? codePoint : -1;
+}
+
+// {
+//   "flaps": [" ", "A", "B", ..., "Ä", "€"],      one character each, in drum order from the magnet
+//   "aliases": {"ä": "Ä", "é": "E"},             characters shown on the flap of another, optional
+//   "stepsPerRot": 2048,                           steps per rotation the positions are given in, optional
+//   "positions": [0, 43, 85, ...]                  step of each flap, optional, evenly spaced without
+// }
+bool loadCustomCharset(const char *json, String &error) {
+    JsonDocument doc;
+    DeserializationError parseError = deserializeJson(doc, json);
+    if (parseError) {
+        error = String("invalid JSON: ") + parseError.c_str();
+        return false;
+    }
+
+    JsonArray flaps = doc["flaps"].as<JsonArray>();
+    int size = flaps.size();
+    if (size == 0 || size > CHARSET_MAX_FLAPS) {
+        error = "flaps must list 1 to " + String(CHARSET_MAX_FLAPS) + " characters";
+        return false;
+    }
+
+    // Every character the file names, flaps and aliases, code points from CHARSET_GLYPH_BASE up get the codes above
+    // ASCII in ascending order
+    std::vector<int32_t> flapPoints;
+    struct Alias
+    {
+        String name;
+        int32_t from;
+        int32_t to;
+    };
+    std::vector<Alias> aliases;
+    std::vector<uint32_t> glyphs;
+    for (int i = 0; i < size; i++) {
+        int32_t codePoint = singleCodePoint(flaps[i].as<const char *>());
+        if (codePoint < 0) {
+            error = "flap " + String(i) + " is not a single character";
+            return false;
+        }
+        flapPoints.push_back(codePoint);
+    }
+    for (JsonPair alias : doc["aliases"].as<JsonObject>()) {
+        int32_t from = singleCodePoint(alias.key().c_str());
+        int32_t to = singleCodePoint(alias.value().as<const char *>());
+        if (from < 0 || to < 0) {
+            error = String("alias ") + alias.key().c_str() + " is not a single character for another";
+            return false;
+        }
+        aliases.push_back({alias.key().c_str(), from, to});
+    }
+    for (int32_t codePoint : flapPoints) {
+        if (codePoint >= CHARSET_GLYPH_BASE) {
+            glyphs.push_back(codePoint);
+        }
+    }
+    for (const Alias &alias : aliases) {
+        if (alias.from >= CHARSET_GLYPH_BASE) {
+            glyphs.push_back(alias.from);
+        }
+    }
+    std::sort(glyphs.begin(), glyphs.end());
+    glyphs.erase(std::unique(glyphs.begin(), glyphs.end()), glyphs.end());
+    if (glyphs.size() > CHARSET_MAX_GLYPHS) {
+        error = "more than " + String(CHARSET_MAX_GLYPHS) + " non-ASCII characters";
+        return false;
+    }
+
+    uint8_t index[256];
+    char chars[CHARSET_MAX_FLAPS];
+    memset(index, CHARSET_UNKNOWN, sizeof(index));
+    for (int i = 0; i < size; i++) {
+        int code = codeOf(flapPoints[i], glyphs.data(), glyphs.size());
+        if (code == CHARSET_NOT_A_GLYPH) {
+            error = "flap " + String(i) + " can not be on a drum";
+            return false;
+        }
+        chars[i] = code;
+        if (index[code] == CHARSET_UNKNOWN) {
+            index[code] = i; // a character on more than one flap, e.g. two blanks, shows on the first
+        }
+    }
+    for (const Alias &alias : aliases) {
+        int from = codeOf(alias.from, glyphs.data(), glyphs.size());
+        int to = codeOf(alias.to, glyphs.data(), glyphs.size());
+        if (from == CHARSET_NOT_A_GLYPH || to == CHARSET_NOT_A_GLYPH || index[to] == CHARSET_UNKNOWN) {
+            error = String("alias ") + alias.name + " is not for a flap";
+            return false;
+        }
+        index[from] = index[to];
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (index[c] == CHARSET_UNKNOWN) {
+            index[c] = index[(uint8_t) charsetFold(c)];
+        }
+    }
+
+    JsonArray positions = doc["positions"].as<JsonArray>();
+    int positionSteps = doc["stepsPerRot"] | 2048;
+    if (! positions.isNull() && (int) positions.size() != size) {
+        error = "positions must have one step per flap";
+        return false;
+    }
+    for (int i = 0; i < (int) positions.size(); i++) {
+        int position = positions[i].as<int>();
+        if (position < 0 || position >= positionSteps || position > 0xFFFF ||
+            (i > 0 && position <= positions[i - 1].as<int>())) {
+            error = "positions must rise from 0 to below stepsPerRot";
+            return false;
+        }
+    }
+
+    for (int i = 0; i < (int) positions.size(); i++) {
+        customPositions[i] = positions[i].as<int>();
+    }
+    memcpy(customChars, chars, size);
+    memcpy(CustomCharset.index, index, sizeof(index));
+    std::copy(glyphs.begin(), glyphs.end(), customGlyphs);
+    CustomCharset.size = size;
+    CustomCharset.positions = positions.isNull() ? nullptr : customPositions;
+    CustomCharset.positionSteps = positionSteps;
+    CustomCharset.numGlyphs = glyphs.size();
+    customLoaded = true;
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define CHARSET_UNKNOWN     0xFF // index of a character that is not on the drum
+#define CHARSET_CUSTOM      0    // charset setting of the drum described by CHARSET_FILE
+#define CHARSET_FILE        "/charset.json"
+#define CHARSET_MAX_FLAPS   128  // most flaps on a custom drum
+#define CHARSET_GLYPH_BASE  0x80 // code of the first multi-byte UTF-8 character, ASCII characters are their own code
+#define CHARSET_MAX_GLYPHS  128  // multi-byte UTF-8 characters a custom drum can name, codes 0x80 to 0xFF
+#define CHARSET_NOT_A_GLYPH 0x7F // code of UTF-8 characters the drum does not name, DEL is never on a drum
+
+// Characters on a drum, in order, the first one is located on the magnet. Text is turned into one code per character
+// by encode(), index maps every code straight to its place on the drum, lower case letters to their upper case flap,
+// so a lookup is a single array access.
+struct SplitFlapCharset
+{
+    const char *chars;         // code of each flap
+    int size;                  // number of flaps
+    uint8_t index[256];        // flap of each code, CHARSET_UNKNOWN if there is none
+    const uint16_t *positions; // step of each flap out of positionSteps, nullptr when the flaps are evenly spaced
+    int positionSteps;
+    const uint32_t *glyphs;    // code point of each code from CHARSET_GLYPH_BASE up, in ascending order
+    int numGlyphs;
+
+    int getPosition(int flap, int stepsPerRot) const {
+        return positions != nullptr ? positions[flap] * stepsPerRot / positionSteps : flap * stepsPerRot / size;
+    }
+    String encode(const String &text) const; // one code per UTF-8 character of text
+    String decode(const String &codes) const; // back to UTF-8
+};
+
+extern const SplitFlapCharset StandardCharset; // 37 flaps: blank, A-Z, 0-9
+extern const SplitFlapCharset ExtendedCharset; // 48 flaps: the standard ones and ' : ? ! . - / $ @ # %
+
+const SplitFlapCharset &getCharset(int charset);          // by charset setting, standard if the custom one is not loaded
+bool loadCustomCharset(const char *json, String &error);  // parse the contents of CHARSET_FILE, keeps the old on error
+
+// Compile time construction of the index table. C++11 constexpr functions are a single return statement, so the
+// search recurses along the drum and the 256 entries are spelled out by the macros below.
+constexpr char charsetFold(int c) {
+    return (c >= 'a' && c <= 'z') ? (char) (c - 'a' + 'A') : (char) c;
+}
+
+constexpr uint8_t charsetIndexOf(const char *chars, int size, int c, int i = 0) {
+    return i >= size ? CHARSET_UNKNOWN : (chars[i] == charsetFold(c) ? i : charsetIndexOf(chars, size, c, i + 1));
+}
+
+#define CHARSET_INDEX_4(chars, size, c)                                                                               \
+    charsetIndexOf(chars, size, c), charsetIndexOf(chars, size, c + 1), charsetIndexOf(chars, size, c + 2),           \
+        charsetIndexOf(chars, size, c + 3)
+#define CHARSET_INDEX_16(chars, size, c)                                                                              \
+    CHARSET_INDEX_4(chars, size, c), CHARSET_INDEX_4(chars, size, c + 4), CHARSET_INDEX_4(chars, size, c + 8),        \
+        CHARSET_INDEX_4(chars, size, c + 12)
+#define CHARSET_INDEX_64(chars, size, c)                                                                              \
+    CHARSET_INDEX_16(chars, size, c), CHARSET_INDEX_16(chars, size, c + 16), CHARSET_INDEX_16(chars, size, c + 32),   \
+        CHARSET_INDEX_16(chars, size, c + 48)
+#define CHARSET_INDEX_256(chars, size)                                                                                \
+    {                                                                                                                 \
+        CHARSET_INDEX_64(chars, size, 0), CHARSET_INDEX_64(chars, size, 64), CHARSET_INDEX_64(chars, size, 128),      \
+            CHARSET_INDEX_64(chars, size, 192)                                                                        \
+    }
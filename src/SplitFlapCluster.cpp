@@ -0,0 +1,422 @@
+#include "SplitFlapCluster.h"
+
+#include "SplitFlapDisplay.h"
+#include "SplitFlapLog.h"
+#include "SplitFlapTrace.h"
+
+// Packets, one line of text each, times in micros() truncated to 32 bits:
+//
+//   member -> leader  HELLO <slot> <modules> <synced> <sequence> <member time>
+//   leader -> member  TIME <sequence> <member time> <leader time>
+//   leader -> member  MOVE <move> <start, leader time> <priority> <speed> <text>
+//   member -> leader  ACK <move>
+//   member -> leader  DONE <move> <started, leader time> <finished, leader time>
+//
+// The text of a move is the member's slice of the board, padded to its module count, and runs to the end of the
+// packet.
+
+void SplitFlapCluster::setup(SplitFlapDisplay &display) {
+    TRACE_SCOPE("cluster.setup");
+    this->display = &display;
+    role = (ClusterRole) constrain(settings.getInt("clusterRole"), 0, 2);
+    if (role == ClusterRole::Off) {
+        return;
+    }
+
+    slot = settings.getInt("clusterSlot");
+    int port = settings.getInt("clusterPort");
+    if (role == ClusterRole::Member) {
+        if (! leaderIp.fromString(settings.getString("clusterLeader"))) {
+            LOG_WARN("Cluster leader address not set, running on its own");
+            role = ClusterRole::Off;
+            return;
+        }
+        leaderPort = port;
+        port += slot; // members on one machine need a port each
+    }
+
+    if (! udp.begin(port)) {
+        LOG_WARN("Cluster port %d not available, running on its own", port);
+        role = ClusterRole::Off;
+        return;
+    }
+
+    display.setCluster(this);
+    LOG_INFO("Cluster %s in slot %d on port %d", role == ClusterRole::Leader ? "leader" : "member", slot, port);
+}
+
+void SplitFlapCluster::loop() {
+    if (role == ClusterRole::Off) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    receive();
+    if (role == ClusterRole::Leader) {
+        resendMoves();
+    } else {
+        sayHello();
+    }
+    runSlice();
+}
+
+bool SplitFlapCluster::distribute(const DisplayCommand &command) {
+    std::lock_guard<std::mutex> guard(lock);
+    pruneMembers();
+    if (numMembers == 0) {
+        return false;
+    }
+
+    // The board from left to right is the members and this controller ordered by slot, the members are kept sorted
+    int ownModules = display->getNumModules();
+    int total = ownModules;
+    for (int i = 0; i < numMembers; i++) {
+        total += members[i].modules;
+    }
+    String codes = display->layoutString(command.text, command.centering, total);
+    const SplitFlapCharset &charset = display->getCharset();
+
+    String ownText;
+    int column = 0;
+    bool placed = false;
+    for (int i = 0; i <= numMembers; i++) {
+        if (! placed && (i == numMembers || members[i].slot > slot)) {
+            ownText = charset.decode(codes.substring(column, column + ownModules));
+            column += ownModules;
+            placed = true;
+        }
+        if (i < numMembers) {
+            members[i].slice = charset.decode(codes.substring(column, column + members[i].modules));
+            column += members[i].modules;
+        }
+    }
+
+    uint32_t move = stats.lastMove + 1;
+    moveStart = micros() + CLUSTER_LEAD_MS * 1000UL;
+    movePriority = command.priority;
+    moveSpeed = command.speed;
+    stats.participants = numMembers + 1;
+    stats.reported = 0;
+    stats.startSpreadUs = 0;
+    stats.finishSpreadUs = 0;
+    arm(move, moveStart, ownText, command.priority, command.speed);
+
+    for (int i = 0; i < numMembers; i++) {
+        sendMove(members[i]);
+    }
+    lastResend = millis();
+    return true;
+}
+
+ClusterStats SplitFlapCluster::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+std::vector<ClusterMember> SplitFlapCluster::getMembers() {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::vector<ClusterMember>(members, members + numMembers);
+}
+
+void SplitFlapCluster::receive() {
+    char packet[CLUSTER_PACKET_SIZE + 1];
+    while (udp.parsePacket() > 0) {
+        int length = udp.read(packet, CLUSTER_PACKET_SIZE);
+        if (length <= 0) {
+            continue;
+        }
+        packet[length] = '\0';
+
+        char *args = strchr(packet, ' ');
+        if (args == nullptr) {
+            continue;
+        }
+        *args++ = '\0';
+
+        if (role == ClusterRole::Leader) {
+            if (strcmp(packet, "HELLO") == 0) {
+                handleHello(args);
+            } else if (strcmp(packet, "ACK") == 0) {
+                handleAck(args);
+            } else if (strcmp(packet, "DONE") == 0) {
+                handleDone(args);
+            }
+        } else if (udp.remoteIP() == leaderIp) {
+            if (strcmp(packet, "TIME") == 0) {
+                handleTime(args);
+            } else if (strcmp(packet, "MOVE") == 0) {
+                handleMove(args);
+            }
+        }
+    }
+}
+
+void SplitFlapCluster::handleHello(const char *args) {
+    int memberSlot, modules, synced;
+    unsigned long sequence, memberTime;
+    if (sscanf(args, "%d %d %d %lu %lu", &memberSlot, &modules, &synced, &sequence, &memberTime) != 5 ||
+        modules <= 0) {
+        return;
+    }
+
+    // Answer first, the leader's time is best taken as close to the hello as possible
+    char reply[64];
+    snprintf(reply, sizeof(reply), "TIME %lu %lu %lu", sequence, memberTime, (unsigned long) (uint32_t) micros());
+    send(udp.remoteIP(), udp.remotePort(), reply);
+
+    IPAddress ip = udp.remoteIP();
+    uint16_t port = udp.remotePort();
+    int index = 0;
+    while (index < numMembers && ! (members[index].ip == ip && members[index].port == port)) {
+        index++;
+    }
+
+    ClusterMember member = {};
+    if (index < numMembers) {
+        member = members[index];
+        for (int i = index; i < numMembers - 1; i++) {
+            members[i] = members[i + 1];
+        }
+        numMembers--;
+    } else if (numMembers == CLUSTER_MAX_MEMBERS) {
+        return;
+    } else {
+        LOG_INFO("Cluster member in slot %d joined with %d modules", memberSlot, modules);
+    }
+    member.ip = ip;
+    member.port = port;
+    member.slot = memberSlot;
+    member.modules = modules;
+    member.synced = synced != 0;
+    member.lastSeen = millis();
+
+    // Back in at its place by slot
+    int position = numMembers;
+    while (position > 0 && members[position - 1].slot > memberSlot) {
+        members[position] = members[position - 1];
+        position--;
+    }
+    members[position] = member;
+    numMembers++;
+}
+
+void SplitFlapCluster::handleTime(const char *args) {
+    unsigned long sequence, memberTime, leaderTime;
+    if (sscanf(args, "%lu %lu %lu", &sequence, &memberTime, &leaderTime) != 3) {
+        return;
+    }
+
+    // The leader read its clock halfway through the round trip, as far as the member can tell
+    uint32_t now = micros();
+    uint32_t rtt = now - (uint32_t) memberTime;
+    samples[nextSample] = ClockSample{(int32_t) ((uint32_t) leaderTime + rtt / 2 - now), rtt};
+    nextSample = (nextSample + 1) % CLUSTER_SYNC_SAMPLES;
+    numSamples = min(numSamples + 1, CLUSTER_SYNC_SAMPLES);
+
+    // The fastest round trip leaves the least room for one leg to have taken longer than the other
+    int best = 0;
+    for (int i = 1; i < numSamples; i++) {
+        if (samples[i].rttUs < samples[best].rttUs) {
+            best = i;
+        }
+    }
+    stats.offsetUs = samples[best].offsetUs;
+    stats.rttUs = samples[best].rttUs;
+    stats.synced = true;
+    lastLeaderTime = millis();
+}
+
+void SplitFlapCluster::handleMove(const char *args) {
+    unsigned long move, start;
+    int priority;
+    float speed;
+    int textStart = 0;
+    if (sscanf(args, "%lu %lu %d %f%n", &move, &start, &priority, &speed, &textStart) != 4 ||
+        args[textStart] != ' ') {
+        return;
+    }
+
+    char ack[32];
+    snprintf(ack, sizeof(ack), "ACK %lu", move);
+    send(leaderIp, leaderPort, ack);
+
+    if (stats.moves > 0 && (uint32_t) move == stats.lastMove) {
+        return; // a resend, the acknowledgement got lost
+    }
+
+    // Without an offset there is no telling when the leader's time comes, start straight away
+    uint32_t localStart = stats.synced ? (uint32_t) start - stats.offsetUs : (uint32_t) micros();
+    arm(move, localStart, String(args + textStart + 1), (CommandPriority) constrain(priority, 0, 3), speed);
+}
+
+void SplitFlapCluster::handleAck(const char *args) {
+    unsigned long move;
+    if (sscanf(args, "%lu", &move) != 1) {
+        return;
+    }
+    for (int i = 0; i < numMembers; i++) {
+        if (members[i].ip == udp.remoteIP() && members[i].port == udp.remotePort()) {
+            members[i].movesAcked = move;
+        }
+    }
+}
+
+void SplitFlapCluster::handleDone(const char *args) {
+    unsigned long move, started, finished;
+    if (sscanf(args, "%lu %lu %lu", &move, &started, &finished) == 3 && (uint32_t) move == stats.lastMove) {
+        recordDone(started, finished);
+    }
+}
+
+void SplitFlapCluster::send(IPAddress ip, uint16_t port, const String &packet) {
+    udp.beginPacket(ip, port);
+    udp.write((const uint8_t *) packet.c_str(), packet.length());
+    udp.endPacket();
+}
+
+void SplitFlapCluster::sendMove(ClusterMember &member) {
+    char header[64];
+    snprintf(header, sizeof(header), "MOVE %lu %lu %d %.2f ", (unsigned long) stats.lastMove,
+             (unsigned long) moveStart, (int) movePriority, moveSpeed);
+    send(member.ip, member.port, header + member.slice);
+}
+
+void SplitFlapCluster::resendMoves() {
+    // Only while the move can still start on time, or close to it
+    if (stats.moves == 0 || millis() - lastResend < CLUSTER_RESEND_MS ||
+        (int32_t) ((uint32_t) micros() - moveStart) > CLUSTER_LEAD_MS * 1000L) {
+        return;
+    }
+    lastResend = millis();
+
+    for (int i = 0; i < numMembers; i++) {
+        if (members[i].movesAcked != stats.lastMove) {
+            sendMove(members[i]);
+            stats.resends++;
+        }
+    }
+}
+
+void SplitFlapCluster::sayHello() {
+    unsigned long now = millis();
+    if (stats.synced && now - lastLeaderTime > CLUSTER_TIMEOUT_MS) {
+        LOG_WARN("Cluster leader lost");
+        stats.synced = false;
+        numSamples = 0;
+    }
+
+    unsigned long interval = numSamples < CLUSTER_SYNC_SAMPLES ? CLUSTER_SYNC_MS : CLUSTER_HELLO_MS;
+    if (helloSequence > 0 && now - lastHello < interval) {
+        return;
+    }
+    lastHello = now;
+
+    char hello[80];
+    snprintf(hello, sizeof(hello), "HELLO %d %d %d %lu %lu", slot, display->getNumModules(), stats.synced ? 1 : 0,
+             (unsigned long) ++helloSequence, (unsigned long) (uint32_t) micros());
+    send(leaderIp, leaderPort, hello);
+}
+
+void SplitFlapCluster::pruneMembers() {
+    unsigned long now = millis();
+    int kept = 0;
+    for (int i = 0; i < numMembers; i++) {
+        if (now - members[i].lastSeen > CLUSTER_TIMEOUT_MS) {
+            LOG_WARN("Cluster member in slot %d lost", members[i].slot);
+            continue;
+        }
+        members[kept++] = members[i];
+    }
+    numMembers = kept;
+}
+
+void SplitFlapCluster::arm(uint32_t move, uint32_t start, const String &text, CommandPriority priority, float speed) {
+    sliceState = SliceState::Armed;
+    sliceMove = move;
+    sliceStart = start;
+    sliceText = text;
+    slicePriority = priority;
+    sliceSpeed = speed;
+    stats.lastMove = move;
+    stats.moves++;
+}
+
+void SplitFlapCluster::runSlice() {
+    uint32_t now = micros();
+    switch (sliceState) {
+        case SliceState::None: break;
+        case SliceState::Armed: {
+            // The display's next tick() takes it, cutting into whatever it is showing. An idle display wakes up and
+            // settles before its first step, a holding or moving one steps straight away, so the hand-over comes
+            // ahead of the start by as much as the display needs. Planned only once the longest start could be due.
+            int32_t untilStart = (int32_t) (sliceStart - now);
+            if (untilStart > (int32_t) (SplitFlapMotion::getWakeUpMs() * 1000UL) ||
+                (untilStart > 0 &&
+                 untilStart > (int32_t) display->planString(sliceText, sliceSpeed, false).startUs)) {
+                break;
+            }
+            sliceQueued = now;
+            sliceRun = display->getQueueStats().run;
+            display->queueString(sliceText, CommandSource::Cluster, slicePriority, false, sliceSpeed);
+            sliceState = SliceState::Queued;
+            break;
+        }
+        case SliceState::Queued:
+            if (display->getQueueStats().run != sliceRun) {
+                sliceState = SliceState::Moving;
+            }
+            break;
+        case SliceState::Moving: {
+            if (display->isBusy()) {
+                break;
+            }
+            sliceState = SliceState::None;
+
+            // The slice's first step, or the hand-over when the display already showed it and took none
+            uint32_t stepped = display->getMotion().getSteppingStart();
+            uint32_t started = (int32_t) (stepped - sliceQueued) >= 0 ? stepped : sliceQueued;
+            if ((int32_t) (started - sliceStart) > 1000) {
+                stats.lateStarts++;
+            }
+            finishSlice(started, now);
+            break;
+        }
+    }
+}
+
+void SplitFlapCluster::finishSlice(uint32_t started, uint32_t finished) {
+    if (role == ClusterRole::Leader) {
+        recordDone(started, finished);
+        return;
+    }
+
+    char done[64];
+    snprintf(done, sizeof(done), "DONE %lu %lu %lu", (unsigned long) sliceMove, (unsigned long) toLeaderTime(started),
+             (unsigned long) toLeaderTime(finished));
+    send(leaderIp, leaderPort, done);
+}
+
+void SplitFlapCluster::recordDone(uint32_t started, uint32_t finished) {
+    if (stats.reported == 0) {
+        firstStarted = lastStarted = started;
+        firstFinished = lastFinished = finished;
+    } else {
+        // times wrap, compare differences
+        if ((int32_t) (started - firstStarted) < 0) {
+            firstStarted = started;
+        }
+        if ((int32_t) (started - lastStarted) > 0) {
+            lastStarted = started;
+        }
+        if ((int32_t) (finished - firstFinished) < 0) {
+            firstFinished = finished;
+        }
+        if ((int32_t) (finished - lastFinished) > 0) {
+            lastFinished = finished;
+        }
+    }
+    stats.reported++;
+    stats.startSpreadUs = lastStarted - firstStarted;
+    stats.finishSpreadUs = lastFinished - firstFinished;
+    stats.maxStartSpreadUs = max(stats.maxStartSpreadUs, stats.startSpreadUs);
+}
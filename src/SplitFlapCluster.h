@@ -0,0 +1,153 @@
+#pragma once
+
+#include "JsonSettings.h"
+#include "SplitFlapCommandQueue.h"
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <mutex>
+#include <vector>
+
+#define CLUSTER_MAX_MEMBERS  8    // controllers following one leader
+#define CLUSTER_PACKET_SIZE  512  // longest datagram, a slice of UTF-8 text with its header
+#define CLUSTER_LEAD_MS      800  // between sending a move and its first step, covers delivery, a few resends and
+                                  // a display waking up from idle
+#define CLUSTER_RESEND_MS    40   // a move not acknowledged yet is sent again this often
+#define CLUSTER_HELLO_MS     1000 // members say hello and take a clock sample this often once synced
+#define CLUSTER_SYNC_MS      100  // and this often until they have CLUSTER_SYNC_SAMPLES
+#define CLUSTER_SYNC_SAMPLES 8    // the clock offset is taken from the fastest round trip of the last ones
+#define CLUSTER_TIMEOUT_MS   5000 // a member, or the leader, not heard from for this long is gone
+
+class SplitFlapDisplay;
+
+enum class ClusterRole {
+    Off,    // a display of its own
+    Leader, // splits text over the members and itself, and picks when it starts
+    Member  // shows the slice the leader sends, at the time the leader asks for
+};
+
+// A controller following the leader, as the leader sees it
+struct ClusterMember
+{
+    IPAddress ip;
+    uint16_t port;
+    int slot;               // place on the board, lowest on the left
+    int modules;
+    unsigned long lastSeen; // millis() of the last hello
+    bool synced;            // has an estimate of the leader's clock
+    uint32_t movesAcked;    // id of the last move it acknowledged
+    String slice;           // text of the current move, resent until acknowledged
+};
+
+struct ClusterStats
+{
+    unsigned long moves;          // moves started, distributed by the leader or received by a member
+    unsigned long resends;        // move packets sent again for lack of an acknowledgement
+    unsigned long lateStarts;     // moves that started more than a millisecond after their time
+    int32_t offsetUs;             // member: leader's clock minus this one's
+    uint32_t rttUs;               // member: round trip of the sample the offset comes from
+    bool synced;                  // member: offset is known and the leader was heard from recently
+    uint32_t lastMove;            // id of the last move
+    int reported;                 // leader: controllers that reported the last move finished, itself included
+    int participants;             // leader: controllers the last move was split over
+    uint32_t startSpreadUs;       // leader: between the first and the last controller starting the last move
+    uint32_t finishSpreadUs;      // leader: between the first and the last controller finishing it
+    uint32_t maxStartSpreadUs;    // leader: largest start spread of any move
+};
+
+// Chains several controllers, each with a display of its own, into one long board. The leader lays text out over
+// every module of the board, sends each member its slice over UDP and asks them all to start at the same time. The
+// members keep an estimate of the offset between their micros() and the leader's, NTP style: each hello carries the
+// member's time, the leader answers with its own, and half the round trip of the fastest of the last few exchanges
+// is taken as the delivery time. Each controller hands its slice to the display early by the wake-up and settle the
+// display still has to go through, so the first steps fall at the start time whether it was idle, holding or moving.
+// Members report when their first step came and when they finished, in the leader's time, so the leader can tell how
+// well they kept together.
+//
+// Packets are lines of text: HELLO, TIME, MOVE, ACK and DONE, see SplitFlapCluster.cpp. The leader listens on the
+// clusterPort setting, members on clusterPort + clusterSlot so several can run on one machine over loopback.
+class SplitFlapCluster {
+  public:
+    SplitFlapCluster(JsonSettings &settings) : settings(settings) {}
+
+    void setup(SplitFlapDisplay &display); // from the settings, does nothing with clusterRole 0
+    void loop();                           // call from loop() before the display's tick()
+    bool distribute(const DisplayCommand &command); // leader: false if there is nobody to split the text with
+
+    ClusterRole getRole() const { return role; }
+    bool isLeader() const { return role == ClusterRole::Leader; }
+    ClusterStats getStats();
+    std::vector<ClusterMember> getMembers();
+
+  private:
+    // A slice waiting for its start time, then for the display to show it
+    enum class SliceState {
+        None,
+        Armed,  // waiting for the start time
+        Queued, // handed to the display, waiting for it to take it
+        Moving  // on its way, waiting for the display to finish
+    };
+
+    JsonSettings &settings;
+    SplitFlapDisplay *display = nullptr;
+    ClusterRole role = ClusterRole::Off;
+    WiFiUDP udp;
+    int slot = 0;
+    IPAddress leaderIp;
+    uint16_t leaderPort = 0;
+    std::mutex lock; // loop() against the web server reading the stats
+
+    ClusterStats stats = {};
+
+    // leader
+    ClusterMember members[CLUSTER_MAX_MEMBERS];
+    int numMembers = 0;
+    uint32_t moveStart = 0;     // in the leader's time
+    float moveSpeed = 0;
+    CommandPriority movePriority = CommandPriority::Text;
+    uint32_t firstStarted = 0;  // of the controllers that reported the last move
+    uint32_t lastStarted = 0;
+    uint32_t firstFinished = 0;
+    uint32_t lastFinished = 0;
+    unsigned long lastResend = 0;
+
+    // member
+    struct ClockSample
+    {
+        int32_t offsetUs;
+        uint32_t rttUs;
+    };
+    ClockSample samples[CLUSTER_SYNC_SAMPLES];
+    int numSamples = 0;
+    int nextSample = 0;
+    uint32_t helloSequence = 0;
+    unsigned long lastHello = 0;
+    unsigned long lastLeaderTime = 0; // millis() of the last answer from the leader
+
+    // the slice this controller shows, on the leader as on the members
+    SliceState sliceState = SliceState::None;
+    uint32_t sliceMove = 0;
+    uint32_t sliceStart = 0;   // in this controller's time
+    String sliceText;
+    CommandPriority slicePriority = CommandPriority::Text;
+    float sliceSpeed = 0;
+    unsigned long sliceRun = 0; // commands the display had run when the slice was handed over
+    uint32_t sliceQueued = 0;   // when it was handed over, ahead of the start by the display's wake-up
+
+    void receive();
+    void handleHello(const char *args);
+    void handleTime(const char *args);
+    void handleMove(const char *args);
+    void handleAck(const char *args);
+    void handleDone(const char *args);
+    void send(IPAddress ip, uint16_t port, const String &packet);
+    void sendMove(ClusterMember &member);
+    void resendMoves();
+    void sayHello();
+    void pruneMembers();
+    void arm(uint32_t move, uint32_t start, const String &text, CommandPriority priority, float speed);
+    void runSlice();
+    void finishSlice(uint32_t started, uint32_t finished); // in this controller's time
+    void recordDone(uint32_t started, uint32_t finished);  // leader, in the leader's time
+    uint32_t toLeaderTime(uint32_t localTime) const { return localTime + stats.offsetUs; }
+};
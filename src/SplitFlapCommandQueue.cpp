@@ -0,0 +1,81 @@
+#include "SplitFlapCommandQueue.h"
+
+bool SplitFlapCommandQueue::push(DisplayCommand command) {
+    std::lock_guard<std::mutex> guard(lock);
+    stats.queued++;
+
+    // latest wins, keeping its place in the queue so a busy source is not pushed back by its own updates
+    for (int i = 0; i < depth; i++) {
+        if (commands[i].source == command.source && commands[i].type == command.type) {
+            command.sequence = commands[i].sequence;
+            commands[i] = command;
+            stats.coalesced++;
+            return true;
+        }
+    }
+
+    if (depth == COMMAND_QUEUE_LENGTH) {
+        // make room by dropping the newest of the lowest priority, unless that is above the new command
+        int victim = 0;
+        for (int i = 1; i < depth; i++) {
+            if (commands[i].priority < commands[victim].priority ||
+                (commands[i].priority == commands[victim].priority && commands[i].sequence > commands[victim].sequence)) {
+                victim = i;
+            }
+        }
+        stats.dropped++;
+        if (commands[victim].priority >= command.priority) {
+            return false;
+        }
+        remove(victim);
+    }
+
+    command.sequence = nextSequence++;
+    commands[depth++] = command;
+    stats.maxDepth = max(stats.maxDepth, depth);
+    return true;
+}
+
+bool SplitFlapCommandQueue::popIf(const std::function<bool(const DisplayCommand &)> &ready, DisplayCommand &command) {
+    std::lock_guard<std::mutex> guard(lock);
+    int index = next();
+    if (index < 0 || ! ready(commands[index])) {
+        return false;
+    }
+
+    command = commands[index];
+    remove(index);
+    stats.run++;
+    return true;
+}
+
+void SplitFlapCommandQueue::countPreempted() {
+    std::lock_guard<std::mutex> guard(lock);
+    stats.preempted++;
+}
+
+CommandQueueStats SplitFlapCommandQueue::getStats() {
+    std::lock_guard<std::mutex> guard(lock);
+    CommandQueueStats current = stats;
+    current.depth = depth;
+    return current;
+}
+
+int SplitFlapCommandQueue::next() const {
+    int index = -1;
+    for (int i = 0; i < depth; i++) {
+        if (index < 0 || commands[i].priority > commands[index].priority ||
+            (commands[i].priority == commands[index].priority && commands[i].sequence < commands[index].sequence)) {
+            index = i;
+        }
+    }
+    return index;
+}
+
+void SplitFlapCommandQueue::remove(int index) {
+    for (int i = index; i < depth - 1; i++) {
+        commands[i] = commands[i + 1];
+    }
+    depth--;
+    commands[depth] = DisplayCommand(); // let go of the text
+}
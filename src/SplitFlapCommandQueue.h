@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <mutex>
+
+#define COMMAND_QUEUE_LENGTH 8 // commands waiting for the display, one per source and kind is usually plenty
+
+// Who sent a command, a newer command from the same source replaces the one still waiting
+enum class CommandSource {
+    Local, // the display modes run by loop(): multiple words, date and time
+    Web,   // text and #home from the web interface
+    Mqtt,  // the MQTT command topic
+    Alert,  // the MQTT alert topic
+    Cluster // a slice of text split over several controllers, started at the time the cluster leader picked
+};
+
+// Higher runs first, and a text command cuts into a move started by a lower one
+enum class CommandPriority {
+    Ambient, // clocks and rotating words, fine to show late
+    Text,    // text someone just sent
+    Alert,   // text that has to be seen now
+    Home     // homing, everything after it relies on the positions it finds
+};
+
+enum class CommandType {
+    Text,
+    Home
+};
+
+struct DisplayCommand
+{
+    CommandType type;
+    CommandSource source;
+    CommandPriority priority;
+    String text;
+    bool centering;
+    float speed;
+    uint32_t sequence; // order of arrival, first in first out within a priority
+};
+
+struct CommandQueueStats
+{
+    unsigned long queued;    // commands handed to push()
+    unsigned long coalesced; // of those, commands that replaced a waiting one from the same source
+    unsigned long dropped;   // commands lost to a full queue, the new one or a waiting one of lower priority
+    unsigned long run;       // commands taken off the queue to run
+    unsigned long preempted; // of those, text that cut into a move of lower priority
+    int depth;               // commands waiting now
+    int maxDepth;            // most commands ever waiting at once
+};
+
+// Bounded queue of display commands, safe to push from network callbacks and pop from loop(). Commands are kept per
+// source and kind with the latest winning, so a burst of messages during a move shows only the last one once the
+// display is free, and a full queue gives way to higher priority commands.
+class SplitFlapCommandQueue {
+  public:
+    bool push(DisplayCommand command); // false if it was dropped because the queue is full of higher priorities
+    bool popIf(const std::function<bool(const DisplayCommand &)> &ready, DisplayCommand &command);
+    void countPreempted();
+    CommandQueueStats getStats();
+
+  private:
+    std::mutex lock;
+    DisplayCommand commands[COMMAND_QUEUE_LENGTH];
+    int depth = 0;
+    uint32_t nextSequence = 0;
+    CommandQueueStats stats = {};
+
+    int next() const; // highest priority, oldest first, -1 when empty
+    void remove(int index);
+};
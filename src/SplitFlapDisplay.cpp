@@ -1,74 +1,171 @@
 #include "SplitFlapDisplay.h"
 
 #include "JsonSettings.h"
+#include "SplitFlapCluster.h"
+#include "SplitFlapLog.h"
 #include "SplitFlapModule.h"
 #include "SplitFlapMqtt.h"
-#include <esp_task_wdt.h>
+#include "SplitFlapTrace.h"
 
-SplitFlapDisplay::SplitFlapDisplay(JsonSettings &settings) : settings(settings) {}
+#include <algorithm>
 
-void SplitFlapDisplay::init() {
-    numModules = settings.getInt("moduleCount");
-    stepsPerRot = settings.getInt("stepsPerRot");
-    displayOffset = settings.getInt("displayOffset");
-    magnetPosition = settings.getInt("magnetPosition");
-    maxVel = settings.getFloat("maxVel");
-    charSetSize = settings.getInt("charset");
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+// Space separated, for the log
+static String formatList(const int *values, int count) {
+    String list;
+    for (int i = 0; i < count; i++) {
+        list += i > 0 ? " " + String(values[i]) : String(values[i]);
+    }
+    return list;
+}
 
-    std::vector<int> settingAddresses = settings.getIntVector("moduleAddresses");
-    for (int i = 0; i < numModules; i++) {
-        moduleAddresses[i] = (uint8_t) settingAddresses[i];
+static String formatPositions(const std::vector<SplitFlapModule> &modules) {
+    String list;
+    for (size_t i = 0; i < modules.size(); i++) {
+        list += i > 0 ? " " + String(modules[i].getPosition()) : String(modules[i].getPosition());
     }
+    return list;
+}
+#endif
 
-    std::vector<int> settingOffsets = settings.getIntVector("moduleOffsets");
+SplitFlapDisplay::SplitFlapDisplay(JsonSettings &settings) : settings(settings), motion(bus) {}
+
+void SplitFlapDisplay::init() {
+    TRACE_SCOPE("display.init");
+    numModules = constrain(settings.getInt("moduleCount"), 1, MAX_MODULES);
+    stepMode = settings.getInt("stepMode");
+    microsteps = SplitFlapModule::getMicrosteps(stepMode);
+    stepsPerRot = settings.getInt("stepsPerRot") * microsteps; // settings are in full steps
+    displayOffset = settings.getInt("displayOffset");
+    magnetPosition = settings.getInt("magnetPosition") * microsteps;
+    maxVel = min(settings.getFloat("maxVel"), MAX_RPM);
+    accel = settings.getFloat("accel");
+    charset = &::getCharset(settings.getInt("charset"));
+    charSetSize = charset->size;
+    if (settings.getInt("charset") == CHARSET_CUSTOM && charset == &StandardCharset) {
+        LOG_WARN("Custom charset " CHARSET_FILE " not loaded, using the standard one");
+    }
+
+    // The second bus is there once its pins are set, modules without a bus are split evenly between the two
+    numBuses = 1;
+#if MAX_BUSES > 1
+    if (settings.getInt("sda2Pin") >= 0 && settings.getInt("scl2Pin") >= 0) {
+        numBuses = 2;
+    }
+#endif
+    moduleBuses = settings.getIntVector("moduleBuses");
+    moduleBuses.resize(numModules, -1);
+    int busModules[MAX_BUSES] = {};
     for (int i = 0; i < numModules; i++) {
-        moduleOffsets[i] = settingOffsets[i];
+        if (moduleBuses[i] < 0 || moduleBuses[i] >= numBuses) {
+            moduleBuses[i] = numBuses > 1 && i >= (numModules + 1) / 2 ? 1 : 0;
+        }
+        busModules[moduleBuses[i]]++;
     }
 
-    Serial.print("Module Offsets: ");
+    // Modules past the end of the lists get the default address on their bus and no offset
+    moduleAddresses = settings.getIntVector("moduleAddresses");
+    moduleAddresses.resize(numModules, 0);
+    int busIndex[MAX_BUSES] = {};
     for (int i = 0; i < numModules; i++) {
-        Serial.print(moduleOffsets[i]);
-        Serial.print(" ");
+        int indexOnBus = busIndex[moduleBuses[i]]++;
+        if (! SplitFlapBus::isValidAddress(moduleAddresses[i])) {
+            moduleAddresses[i] = SplitFlapBus::getDefaultAddress(indexOnBus, busModules[moduleBuses[i]]);
+        }
     }
-    Serial.println();
 
-    for (uint8_t i = 0; i < numModules; i++) {
-        modules[i] = SplitFlapModule(
-            moduleAddresses[i], stepsPerRot, moduleOffsets[i] + displayOffset, magnetPosition, charSetSize
-        );
-    }
+    moduleOffsets = settings.getIntVector("moduleOffsets");
+    moduleOffsets.resize(numModules, 0);
+    magnetCorrections = settings.getIntVector("magnetCorrections");
+    magnetCorrections.resize(numModules, 0);
+
+    LOG_INFO("Module Offsets: %s", formatList(moduleOffsets.data(), numModules).c_str());
+
+    modules.clear();
+    for (int i = 0; i < numModules; i++) {
+        modules.push_back(SplitFlapModule(
+            moduleAddresses[i], stepsPerRot, (moduleOffsets[i] + magnetCorrections[i] + displayOffset) * microsteps,
+            magnetPosition,
+            *charset, stepMode
+        ));
+    }
+    motion.setModules(modules.data(), numModules);
+    drift.setModules(numModules, microsteps);
+    driftCorrection = settings.getInt("driftCorrection") != 0;
+    motion.setDriftLog(&drift.getLog());
+    metrics.setModules(numModules);
+    motion.setMetrics(&metrics);
+    motion.setRamp(RAMP_START_RPM / 60 * stepsPerRot, max(accel, 0.0f) / 60 * stepsPerRot);
+    motion.setHoldTime(settings.getInt("holdTime"));
+    motion.startTask();
+    motion.setHallInterrupt(settings.getInt("hallIntPin"));
+    motion.setHallWindow(settings.getInt("hallWindow") * microsteps);
 
     SDAPin = settings.getInt("sdaPin");
     SCLPin = settings.getInt("sclPin");
 
-    Wire.begin(SDAPin, SCLPin);
-    Wire.setClock(400000);
+    bus.begin(SDAPin, SCLPin, settings.getInt("i2cClock"));
+#if MAX_BUSES > 1
+    if (numBuses > 1) {
+        secondBus.begin(settings.getInt("sda2Pin"), settings.getInt("scl2Pin"), settings.getInt("i2cClock"));
+        secondBus.startTask();
+        motion.addBus(secondBus);
+    }
+#endif
+
+    // Fast-mode Plus needs every expander and the wiring to keep up, otherwise stay at 400kHz
+    for (int i = 0; i < numModules; i++) {
+        SplitFlapBus &moduleBus = getBus(moduleBuses[i]);
+        if (moduleBus.getClock() > I2C_FAST_CLOCK && ! moduleBus.probe(moduleAddresses[i])) {
+            LOG_WARN(
+                "Module %d does not answer at %luHz, using 400kHz on bus %d", i, (unsigned long) moduleBus.getClock(),
+                moduleBuses[i]
+            );
+            moduleBus.setClock(I2C_FAST_CLOCK);
+        }
+    }
+
+    for (int i = 0; i < numModules; i++) {
+        TRACE_SCOPE("module.init", i);
+        modules[i].init(getBus(moduleBuses[i]));
+    }
+}
 
-    for (uint8_t i = 0; i < numModules; i++) {
-        modules[i].init();
+SplitFlapBus &SplitFlapDisplay::getBus(int index) {
+#if MAX_BUSES > 1
+    if (index == 1) {
+        return secondBus;
     }
+#endif
+    return bus;
 }
 
-void SplitFlapDisplay::updateOffsets() {
+void SplitFlapDisplay::updateOffsets(bool keepReference) {
     // Reload offsets from settings
     displayOffset = settings.getInt("displayOffset");
     
-    std::vector<int> settingOffsets = settings.getIntVector("moduleOffsets");
+    moduleOffsets = settings.getIntVector("moduleOffsets");
+    moduleOffsets.resize(numModules, 0);
+    magnetCorrections = settings.getIntVector("magnetCorrections");
+    magnetCorrections.resize(numModules, 0);
     for (int i = 0; i < numModules; i++) {
-        moduleOffsets[i] = settingOffsets[i];
         // Update each module's offset
-        modules[i].updateOffset(moduleOffsets[i] + displayOffset);
+        modules[i].updateOffset((moduleOffsets[i] + magnetCorrections[i] + displayOffset) * microsteps, keepReference);
     }
     
-    Serial.println("Module offsets updated dynamically");
-    Serial.print("Display Offset: ");
-    Serial.println(displayOffset);
-    Serial.print("Module Offsets: ");
-    for (int i = 0; i < numModules; i++) {
-        Serial.print(moduleOffsets[i]);
-        Serial.print(" ");
-    }
-    Serial.println();
+    LOG_INFO("Module offsets updated dynamically");
+    LOG_INFO("Display Offset: %d", displayOffset);
+    LOG_INFO("Module Offsets: %s", formatList(moduleOffsets.data(), numModules).c_str());
+}
+
+void SplitFlapDisplay::setHoldTime(int seconds) {
+    motion.setHoldTime(max(seconds, 0));
+    LOG_INFO("Hold time: %lus", (unsigned long) motion.getHoldTime());
+}
+
+void SplitFlapDisplay::setHallWindow(int steps) {
+    motion.setHallWindow(steps * microsteps);
+    LOG_INFO("Hall window: %d steps", motion.getHallWindow() / microsteps);
 }
 
 void SplitFlapDisplay::testAll() {
@@ -79,15 +176,11 @@ void SplitFlapDisplay::testAll() {
 
     int charPos;
     for (int i = 0; i < numChars; i++) {
-        // Serial.print("Target Positions: [");
         // fill array with same char
-
         for (int j = 0; j < numModules; j++) {
             targetPositions[j] = modules[j].getCharPosition(testChars[i]);
-            // Serial.print(targetPositions[j]);
-            // Serial.print(" , ");
         }
-        // Serial.println("]");
+        LOG_DEBUG("Target Positions: [%s]", formatList(targetPositions, numModules).c_str());
 
         moveTo(targetPositions);
         delay(500);
@@ -101,24 +194,23 @@ void SplitFlapDisplay::testRandom(float speed) {
     int targetPositions[numModules];
     char randChar;
 
-    Serial.print("Target: ");
+    String target;
     for (int i = 0; i < numModules; i++) {
         randChar = testChars[random(0, 37)];
         targetPositions[i] = modules[i].getCharPosition(randChar);
-        Serial.print(randChar);
+        target += randChar;
     }
-    Serial.println(" ");
+    LOG_INFO("Target: %s", target.c_str());
     moveTo(targetPositions, speed);
 }
 
 void SplitFlapDisplay::testModule(int moduleIndex, float speed) {
     if (moduleIndex < 0 || moduleIndex >= numModules) {
-        Serial.println("Invalid module index");
+        LOG_ERROR("Invalid module index %d", moduleIndex);
         return;
     }
 
-    Serial.print("Homing module ");
-    Serial.println(moduleIndex);
+    LOG_INFO("Homing module %d", moduleIndex);
 
     int targetPositions[numModules];
 
@@ -131,31 +223,110 @@ void SplitFlapDisplay::testModule(int moduleIndex, float speed) {
     // Move back one step to ensure we cross the magnet sensor
     targetPositions[moduleIndex] = (modules[moduleIndex].getPosition() - 1 + stepsPerRot) % stepsPerRot;
 
-    startMotors();
+    // The motion task energises the coils as part of the move, writing them from here could race its hold or release
     moveTo(targetPositions, speed, true, true);  // isHoming = true
 
-    Serial.print("Module ");
-    Serial.print(moduleIndex);
-    Serial.print(" homed to position: ");
-    Serial.println(modules[moduleIndex].getPosition());
+    LOG_INFO("Module %d homed to position: %d", moduleIndex, modules[moduleIndex].getPosition());
 
     // Move to blank space to show alignment
-    // Use smaller delays with yields to avoid watchdog timeout
-    for (int i = 0; i < 5; i++) {
-        delay(100);
-        yield();  // Allow other tasks to run
-    }
+    delay(500);
 
-    Serial.println("Moving to blank to show alignment");
+    LOG_INFO("Moving to blank to show alignment");
     for (int i = 0; i < numModules; i++) {
         targetPositions[i] = modules[i].getPosition();
     }
     targetPositions[moduleIndex] = modules[moduleIndex].getCharPosition(' ');
     moveTo(targetPositions, speed);
 
-    Serial.print("Module at position: ");
-    Serial.print(modules[moduleIndex].getPosition());
-    Serial.println(" (should show blank)");
+    LOG_INFO("Module at position: %d (should show blank)", modules[moduleIndex].getPosition());
+}
+
+void SplitFlapDisplay::requestModuleTest(int moduleIndex) {
+    pendingModuleTest = moduleIndex;
+}
+
+void SplitFlapDisplay::requestCalibration(int passes) {
+    pendingCalibration = constrain(passes, 1, CALIBRATION_MAX_PASSES);
+}
+
+void SplitFlapDisplay::calibrate(int passes) {
+    TRACE_SCOPE("display.calibrate", passes);
+    passes = constrain(passes, 1, CALIBRATION_MAX_PASSES);
+    calibrating = true;
+    LOG_INFO("Calibrating %d modules over %d passes", numModules, passes);
+
+    // Every module at once: at full speed to just before its magnet, then slowly over it with the sensor read after
+    // every step. The rising edge sets the count to the magnet position, so the falling edge gives the width.
+    std::vector<std::vector<int>> widths(numModules);
+    int targetPositions[numModules];
+    for (int pass = 0; pass < passes; pass++) {
+        for (int i = 0; i < numModules; i++) {
+            int start = modules[i].getMagnetPosition() - CALIBRATION_LEAD * microsteps;
+            targetPositions[i] = (start % stepsPerRot + stepsPerRot) % stepsPerRot;
+        }
+        moveTo(targetPositions, maxVel, false);
+
+        for (int i = 0; i < numModules; i++) {
+            targetPositions[i] = (targetPositions[i] + CALIBRATION_SCAN * microsteps) % stepsPerRot;
+        }
+        motion.setEdgeScan(true);
+        moveTo(targetPositions, CALIBRATION_RPM, false);
+        motion.setEdgeScan(false);
+        for (int i = 0; i < numModules; i++) {
+            int width = motion.getMagnetWidth(i);
+            if (width > 0) {
+                widths[i].push_back(width);
+            }
+        }
+    }
+
+    // A module whose sensor switches early reads a wider magnet and is homed before the centre, so it is corrected by
+    // half the difference to the average width. The correction is kept apart from the module's own offset, which
+    // records how its flaps sit against the magnet, something a scan cannot see, and a new run replaces it.
+    std::vector<int> corrections = magnetCorrections;
+    std::vector<ModuleCalibration> results(numModules);
+    float widthSum = 0;
+    int calibrated = 0;
+    for (int i = 0; i < numModules; i++) {
+        ModuleCalibration &result = results[i];
+        result = ModuleCalibration{(int) widths[i].size(), 0, 0, corrections[i], corrections[i], false};
+        if (widths[i].empty()) {
+            LOG_WARN("Module %d: magnet not found, check its sensor and offset", i);
+            continue;
+        }
+        int narrowest = *std::min_element(widths[i].begin(), widths[i].end());
+        int widest = *std::max_element(widths[i].begin(), widths[i].end());
+        float sum = 0;
+        for (int width : widths[i]) {
+            sum += width;
+        }
+        result.width = sum / widths[i].size() / microsteps;
+        result.spread = (float) (widest - narrowest) / microsteps;
+        result.calibrated = result.passes == passes && result.spread <= CALIBRATION_MAX_SPREAD;
+        if (result.calibrated) {
+            widthSum += result.width;
+            calibrated++;
+        } else {
+            LOG_WARN("Module %d: magnet %.1f steps wide, %.1f apart over %d of %d passes, not calibrated", i,
+                     result.width, result.spread, result.passes, passes);
+        }
+    }
+
+    if (calibrated > 0) {
+        for (int i = 0; i < numModules; i++) {
+            if (results[i].calibrated) {
+                results[i].correction = lroundf((widthSum / calibrated - results[i].width) / 2);
+                corrections[i] = results[i].correction;
+            }
+        }
+        settings.putIntVector("magnetCorrections", corrections); // one write for the whole board
+        updateOffsets(true);
+    }
+    calibration = results;
+    LOG_INFO("Calibrated %d of %d modules", calibrated, numModules);
+
+    writeChar(' ');
+    calibrating = false;
 }
 
 void SplitFlapDisplay::testCount() {
@@ -181,30 +352,21 @@ void SplitFlapDisplay::testCount() {
 
 // Private helper method: Perform the homing sequence
 void SplitFlapDisplay::performHomingSequence(float speed) {
-    Serial.println("Homing");
-    Serial.print("Initial positions: ");
-    for (int i = 0; i < numModules; i++) {
-        Serial.print(modules[i].getPosition());
-        Serial.print(" ");
-    }
-    Serial.println();
+    TRACE_SCOPE("display.homing");
+    LOG_INFO("Homing");
+    LOG_INFO("Initial positions: %s", formatPositions(modules).c_str());
 
     int targetPositions[numModules];
     for (int i = 0; i < numModules; i++) {
         targetPositions[i] = (modules[i].getPosition() - 1 + stepsPerRot) % stepsPerRot;
     }
-    startMotors();
-    moveTo(targetPositions, speed, false, true);  // isHoming = true
+    moveTo(targetPositions, speed, false, true);  // isHoming = true, the motion task energises the coils
 
-    Serial.print("Positions after magnet detection: ");
-    for (int i = 0; i < numModules; i++) {
-        Serial.print(modules[i].getPosition());
-        Serial.print(" ");
-    }
-    Serial.println();
+    LOG_INFO("Positions after magnet detection: %s", formatPositions(modules).c_str());
 }
 
 void SplitFlapDisplay::home(float speed) {
+    TRACE_SCOPE("display.home");
     performHomingSequence(speed);
 
     // Move to blank space
@@ -213,24 +375,15 @@ void SplitFlapDisplay::home(float speed) {
         targetPositions[i] = modules[i].getCharPosition(' ');
     }
 
-    Serial.print("Target positions for blank: ");
-    for (int i = 0; i < numModules; i++) {
-        Serial.print(targetPositions[i]);
-        Serial.print(" ");
-    }
-    Serial.println();
+    LOG_INFO("Target positions for blank: %s", formatList(targetPositions, numModules).c_str());
 
     moveTo(targetPositions, speed);
 
-    Serial.print("Final positions: ");
-    for (int i = 0; i < numModules; i++) {
-        Serial.print(modules[i].getPosition());
-        Serial.print(" ");
-    }
-    Serial.println();
+    LOG_INFO("Final positions: %s", formatPositions(modules).c_str());
 }
 
 void SplitFlapDisplay::homeToString(String homeString, float speed, bool centering) {
+    TRACE_SCOPE("display.homeToString");
     performHomingSequence(speed);
     writeString(homeString, speed, centering);
 }
@@ -249,11 +402,14 @@ void SplitFlapDisplay::writeChar(char inputChar, float speed) {
     moveTo(targetPositions, speed);
 }
 
-void SplitFlapDisplay::writeString(String inputString, float speed, bool centering) {
-    String displayString = inputString.substring(0, numModules);
+String SplitFlapDisplay::layoutString(const String &inputString, bool centering, int width) {
+    if (width < 0) {
+        width = numModules;
+    }
+    String displayString = charset->encode(inputString).substring(0, width); // one code per module
 
     if (centering) {
-        int totalPadding = numModules - displayString.length();
+        int totalPadding = width - displayString.length();
         int paddingLeft = totalPadding / 2;
         int paddingRight = totalPadding - paddingLeft;
 
@@ -271,14 +427,15 @@ void SplitFlapDisplay::writeString(String inputString, float speed, bool centeri
             result += " ";
         }
         displayString = result;
-    } else {                                          // pad blanks to end, if no centering
-        while (displayString.length() < numModules) { // Pad with spaces
-            displayString += " ";                     // Padding with space
+    } else {                                           // pad blanks to end, if no centering
+        while ((int) displayString.length() < width) { // Pad with spaces
+            displayString += " ";                      // Padding with space
         }
     }
+    return displayString;
+}
 
-    int targetPositions[numModules];
-
+void SplitFlapDisplay::getTargetPositions(const String &displayString, int targetPositions[]) {
     // Initialize all positions to blank space first
     for (int i = 0; i < numModules; i++) {
         targetPositions[i] = modules[i].getCharPosition(' ');
@@ -287,175 +444,171 @@ void SplitFlapDisplay::writeString(String inputString, float speed, bool centeri
     // Then set positions for the actual characters in the string
     for (int i = 0; i < displayString.length() && i < numModules; i++) {
         char currentChar = displayString[i];
-        // Serial.println(currentChar);
         targetPositions[i] = modules[i].getCharPosition(currentChar);
     }
-    moveTo(targetPositions, speed);
+}
+
+void SplitFlapDisplay::writeString(String inputString, float speed, bool centering, bool wait) {
+    String displayString = layoutString(inputString, centering);
+
+    int targetPositions[numModules];
+    getTargetPositions(displayString, targetPositions);
 
-    if (mqtt && mqtt->isConnected()) {
-        mqtt->publishState(displayString);
+    MotionPlan plan = motion.plan(targetPositions, getTimePerStep(speed));
+    if (! startMove(targetPositions, speed)) {
+        return;
+    }
+
+    // published by tick() once the modules have arrived, the ETA straight away
+    pendingState = charset->decode(displayString);
+    statePending = true;
+    pendingEtaMs = plan.totalMs;
+    pendingEtaTime = millis();
+    etaPending = true;
+
+    if (wait) {
+        waitUntilIdle();
     }
 }
 
+MotionPlan SplitFlapDisplay::planString(const String &inputString, float speed, bool centering) {
+    int targetPositions[numModules];
+    getTargetPositions(layoutString(inputString, centering), targetPositions);
+    return motion.plan(targetPositions, getTimePerStep(speed));
+}
+
 void SplitFlapDisplay::moveTo(int targetPositions[], float speed, bool releaseMotors, bool isHoming) {
+    if (startMove(targetPositions, speed, releaseMotors, isHoming)) {
+        waitUntilIdle();
+    }
+}
+
+bool SplitFlapDisplay::startMove(int targetPositions[], float speed, bool releaseMotors, bool isHoming) {
     // Validate input parameters
     if (targetPositions == nullptr) {
-        Serial.println("ERROR: targetPositions is null, aborting moveTo");
-        return;
+        LOG_ERROR("targetPositions is null, aborting moveTo");
+        return false;
     }
 
     // Validate all target positions are within valid range
     for (int i = 0; i < numModules; i++) {
         if (targetPositions[i] < 0 || targetPositions[i] >= stepsPerRot) {
-            Serial.printf("ERROR: Module %d target position %d out of range (0-%d), aborting moveTo\n",
-                         i, targetPositions[i], stepsPerRot - 1);
-            return;
+            LOG_ERROR("Module %d target position %d out of range (0-%d), aborting moveTo", i, targetPositions[i],
+                      stepsPerRot - 1);
+            return false;
         }
     }
 
+    motion.post(targetPositions, getTimePerStep(speed), releaseMotors, isHoming);
+    return true;
+}
+
+float SplitFlapDisplay::getTimePerStep(float speed) const {
     speed = constrain(speed, 2, maxVel);
     float stepsPerSecond = (speed / 60) * stepsPerRot;
-    float timePerStep = 1000000 / stepsPerSecond;
+    return 1000000 / stepsPerSecond;
+}
 
-    unsigned long currentTime = micros();
+void SplitFlapDisplay::tick() {
+    metrics.tickLoop();
+    if (! motion.hasTask()) {
+        motion.tick();
+    }
 
-    // Use predefined timing constants for reliable operation
+    drift.update(modules.data(), ! motion.isRunning(), driftCorrection); // before a new move starts
 
-    bool resetLatches[numModules] = {}; // Initialize to false //start with latch on to prevent case where the
-    // motion starts with the magnet over the sensor
-    bool needsStepping[numModules] = {};             // Initialize to false; //modules that still require moving
-    unsigned long lastStepTimes[numModules] = {};    // Initialize to false; //track when each module was last stepped
-    unsigned long lastSensorCheckTime = currentTime; // track when we last read all the hall effect sensors
-    bool sensorTriggered[numModules] = {};           // Track which modules triggered their hall sensor
+    runCommands();
 
-    for (int i = 0; i < numModules; i++) {
-        targetPositions[i] = constrain(
-            targetPositions[i],
-            0,
-            stepsPerRot - 1
-        ); // Constrain to avoid errors with incorrect inputs
-        resetLatches[i] = true;
-        lastStepTimes[i] = currentTime;
-        if (modules[i].getPosition() != targetPositions[i]) {
-            needsStepping[i] = true;
-        } else {
-            needsStepping[i] = false;
-        }
+    publishPendingState();
+    for (int i = 0; i < numBuses; i++) {
+        getBus(i).reportErrors();
     }
+    SplitFlapModule::reportUnknownChars(*charset);
 
-    // Wake up all motors before starting movement
-    // This gentle sequence ensures coils are energized and overcomes static friction
-    for (int i = 0; i < numModules; i++) {
-        modules[i].wakeUp();
+    // Module tests block until the module has moved, so web requests hand them over to loop() instead
+    if (pendingModuleTest >= 0 && ! motion.isRunning()) {
+        int moduleIndex = pendingModuleTest;
+        pendingModuleTest = -1;
+        testModule(moduleIndex);
     }
+    if (pendingCalibration > 0 && ! motion.isRunning()) {
+        int passes = pendingCalibration;
+        calibrate(passes);
+        pendingCalibration = 0; // only now, so isCalibrating() does not blink off before calibrate() starts
+    }
+}
 
-    startMotors(); // not sure if this helps or not, likely that it does not based
-    // on testing
-    delay(MOTOR_START_STOP_DELAY_MS); // give the motor time to align to magnetic field
-
-    bool isFinished = checkAllFalse(needsStepping, numModules);
-    unsigned long lastWatchdogFeed = millis();
-
-    while (! isFinished) {
-        currentTime = micros();
+bool SplitFlapDisplay::queueString(
+    const String &inputString, CommandSource source, CommandPriority priority, bool centering, float speed
+) {
+    return commands.push({CommandType::Text, source, priority, inputString, centering, speed, 0});
+}
 
-        // Feed the watchdog timer periodically to prevent timeout
-        if (millis() - lastWatchdogFeed > WATCHDOG_FEED_INTERVAL_MS) {
-            yield();
-            esp_task_wdt_reset();  // Reset the task watchdog timer
-            lastWatchdogFeed = millis();
-        }
+bool SplitFlapDisplay::queueHome(CommandSource source, float speed) {
+    return commands.push({CommandType::Home, source, CommandPriority::Home, "", true, speed, 0});
+}
 
-        for (int i = 0; i < numModules; i++) {
-            if (((currentTime - lastStepTimes[i]) > timePerStep) && needsStepping[i]) {
-                modules[i].step();
-                lastStepTimes[i] = micros();
-                if (modules[i].getPosition() == targetPositions[i]) { // this module is not in the correct position,
-                    // requires stepping
-                    needsStepping[i] = false;
-                }
-            }
-        }
+void SplitFlapDisplay::runCommands() {
+    // Text of a higher priority cuts into the move in progress by retargeting it, anything else waits for it. Slices
+    // from the cluster always cut in, the other controllers start theirs at the same time whatever they were doing.
+    bool running = motion.isRunning();
+    DisplayCommand command;
+    auto ready = [&](const DisplayCommand &next) {
+        return ! running ||
+            (next.type == CommandType::Text &&
+             (next.priority > runningPriority || next.source == CommandSource::Cluster));
+    };
+    if (! commands.popIf(ready, command)) {
+        return;
+    }
 
-        if ((currentTime - lastSensorCheckTime) > HALL_EFFECT_CHECK_INTERVAL_US) { // check hall effect sensor every checkIntervalMs
-            // check every modules sensor
-            for (int i = 0; i < numModules; i++) {
-                if (needsStepping[i] &&
-                    (modules[i].readHallEffectSensor() == true
-                    )) { // only check sensors where the module is still moving
-                    if (! resetLatches[i]) {
-                        // Track that this module's sensor was triggered (for debug summary)
-                        sensorTriggered[i] = true;
-
-                        // UNCOMMENTING THIS WILL PROBBALY MAKE THE MOTORS INACCURATE, DUE
-                        // TO TIME TAKEN TO PRINT
-                        //  Serial.print("Module: ");
-                        //  Serial.print(i);
-                        //  Serial.print(" Magnet Position: ");
-                        //  Serial.print(modules[i].getMagnetPosition());
-                        //  Serial.print(" Actual Position: ");
-                        //  Serial.print(modules[i].getPosition());
-                        //  Serial.print(" Error: ");
-                        //  Serial.println((modules[i].getMagnetPosition() -
-                        //  modules[i].getPosition()));
-                        modules[i].magnetDetected(); // update position to the modules
-                        // magnet position
-                        resetLatches[i] = true;
-                    }
-                } else if (resetLatches[i] == true) {
-                    resetLatches[i] = false;
-                }
-            }
-            isFinished = checkAllFalse(needsStepping, numModules);
-            lastSensorCheckTime = currentTime; // recall micros because for loop may
-            // take a moment to execute
-        }
+    // The cluster leader shows text over the whole board, it comes back as this controller's slice when it is due
+    if (cluster != nullptr && cluster->isLeader() && command.type == CommandType::Text &&
+        command.source != CommandSource::Cluster && cluster->distribute(command)) {
+        return;
     }
-    if (releaseMotors) {
-        delay(MOTOR_START_STOP_DELAY_MS); // allow all motors time to settle
-        stopMotors();
+
+    if (running) {
+        commands.countPreempted();
     }
+    runningPriority = command.priority;
+    TRACE_INSTANT("command", (int) command.source);
 
-    // Print hall sensor summary if this is a homing operation
-    if (isHoming) {
-        Serial.print("Hall sensor summary - Triggered modules: ");
-        bool anyTriggered = false;
-        for (int i = 0; i < numModules; i++) {
-            if (sensorTriggered[i]) {
-                if (anyTriggered) {
-                    Serial.print(", ");
-                }
-                Serial.print(i);
-                anyTriggered = true;
-            }
-        }
-        if (!anyTriggered) {
-            Serial.print("None");
-        }
-        Serial.println();
+    switch (command.type) {
+        case CommandType::Text: writeString(command.text, command.speed, command.centering, false); break;
+        case CommandType::Home: home(command.speed); break; // blocks until every module is back on blank
     }
 }
 
-bool SplitFlapDisplay::checkAllFalse(bool array[], int size) {
-    for (int i = 0; i < size; i++) {
-        if (array[i] == true) {
-            return false;              // As soon as a true value is found, return false
+void SplitFlapDisplay::waitUntilIdle() {
+    if (motion.hasTask()) {
+        // the motion task does the stepping, sleeping here lets the idle task run so the watchdog stays fed
+        while (motion.isRunning()) {
+            delay(1);
+        }
+    } else {
+        while (motion.isBusy()) {
+            motion.tick();
         }
     }
-    return true;                       // All values were false
+
+    publishPendingState();
 }
 
-void SplitFlapDisplay::startMotors() { // Probably broken somewhere, not sure
-    // why, haven't looked
-    for (int i = 0; i < numModules; i++) {
-        modules[i].start();
+void SplitFlapDisplay::publishPendingState() {
+    if (etaPending) {
+        etaPending = false;
+        if (mqtt && mqtt->isConnected()) {
+            unsigned long elapsed = millis() - pendingEtaTime;
+            mqtt->publishEta(pendingState, pendingEtaMs - min(elapsed, pendingEtaMs));
+        }
     }
-}
 
-void SplitFlapDisplay::stopMotors() {
-    // Serial.println("Stopping Motors");
-    for (int i = 0; i < numModules; i++) {
-        modules[i].stop();
+    if (statePending && ! motion.isRunning()) {
+        statePending = false;
+        if (mqtt && mqtt->isConnected()) {
+            mqtt->publishState(pendingState);
+        }
     }
 }
 
@@ -1,18 +1,35 @@
 #pragma once
 
 #include "JsonSettings.h"
+#include "SplitFlapCommandQueue.h"
 #include "SplitFlapModule.h"
+#include "SplitFlapMotion.h"
 
 #include <Arduino.h>
+#include <vector>
 
-#define MAX_MODULES 8 // for memory allocation, update if more modules
-#define MAX_RPM 15.0f
+#define MAX_RPM         30.0f // hard cap, the maxVel setting picks the cruise speed below it
+#define RAMP_START_RPM  10.0f // speed the motors start and stop at, the ramps accelerate from here
 
-// Timing constants for motor control
-#define HALL_EFFECT_CHECK_INTERVAL_US  (20 * 1000)  // 20ms minimum to avoid sensor bouncing
-#define MOTOR_START_STOP_DELAY_MS      200          // Time for motor to align to magnetic field
-#define WATCHDOG_FEED_INTERVAL_MS      100          // Feed watchdog every 100ms during operations
+#define CALIBRATION_PASSES     2    // scans over each magnet, a drum revolution apiece
+#define CALIBRATION_MAX_PASSES 10
+#define CALIBRATION_RPM        5.0f // scan speed, slow enough for a sensor read after every step on a full board
+#define CALIBRATION_LEAD       32   // full steps before the magnet position a scan starts, room for an offset that is off
+#define CALIBRATION_SCAN       160  // full steps a scan covers, both margins and the magnet between them
+#define CALIBRATION_MAX_SPREAD 4    // full steps the width may vary between passes before a module is left alone
 
+// What calibrate() found for one module, in full steps
+struct ModuleCalibration
+{
+    int passes;      // scans that saw both edges of the magnet
+    float width;     // from the rising to the falling edge, averaged over those
+    float spread;    // widest minus narrowest
+    int oldCorrection;
+    int correction;  // saved to magnetCorrections, the old one when the module was not calibrated
+    bool calibrated; // every pass saw both edges and the widths agreed
+};
+
+class SplitFlapCluster;
 class SplitFlapMqtt;
 
 class SplitFlapDisplay {
@@ -20,14 +37,33 @@ class SplitFlapDisplay {
     SplitFlapDisplay(JsonSettings &settings);
 
     void init();
-    void updateOffsets();  // Update offsets without full reinit
+    void updateOffsets(bool keepReference = false); // Update offsets without full reinit, keepReference skips homing
+    void setHoldTime(int seconds); // keep coils energised between back-to-back moves, 0 to release after every move
+    void setHallWindow(int steps); // full steps either side of the magnet read densely, 0 to poll every sensor
+    void setDriftCorrection(bool enabled) { driftCorrection = enabled; } // off only records the drift
     void writeString(
         String inputString, float speed = MAX_RPM,
-        bool centering = true
+        bool centering = true, bool wait = true
     );                                     // Move all modules at once to show a specific string
+    MotionPlan planString(
+        const String &inputString, float speed = MAX_RPM, bool centering = true
+    );                                     // steps and time writeString would take, without moving
     void writeChar(char inputChar,
                    float speed = MAX_RPM); // sets all modules to a single char
     void moveTo(int targetPositions[], float speed = MAX_RPM, bool releaseMotors = true, bool isHoming = false);
+    bool startMove(
+        int targetPositions[], float speed = MAX_RPM, bool releaseMotors = true,
+        bool isHoming = false
+    );                                     // like moveTo, but returns straight away and lets tick() do the moving
+    bool queueString(
+        const String &inputString, CommandSource source, CommandPriority priority = CommandPriority::Text,
+        bool centering = true, float speed = MAX_RPM
+    );                                     // writeString from tick() once the display is free, safe from any task
+    bool queueHome(CommandSource source, float speed = MAX_RPM); // home from tick(), safe from any task
+    CommandQueueStats getQueueStats() { return commands.getStats(); }
+    void tick();                           // publish finished moves and run deferred work, call from loop()
+    bool isBusy() const { return motion.isRunning(); }
+    void waitUntilIdle();                  // block until the move in progress has finished
     void home(float speed = MAX_RPM);      // move home
     void homeToString(
         String homeString, float speed = MAX_RPM,
@@ -39,32 +75,77 @@ class SplitFlapDisplay {
     void testCount();
     void testRandom(float speed = MAX_RPM);
     void testModule(int moduleIndex, float speed = MAX_RPM); // Test single module: A -> 0 -> blank
+    void requestModuleTest(int moduleIndex); // run testModule from the next tick(), safe to call from other tasks
+    void calibrate(int passes = CALIBRATION_PASSES); // scan every magnet and save corrections that centre them alike
+    void requestCalibration(int passes = CALIBRATION_PASSES); // calibrate from the next tick(), from any task
+    bool isCalibrating() const { return pendingCalibration > 0 || calibrating; }
+    const std::vector<ModuleCalibration> &getCalibration() const { return calibration; } // of the last run
     int getNumModules() { return numModules; }
     int getCharsetSize() const { return charSetSize; }
+    const SplitFlapCharset &getCharset() const { return *charset; }
     void setMqtt(SplitFlapMqtt *mqttHandler);
-    SplitFlapModule* getModules() { return modules; }       // Get access to modules array for testing
+    void setCluster(SplitFlapCluster *cluster) { this->cluster = cluster; } // the leader splits text it is given
+    String layoutString(
+        const String &inputString, bool centering, int width = -1
+    );                                     // one code per module of a board width wide, numModules if -1, padded
+    SplitFlapModule* getModules() { return modules.data(); } // Get access to modules array for testing
+    const SplitFlapMotion &getMotion() const { return motion; }
+    SplitFlapBus &getBus(int index = 0); // the bus on Wire, 1 for the one on Wire1
+    int getNumBuses() const { return numBuses; }
+    std::vector<ModuleDrift> getDrift() { return drift.getModules(); } // magnet crossings of each module
+    unsigned long getDriftDropped() const { return drift.getDropped(); }
+    const SplitFlapMetrics &getMetrics() const { return metrics; }
+    int getMicrosteps() const { return microsteps; } // steps of the step mode per full step
 
   private:
     JsonSettings &settings;
 
-    bool checkAllFalse(bool array[], int size);
-    void stopMotors();
-    void startMotors();
     void performHomingSequence(float speed);  // Shared homing logic
+    void publishPendingState();
+    void runCommands();                  // start the next queued command the display is free for
+    void getTargetPositions(const String &displayString, int targetPositions[]);
+    float getTimePerStep(float speed) const; // microseconds per step at speed RPM, capped at maxVel
 
-    int numModules;
-    uint8_t moduleAddresses[MAX_MODULES];
-    SplitFlapModule modules[MAX_MODULES];
-    int moduleOffsets[MAX_MODULES];
+    int numModules = 0;
+    std::vector<int> moduleAddresses; // sized by init, from the moduleCount setting
+    std::vector<int> moduleBuses;     // bus of each module, 0 for bus and 1 for secondBus
+    SplitFlapBus bus;
+#if MAX_BUSES > 1
+    SplitFlapBus secondBus{Wire1};    // on the sda2Pin and scl2Pin settings, unused while they are -1
+#endif
+    int numBuses = 1;
+    std::vector<SplitFlapModule> modules;
+    SplitFlapMotion motion;
+    SplitFlapDrift drift;
+    bool driftCorrection = true; // move magnet positions by the steady drift SplitFlapDrift finds
+    SplitFlapMetrics metrics;
+    SplitFlapCommandQueue commands;
+    CommandPriority runningPriority = CommandPriority::Ambient; // of the last command started from the queue
+    std::vector<int> moduleOffsets;
+    std::vector<int> magnetCorrections; // added to moduleOffsets, found by calibrate() rather than set by hand
     int displayOffset;
 
     float maxVel;       // Max Velocity In RPM
-    int charSetSize;    // 37 for standard, 48 for extended
+    float accel;        // acceleration in RPM per second, 0 to step at a constant speed
+    const SplitFlapCharset *charset = &StandardCharset; // picked by the charset setting
+    int charSetSize;    // 37 for standard, 48 for extended, any for custom
     int stepsPerRot;    // number of motor steps per full rotation of character
-                        // drum
+                        // drum, in the steps of the step mode
+    int stepMode;       // STEP_MODE_FULL, STEP_MODE_HALF or STEP_MODE_WAVE
+    int microsteps;     // steps of the step mode per full step, positions and offsets in settings are full steps
     int magnetPosition; // position of drum wheel when magnet is detected
     int SDAPin;         // SDA pin
     int SCLPin;         // SCL pin
 
     SplitFlapMqtt *mqtt = nullptr;
+    SplitFlapCluster *cluster = nullptr;
+    String pendingState;       // string to publish once the move showing it has finished
+    bool statePending = false;
+    unsigned long pendingEtaMs = 0;  // time the move to pendingState was planned to take
+    unsigned long pendingEtaTime = 0; // millis() when it started
+    bool etaPending = false;
+    volatile int pendingModuleTest = -1; // module index requested through requestModuleTest, -1 for none
+    volatile int pendingCalibration = 0; // passes requested through requestCalibration, 0 for none
+    volatile bool calibrating = false;
+    std::vector<ModuleCalibration> calibration;
 };
@@ -5,8 +5,11 @@
 
 // Enjoy :)
 #include "JsonSettings.h"
+#include "SplitFlapCluster.h"
 #include "SplitFlapDisplay.h"
+#include "SplitFlapLog.h"
 #include "SplitFlapMqtt.h"
+#include "SplitFlapTrace.h"
 #include "SplitFlapWebServer.h"
 
 #include <Arduino.h>
@@ -51,17 +54,34 @@ JsonSettings settings = JsonSettings("config", {
     {"mqtt_port", JsonSetting(MQTT_PORT)},
     {"mqtt_user", JsonSetting(MQTT_USER)},
     {"mqtt_pass", JsonSetting(MQTT_PASS)},
+    {"metricsInterval", JsonSetting(0)}, // seconds between metrics over MQTT, 0 for none
     // Hardware Settings
     {"moduleCount", JsonSetting(8)},
     {"moduleAddresses", JsonSetting({0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27})},
+    {"moduleBuses", JsonSetting(std::vector<int>())}, // 0 for Wire, 1 for Wire1
     {"magnetPosition", JsonSetting(730)},
     {"moduleOffsets", JsonSetting({0, -30, -20, 0, 0, 0, 0, 0})},
+    {"magnetCorrections", JsonSetting(std::vector<int>())}, // added to moduleOffsets, saved by Calibrate All
     {"displayOffset", JsonSetting(0)},
     {"sdaPin", JsonSetting(8)},
     {"sclPin", JsonSetting(9)},
+    {"sda2Pin", JsonSetting(-1)},
+    {"scl2Pin", JsonSetting(-1)},
+    {"i2cClock", JsonSetting(400000)},
+    {"hallIntPin", JsonSetting(-1)},
+    {"hallWindow", JsonSetting(32)},
+    {"driftCorrection", JsonSetting(1)},
     {"stepsPerRot", JsonSetting(2048)},
-    {"maxVel", JsonSetting(15.0f)},
+    {"stepMode", JsonSetting(0)},
+    {"maxVel", JsonSetting(20.0f)},
+    {"accel", JsonSetting(30.0f)},
     {"charset", JsonSetting(37)},
+    {"holdTime", JsonSetting(0)},
+    // Cluster Settings
+    {"clusterRole", JsonSetting(0)},    // 0 on its own, 1 leader, 2 member
+    {"clusterSlot", JsonSetting(0)},    // place on the board, lowest on the left
+    {"clusterLeader", JsonSetting("")}, // IP address of the leader, for members
+    {"clusterPort", JsonSetting(4210)},
     // Operational States
     {"mode", JsonSetting(0)}
 });
@@ -71,16 +91,19 @@ WiFiClient wifiClient;
 SplitFlapDisplay display(settings);
 SplitFlapWebServer webServer(settings);
 SplitFlapMqtt splitflapMqtt(settings, wifiClient);
+SplitFlapCluster cluster(settings);
 
 void setup() {
     // put your setup code here, to run once:
     Serial.begin(SERIAL_SPEED);
+    SplitFlapLog::begin();
 
 #ifdef STARTUP_DELAY
     delay(STARTUP_DELAY);
 #endif
+    TRACE_SCOPE("setup"); // the startup delay is left out, it is only there for the serial monitor to catch up
 
-    Serial.println("Init Web Server");
+    LOG_INFO("Init Web Server");
     webServer.init();
 
     if (! webServer.connectToWifi()) {
@@ -109,6 +132,8 @@ void setup() {
         splitflapMqtt.setDisplay(&display);
         splitflapMqtt.setWebServer(&webServer);  // Connect web server to MQTT for state updates
         display.setMqtt(&splitflapMqtt);
+        cluster.setup(display);
+        webServer.setCluster(&cluster);
 
         display.homeToString("OK");
         delay(250);
@@ -118,6 +143,9 @@ void setup() {
 
 void loop() {
     splitflapMqtt.loop();
+    cluster.loop(); // hands slices to the display when they are due, the tick() right after starts them
+    display.tick(); // publish finished moves, runs the motion engine too when it has no task of its own
+    settings.tick(); // write settings changed by the web server or MQTT to NVS
 
     // check what mode the display is in, this value is updated by the web server
     switch (webServer.getMode()) {
@@ -143,7 +171,7 @@ void loop() {
 void singleInputMode() {
     String userInput = webServer.getInputString();
     if (userInput != webServer.getWrittenString()) {
-        display.writeString(userInput, MAX_RPM, webServer.getCentering());
+        display.queueString(userInput, CommandSource::Web, CommandPriority::Text, webServer.getCentering());
         webServer.setWrittenString(userInput);
     }
 }
@@ -154,7 +182,7 @@ void multiInputMode() {
         String userInput = webServer.getMultiInputString();
         String currWord = extractFromCSV(userInput, webServer.getMultiWordCurrentIndex());
         if (currWord != webServer.getWrittenString()) {
-            display.writeString(currWord, MAX_RPM, webServer.getCentering());
+            display.queueString(currWord, CommandSource::Local, CommandPriority::Ambient, webServer.getCentering());
             webServer.setWrittenString(currWord);
         }
         webServer.setLastSwitchMultiTime(millis());
@@ -171,7 +199,7 @@ void dateMode() {
         String result = renderDate(strftimeFormat);
 
         if (result.length() <= display.getNumModules() && result != webServer.getWrittenString()) {
-            display.writeString(result, MAX_RPM);
+            display.queueString(result, CommandSource::Local, CommandPriority::Ambient);
             webServer.setWrittenString(result);
         }
     }
@@ -190,7 +218,7 @@ void timeMode() {
 
         // Write to display if it changed
         if (result != webServer.getWrittenString()) {
-            display.writeString(result, MAX_RPM);
+            display.queueString(result, CommandSource::Local, CommandPriority::Ambient);
             webServer.setWrittenString(result);
         }
     }
@@ -206,13 +234,13 @@ void manualMode() {
     
     // Check for #home command
     if (userInput == "#home") {
-        Serial.println("Homing display...");
-        display.home();
-        webServer.setInputString("");  // Clear the command after execution
+        LOG_INFO("Homing display...");
+        display.queueHome(CommandSource::Web);
+        webServer.setInputString("");  // Clear the command once it is queued
         webServer.setWrittenString("");
     } else if (userInput != webServer.getWrittenString() && userInput != "") {
         // Normal text display
-        display.writeString(userInput, MAX_RPM, webServer.getCentering());
+        display.queueString(userInput, CommandSource::Web, CommandPriority::Text, webServer.getCentering());
         webServer.setWrittenString(userInput);
     }
 }
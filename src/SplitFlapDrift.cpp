@@ -0,0 +1,106 @@
+#include "SplitFlapDrift.h"
+
+#include "SplitFlapLog.h"
+
+#include <math.h>
+
+bool DriftLog::push(const DriftRecord &record) {
+    uint32_t at = head.load(std::memory_order_relaxed);
+    if (at - tail.load(std::memory_order_acquire) >= DRIFT_LOG_LENGTH) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    records[at % DRIFT_LOG_LENGTH] = record;
+    head.store(at + 1, std::memory_order_release); // publishes the record
+    return true;
+}
+
+bool DriftLog::pop(DriftRecord &record) {
+    uint32_t at = tail.load(std::memory_order_relaxed);
+    if (at == head.load(std::memory_order_acquire)) return false;
+    record = records[at % DRIFT_LOG_LENGTH];
+    tail.store(at + 1, std::memory_order_release); // hands the slot back
+    return true;
+}
+
+void SplitFlapDrift::setModules(int count, int microsteps) {
+    std::lock_guard<std::mutex> guard(lock);
+    modules.assign(count, ModuleDrift{});
+    this->microsteps = microsteps;
+}
+
+void SplitFlapDrift::update(SplitFlapModule *displayModules, bool idle, bool correct) {
+    std::lock_guard<std::mutex> guard(lock);
+    DriftRecord entry;
+    while (log.pop(entry)) {
+        if (entry.module < 0 || entry.module >= (int) modules.size()) continue;
+        record(entry.module, entry.drift, entry.rotations);
+    }
+
+    // The motion engine owns the modules while it moves them
+    if (! idle) return;
+    for (int i = 0; i < (int) modules.size(); i++) {
+        int correction = correct ? modules[i].correction : 0;
+        if (displayModules[i].getDriftCorrection() != correction) displayModules[i].setDriftCorrection(correction);
+    }
+}
+
+std::vector<ModuleDrift> SplitFlapDrift::getModules() {
+    std::lock_guard<std::mutex> guard(lock);
+    return modules;
+}
+
+void SplitFlapDrift::record(int module, int drift, int rotations) {
+    ModuleDrift &m = modules[module];
+    m.crossings++;
+    m.missed += rotations - 1;
+    if (drift > 0) m.stepsLost += drift;
+    else m.stepsGained -= drift;
+
+    // Judged per rotation, a steady drift doubles over a crossing that was missed
+    drift = (drift + (drift < 0 ? -rotations : rotations) / 2) / rotations;
+    m.last = drift;
+    m.histogram.record(abs(drift) / microsteps, SplitFlapMetrics::DriftBucketsSteps);
+    if (abs(drift) > abs(m.worst)) m.worst = drift;
+
+    m.window[m.windowNext] = drift;
+    m.windowNext = (m.windowNext + 1) % DRIFT_WINDOW;
+    if (m.windowCount < DRIFT_WINDOW) m.windowCount++;
+    evaluate(module);
+}
+
+void SplitFlapDrift::evaluate(int module) {
+    ModuleDrift &m = modules[module];
+    float sum = 0;
+    int largest = 0;
+    for (int i = 0; i < m.windowCount; i++) {
+        sum += m.window[i];
+        largest = max(largest, abs(m.window[i]));
+    }
+    m.mean = sum / m.windowCount;
+    float squares = 0;
+    for (int i = 0; i < m.windowCount; i++) squares += (m.window[i] - m.mean) * (m.window[i] - m.mean);
+    m.deviation = sqrtf(squares / m.windowCount);
+
+    bool trouble = largest >= DRIFT_TROUBLE_STEPS * microsteps
+                   || (m.windowCount == DRIFT_WINDOW && m.deviation >= DRIFT_TROUBLE_NOISE * microsteps);
+    if (trouble != m.trouble) {
+        m.trouble = trouble;
+        if (trouble) {
+            LOG_WARN("Module %d drifts %s (%d steps, deviation %.1f), check its mechanics", module,
+                     largest >= DRIFT_TROUBLE_STEPS * microsteps ? "too far" : "erratically", m.last, m.deviation);
+        } else {
+            LOG_INFO("Module %d drifts steadily again", module);
+        }
+    }
+
+    // Only a full window of steady crossings says anything about the steps per rotation. The drift is measured in
+    // the module's own frame, so a correction does not change it and is not piled up crossing after crossing.
+    if (m.windowCount < DRIFT_WINDOW || trouble || m.deviation > DRIFT_CORRECT_NOISE * microsteps) return;
+    if (fabsf(m.mean) < DRIFT_CORRECT_MIN * microsteps) {
+        m.correction = 0;
+        return;
+    }
+    int limit = DRIFT_CORRECT_MAX * microsteps;
+    m.correction = constrain((int) lroundf(-m.mean / 2), -limit, limit);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "SplitFlapMetrics.h"
+#include "SplitFlapModule.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define DRIFT_LOG_LENGTH    64 // magnet crossings waiting to be counted, a power of two
+#define DRIFT_WINDOW        8  // latest crossings of a module its drift is judged on
+#define DRIFT_CORRECT_MIN   4  // full steps, a steady drift smaller than this is left alone, sensor lag gets close
+#define DRIFT_CORRECT_NOISE 2  // full steps of standard deviation, a drift noisier than this is not corrected
+#define DRIFT_CORRECT_MAX   16 // full steps, the furthest a correction moves the magnet position
+#define DRIFT_TROUBLE_STEPS 32 // full steps off at a single crossing, the drum slipped or bound
+#define DRIFT_TROUBLE_NOISE 8  // full steps of standard deviation, steps are lost and found at random
+
+// How far a module's step count was off when its magnet came by, in steps of the step mode
+struct DriftRecord
+{
+    int16_t module;
+    int16_t drift;     // positive when the count ran ahead of the drum, as it does when steps are lost
+    int16_t rotations; // of the drum since the last crossing that was seen
+    uint32_t timeMs;   // millis() of the crossing
+};
+
+// Single producer, single consumer ring of crossings: the motion engine pushes from the stepping path and loop()
+// pops. Each side only moves its own index, so neither takes a lock and a push costs a copy and two atomics.
+class DriftLog {
+  public:
+    bool push(const DriftRecord &record); // false when full, the record is dropped and counted
+    bool pop(DriftRecord &record);
+    unsigned long getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+  private:
+    DriftRecord records[DRIFT_LOG_LENGTH];
+    std::atomic<uint32_t> head{0}; // next to write, moved by push() only
+    std::atomic<uint32_t> tail{0}; // next to read, moved by pop() only
+    std::atomic<unsigned long> dropped{0};
+};
+
+// Drift of one module since boot, and over its last DRIFT_WINDOW crossings
+struct ModuleDrift
+{
+    unsigned long crossings; // magnet crossings with a known position before them
+    unsigned long missed;    // crossings not seen, the move ended over the magnet
+    int last;                // drift per rotation at the latest one
+    int worst;               // largest drift either way
+    long stepsLost;          // positive drifts added up
+    long stepsGained;        // negative drifts added up, as a positive number
+    float mean;              // over the window, once it is full
+    float deviation;         // standard deviation over the window
+    int correction;          // steps the module's magnet position and count are moved by
+    bool trouble;            // drift too large or too erratic for the mechanics to be sound
+    MetricsHistogram histogram; // drift per rotation either way, in full steps, of every crossing
+    int window[DRIFT_WINDOW];
+    int windowCount;
+    int windowNext;
+};
+
+// Turns the crossings into statistics per module, from loop(). A steady drift, the same every rotation, comes from
+// the drum taking a different number of steps per rotation than stepsPerRot says, e.g. 2038 rather than 2048 on a
+// 28BYJ-48 with its 63.68:1 gearbox. The count is right at the magnet and off by up to the whole drift just before
+// it, so the correction moves the magnet position by half the drift, and the error is at most half of it either
+// way. A noisy drift is left alone, and one that is large or erratic flags the module.
+class SplitFlapDrift {
+  public:
+    void setModules(int count, int microsteps);
+    DriftLog &getLog() { return log; }
+    unsigned long getDropped() const { return log.getDropped(); }
+    void update(SplitFlapModule *modules, bool idle, bool correct); // count new crossings, correct when idle
+    std::vector<ModuleDrift> getModules();
+
+  private:
+    DriftLog log;
+    std::mutex lock; // update() against the web server reading the statistics
+    std::vector<ModuleDrift> modules;
+    int microsteps = 1;
+
+    void record(int module, int drift, int rotations);
+    void evaluate(int module);
+};
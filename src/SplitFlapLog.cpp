@@ -0,0 +1,122 @@
+#include "SplitFlapLog.h"
+
+#include <stdarg.h>
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+struct LogSlot
+{
+    std::atomic<uint32_t> sequence; // index + 1 once the message is written
+    LogMessage message;
+};
+
+static const char LevelLetters[] = {'-', 'E', 'W', 'I', 'D'};
+
+LogSlot SplitFlapLog::slots[LOG_LENGTH];
+std::atomic<uint32_t> SplitFlapLog::head(0);
+std::atomic<uint32_t> SplitFlapLog::tail(0);
+std::atomic<unsigned long> SplitFlapLog::dropped(0);
+unsigned long SplitFlapLog::droppedReported = 0;
+std::atomic<LogSink> SplitFlapLog::sink(nullptr);
+void *SplitFlapLog::sinkArg = nullptr;
+
+uint32_t SplitFlapLog::now() {
+#ifdef ARDUINO_ARCH_ESP32
+    return millis();
+#else
+    return host::nowUs() / 1000; // unlike millis() it does not move the virtual clock, logging leaves timings alone
+#endif
+}
+
+void SplitFlapLog::begin() {
+#ifdef ARDUINO_ARCH_ESP32
+    static TaskHandle_t task = nullptr;
+    if (task == nullptr) {
+        xTaskCreate(taskEntry, "log", LOG_DRAIN_STACK, nullptr, LOG_DRAIN_PRIORITY, &task);
+    }
+#endif
+}
+
+void SplitFlapLog::write(int level, const char *format, ...) {
+    uint32_t at = head.load(std::memory_order_relaxed);
+    do {
+        if (at - tail.load(std::memory_order_acquire) >= LOG_LENGTH) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (! head.compare_exchange_weak(at, at + 1, std::memory_order_relaxed));
+
+    LogSlot &slot = slots[at % LOG_LENGTH];
+    slot.message.timeMs = now();
+    slot.message.level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot.message.text, sizeof(slot.message.text), format, args);
+    va_end(args);
+    slot.sequence.store(at + 1, std::memory_order_release); // publishes the message
+
+#ifndef ARDUINO_ARCH_ESP32
+    drain(); // the host build has no tasks, what is logged is written out straight away
+#endif
+}
+
+void SplitFlapLog::flush() {
+#ifdef ARDUINO_ARCH_ESP32
+    unsigned long startTime = millis();
+    while (tail.load(std::memory_order_acquire) != head.load(std::memory_order_acquire) &&
+           millis() - startTime < LOG_FLUSH_TIMEOUT_MS) {
+        delay(LOG_DRAIN_INTERVAL_MS);
+    }
+#endif
+}
+
+void SplitFlapLog::setSink(LogSink newSink, void *arg) {
+    sinkArg = arg;
+    sink.store(newSink, std::memory_order_release);
+}
+
+void SplitFlapLog::drain() {
+    unsigned long lost = dropped.load(std::memory_order_relaxed);
+    if (lost != droppedReported) {
+        LogMessage message = {now(), LOG_LEVEL_WARN, ""};
+        snprintf(message.text, sizeof(message.text), "%lu log messages dropped, the ring was full",
+                 lost - droppedReported);
+        droppedReported = lost;
+        output(message);
+    }
+
+    // A writer that claimed a slot and has not finished it holds up the ones after it until the next pass
+    uint32_t at = tail.load(std::memory_order_relaxed);
+    while (at != head.load(std::memory_order_acquire)) {
+        LogSlot &slot = slots[at % LOG_LENGTH];
+        if (slot.sequence.load(std::memory_order_acquire) != at + 1) {
+            break;
+        }
+        output(slot.message);
+        tail.store(++at, std::memory_order_release); // hands the slot back
+    }
+}
+
+void SplitFlapLog::output(const LogMessage &message) {
+    char line[LOG_MESSAGE_LENGTH + 24];
+    snprintf(line, sizeof(line), "%5lu.%03lu %c %s", (unsigned long) message.timeMs / 1000,
+             (unsigned long) message.timeMs % 1000, LevelLetters[message.level], message.text);
+    Serial.println(line);
+
+    LogSink current = sink.load(std::memory_order_acquire);
+    if (current != nullptr) {
+        current(line, message, sinkArg);
+    }
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+void SplitFlapLog::taskEntry(void *arg) {
+    for (;;) {
+        drain();
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL_MS));
+    }
+}
+#endif
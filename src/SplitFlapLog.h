@@ -0,0 +1,90 @@
+#pragma once
+
+// Leveled logging that never waits on the serial port. A message is formatted into a ring and a low-priority task
+// writes it out, to Serial and to the clients of /api/logs, so diagnostics can stay in the stepping path and the web
+// handlers. Levels above LOG_LEVEL are stripped at compile time, their arguments are not even evaluated.
+//
+//   LOG_WARN("Module %d does not answer", module);
+//   LOG_DEBUG("Target positions: %s", formatList(targets, count).c_str());
+
+#include <Arduino.h>
+#include <atomic>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO // most detailed level compiled in
+#endif
+
+#define LOG_LENGTH            32   // messages waiting to be written out, further ones are dropped and counted
+#define LOG_MESSAGE_LENGTH    120  // characters of a message, longer ones are cut
+#define LOG_DRAIN_INTERVAL_MS 20   // between passes of the drain task over the ring
+#define LOG_DRAIN_PRIORITY    1    // as low as loop(), it runs whenever nothing else needs the CPU
+#define LOG_DRAIN_STACK       3072
+#define LOG_FLUSH_TIMEOUT_MS  500  // longest flush() waits for the ring to empty
+
+struct LogMessage
+{
+    uint32_t timeMs; // since boot
+    uint8_t level;
+    char text[LOG_MESSAGE_LENGTH];
+};
+
+struct LogSlot;
+
+typedef void (*LogSink)(const char *line, const LogMessage &message, void *arg);
+
+// Multiple producers, single consumer: writers claim a slot with a compare and swap on the head and publish it with
+// a store, the drain task is the only one moving the tail. Nothing blocks, a full ring drops the message.
+class SplitFlapLog {
+  public:
+    static void begin(); // starts the drain task, before anything is logged
+    static void write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    static void flush(); // waits for the ring to be written out, before a restart
+    static void setSink(LogSink sink, void *arg); // also gets every line, called from the drain task
+    static unsigned long getDropped() { return dropped.load(std::memory_order_relaxed); }
+
+  private:
+    static LogSlot slots[LOG_LENGTH];
+    static std::atomic<uint32_t> head; // next to claim, moved by writers
+    static std::atomic<uint32_t> tail; // next to write out, moved by the drain only
+    static std::atomic<unsigned long> dropped;
+    static unsigned long droppedReported;
+    static std::atomic<LogSink> sink;
+    static void *sinkArg;
+
+    static uint32_t now();
+    static void drain();
+    static void output(const LogMessage &message);
+#ifdef ARDUINO_ARCH_ESP32
+    static void taskEntry(void *arg);
+#endif
+};
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) SplitFlapLog::write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) SplitFlapLog::write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) SplitFlapLog::write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) SplitFlapLog::write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
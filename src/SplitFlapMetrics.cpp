@@ -0,0 +1,238 @@
+#include "SplitFlapMetrics.h"
+
+#include "SplitFlapDisplay.h"
+#include "SplitFlapLog.h"
+
+const uint32_t SplitFlapMetrics::MoveBucketsMs[METRICS_BUCKETS - 1] = {250, 500, 1000, 2000, 4000, 8000, 16000};
+const uint32_t SplitFlapMetrics::WakeUpBucketsMs[METRICS_BUCKETS - 1] = {1, 50, 100, 200, 400, 800, 1600};
+const uint32_t SplitFlapMetrics::LoopBucketsMs[METRICS_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100};
+const uint32_t SplitFlapMetrics::DriftBucketsSteps[METRICS_BUCKETS - 1] = {0, 1, 2, 4, 8, 16, 32};
+
+void MetricsHistogram::record(uint32_t value, const uint32_t *bounds) {
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && value > bounds[bucket]) {
+        bucket++;
+    }
+    counts[bucket]++;
+    count++;
+    sum += value;
+}
+
+void SplitFlapMetrics::setModules(int count) {
+    modules.assign(count, ModuleMetrics{});
+}
+
+void SplitFlapMetrics::tickLoop() {
+    unsigned long now = millis();
+    if (loops > 0) {
+        loopMs.record(now - lastLoopTime, LoopBucketsMs);
+    } else {
+        windowStartTime = now;
+    }
+    lastLoopTime = now;
+    loops++;
+
+    if (now - windowStartTime >= METRICS_RATE_WINDOW_MS) {
+        loopRate = (loops - windowStartLoops) * 1000.0f / (now - windowStartTime);
+        windowStartTime = now;
+        windowStartLoops = loops;
+    }
+}
+
+enum class Metric {
+    Uptime,
+    Loops,
+    LoopRate,
+    LoopInterval,
+    HeapFree,
+    HeapMinFree,
+    HeapMaxAlloc,
+    LogDropped,
+    Moves,
+    Steps,
+    I2cErrors,
+    I2cRecoveries,
+    Crossings,
+    MissedCrossings,
+    Drift,
+    DriftCorrection,
+    DriftTrouble,
+    DriftSteps,
+    MoveDuration,
+    WakeUp
+};
+
+struct MetricFamily
+{
+    Metric metric;
+    const char *name;
+    const char *type;
+    const char *help;
+    bool perModule;
+};
+
+// clang-format off
+static const MetricFamily Families[] = {
+    {Metric::Uptime, "splitflap_uptime_seconds", "gauge", "Time since boot", false},
+    {Metric::Loops, "splitflap_loops_total", "counter", "Passes of loop()", false},
+    {Metric::LoopRate, "splitflap_loop_rate_hz", "gauge", "Passes of loop() per second, over the last second", false},
+    {Metric::LoopInterval, "splitflap_loop_interval_seconds", "histogram", "Time between passes of loop()", false},
+#ifdef ARDUINO_ARCH_ESP32
+    {Metric::HeapFree, "splitflap_heap_free_bytes", "gauge", "Free heap", false},
+    {Metric::HeapMinFree, "splitflap_heap_min_free_bytes", "gauge", "Lowest free heap since boot", false},
+    {Metric::HeapMaxAlloc, "splitflap_heap_max_alloc_bytes", "gauge", "Largest block the heap can allocate", false},
+#endif
+    {Metric::LogDropped, "splitflap_log_dropped_total", "counter", "Log messages dropped, the ring was full", false},
+    {Metric::Moves, "splitflap_moves_total", "counter", "Moves started from rest or from the hold window", false},
+    {Metric::Steps, "splitflap_module_steps_total", "counter", "Steps issued", true},
+    {Metric::I2cErrors, "splitflap_module_i2c_errors_total", "counter", "Writes to the expander that failed", true},
+    {Metric::I2cRecoveries, "splitflap_module_i2c_recoveries_total", "counter",
+     "Writes that went through after one or more failed", true},
+    {Metric::Crossings, "splitflap_module_magnet_crossings_total", "counter",
+     "Magnet crossings with a known position before them", true},
+    {Metric::MissedCrossings, "splitflap_module_magnet_missed_total", "counter",
+     "Magnet crossings not seen, a move ended over the magnet", true},
+    {Metric::Drift, "splitflap_module_drift_steps", "gauge",
+     "Full steps the count was off at the latest crossing, positive when steps were lost", true},
+    {Metric::DriftCorrection, "splitflap_module_drift_correction_steps", "gauge",
+     "Full steps the magnet position is moved by to make up for a steady drift", true},
+    {Metric::DriftTrouble, "splitflap_module_drift_trouble", "gauge",
+     "1 when the drift is too large or too erratic for the mechanics to be sound", true},
+    {Metric::DriftSteps, "splitflap_module_drift_abs_steps", "histogram",
+     "Full steps the count was off at each crossing, either way", true},
+    {Metric::MoveDuration, "splitflap_module_move_duration_seconds", "histogram",
+     "From a move reaching the module until it shows its target", true},
+    {Metric::WakeUp, "splitflap_module_wakeup_seconds", "histogram",
+     "From a move reaching the module until its first step", true},
+};
+// clang-format on
+
+static const int FamilyCount = sizeof(Families) / sizeof(Families[0]);
+
+MetricsExporter::MetricsExporter(SplitFlapDisplay &display) : display(display), drift(display.getDrift()) {}
+
+size_t MetricsExporter::read(uint8_t *buffer, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        if (pendingAt >= pending.length()) {
+            pending = "";
+            pendingAt = 0;
+            if (! renderNext()) {
+                break;
+            }
+        }
+        size_t count = min(length - written, pending.length() - pendingAt);
+        memcpy(buffer + written, pending.c_str() + pendingAt, count);
+        written += count;
+        pendingAt += count;
+    }
+    return written;
+}
+
+bool MetricsExporter::renderNext() {
+    if (family >= FamilyCount) {
+        return false;
+    }
+
+    const MetricFamily &current = Families[family];
+    if (module < 0) {
+        pending += String("# HELP ") + current.name + " " + current.help + "\n";
+        pending += String("# TYPE ") + current.name + " " + current.type + "\n";
+        module = 0;
+        return true;
+    }
+
+    render(current, module);
+    module++;
+    if (! current.perModule || module >= display.getNumModules()) {
+        family++;
+        module = -1;
+    }
+    return true;
+}
+
+void MetricsExporter::render(const MetricFamily &current, int module) {
+    const SplitFlapMetrics &metrics = display.getMetrics();
+    const SplitFlapModule &splitFlapModule = display.getModules()[module];
+    const ModuleDrift &moduleDrift = drift[module];
+    float microsteps = display.getMicrosteps(); // drift is kept in the steps of the step mode
+    const char *name = current.name;
+    int label = current.perModule ? module : -1;
+
+    switch (current.metric) {
+        case Metric::Uptime: addValue(name, label, millis() / 1000.0); break;
+        case Metric::Loops: addValue(name, label, metrics.getLoops()); break;
+        case Metric::LoopRate: addValue(name, label, metrics.getLoopRate()); break;
+        case Metric::LoopInterval:
+            addHistogram(name, label, metrics.getLoopMs(), SplitFlapMetrics::LoopBucketsMs, 0.001);
+            break;
+#ifdef ARDUINO_ARCH_ESP32
+        case Metric::HeapFree: addValue(name, label, ESP.getFreeHeap()); break;
+        case Metric::HeapMinFree: addValue(name, label, ESP.getMinFreeHeap()); break;
+        case Metric::HeapMaxAlloc: addValue(name, label, ESP.getMaxAllocHeap()); break;
+#else
+        case Metric::HeapFree:
+        case Metric::HeapMinFree:
+        case Metric::HeapMaxAlloc: break;
+#endif
+        case Metric::LogDropped: addValue(name, label, SplitFlapLog::getDropped()); break;
+        case Metric::Moves: addValue(name, label, display.getMotion().getReport().moves); break;
+        case Metric::Steps: addValue(name, label, splitFlapModule.getSteps()); break;
+        case Metric::I2cErrors: addValue(name, label, splitFlapModule.getErrors()); break;
+        case Metric::I2cRecoveries: addValue(name, label, splitFlapModule.getRecoveries()); break;
+        case Metric::Crossings: addValue(name, label, moduleDrift.crossings); break;
+        case Metric::MissedCrossings: addValue(name, label, moduleDrift.missed); break;
+        case Metric::Drift: addValue(name, label, moduleDrift.last / microsteps); break;
+        case Metric::DriftCorrection: addValue(name, label, moduleDrift.correction / microsteps); break;
+        case Metric::DriftTrouble: addValue(name, label, moduleDrift.trouble ? 1 : 0); break;
+        case Metric::DriftSteps:
+            addHistogram(name, label, moduleDrift.histogram, SplitFlapMetrics::DriftBucketsSteps, 1);
+            break;
+        case Metric::MoveDuration:
+            addHistogram(name, label, metrics.getModule(module).moveMs, SplitFlapMetrics::MoveBucketsMs, 0.001);
+            break;
+        case Metric::WakeUp:
+            addHistogram(name, label, metrics.getModule(module).wakeUpMs, SplitFlapMetrics::WakeUpBucketsMs, 0.001);
+            break;
+    }
+}
+
+void MetricsExporter::addValue(const char *name, int module, double value) {
+    char line[128];
+    if (module >= 0) {
+        snprintf(line, sizeof(line), "%s{module=\"%d\"} %.10g\n", name, module, value);
+    } else {
+        snprintf(line, sizeof(line), "%s %.10g\n", name, value);
+    }
+    pending += line;
+}
+
+void MetricsExporter::addHistogram(
+    const char *name, int module, const MetricsHistogram &histogram, const uint32_t *bounds, double scale
+) {
+    char labels[32] = "";
+    if (module >= 0) {
+        snprintf(labels, sizeof(labels), "module=\"%d\",", module);
+    }
+
+    // Copied first, so the buckets add up to the count even while the motion task records into it
+    MetricsHistogram snapshot = histogram;
+    char line[160];
+    uint32_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += snapshot.counts[i];
+        if (i < METRICS_BUCKETS - 1) {
+            snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %lu\n", name, labels, bounds[i] * scale,
+                     (unsigned long) cumulative);
+        } else {
+            snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, (unsigned long) cumulative);
+        }
+        pending += line;
+    }
+    labels[max((int) strlen(labels) - 1, 0)] = '\0'; // no trailing comma without le
+    const char *open = module >= 0 ? "{" : "";
+    const char *close = module >= 0 ? "}" : "";
+    snprintf(line, sizeof(line), "%s_sum%s%s%s %.10g\n%s_count%s%s%s %lu\n", name, open, labels, close,
+             snapshot.sum * scale, name, open, labels, close, (unsigned long) cumulative);
+    pending += line;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+#define METRICS_BUCKETS        8    // of a histogram, the last one has no upper bound
+#define METRICS_RATE_WINDOW_MS 1000 // loop rate is measured over this window
+
+class SplitFlapDisplay;
+struct MetricFamily;
+struct ModuleDrift;
+
+// Counts per bucket of fixed bounds, recording is a few compares and adds. Buckets are not cumulative here, the
+// exporter adds them up into Prometheus' le buckets.
+struct MetricsHistogram
+{
+    uint32_t counts[METRICS_BUCKETS];
+    uint32_t count;
+    uint64_t sum;
+
+    void record(uint32_t value, const uint32_t *bounds); // bounds holds METRICS_BUCKETS - 1 upper bounds, ascending
+};
+
+// Timings of one module, written by the motion engine
+struct ModuleMetrics
+{
+    MetricsHistogram moveMs;   // from a move reaching the module until it shows its target
+    MetricsHistogram wakeUpMs; // from a move reaching the module until its first step, wake-up and settle from cold
+};
+
+// Counters and histograms for a fleet to be watched by. Everything is sized by setModules() and fixed after, so
+// recording never allocates, and the stepping path only adds to a histogram when a module arrives. Readers on other
+// tasks take the values as they are, a counter being one short while it is read is fine for a metric.
+class SplitFlapMetrics {
+  public:
+    void setModules(int count); // sizes the per-module state, call while idle
+    void recordMove(int module, unsigned long ms) { modules[module].moveMs.record(ms, MoveBucketsMs); }
+    void recordWakeUp(int module, unsigned long ms) { modules[module].wakeUpMs.record(ms, WakeUpBucketsMs); }
+    void tickLoop(); // once per pass of loop()
+
+    const ModuleMetrics &getModule(int module) const { return modules[module]; }
+    unsigned long getLoops() const { return loops; }
+    float getLoopRate() const { return loopRate; } // passes of loop() per second over the last window
+    const MetricsHistogram &getLoopMs() const { return loopMs; }
+
+    static const uint32_t MoveBucketsMs[METRICS_BUCKETS - 1];
+    static const uint32_t WakeUpBucketsMs[METRICS_BUCKETS - 1];
+    static const uint32_t LoopBucketsMs[METRICS_BUCKETS - 1];
+    static const uint32_t DriftBucketsSteps[METRICS_BUCKETS - 1];
+
+  private:
+    std::vector<ModuleMetrics> modules;
+    unsigned long loops = 0;
+    MetricsHistogram loopMs = {}; // time between passes of loop()
+    unsigned long lastLoopTime = 0;
+    unsigned long windowStartTime = 0;
+    unsigned long windowStartLoops = 0;
+    float loopRate = 0;
+};
+
+// Renders the metrics as Prometheus text a block at a time, one metric of one module, so a board of any size streams
+// through a small buffer instead of being built up in memory
+class MetricsExporter {
+  public:
+    MetricsExporter(SplitFlapDisplay &display);
+    size_t read(uint8_t *buffer, size_t length); // next bytes of the text, 0 once it is all out
+
+  private:
+    SplitFlapDisplay &display;
+    std::vector<ModuleDrift> drift; // taken once, so every block sees the same crossings
+    int family = 0;                 // metric being rendered
+    int module = -1;                // module of it, -1 for its HELP and TYPE lines
+    String pending;                 // rendered and not read yet
+    size_t pendingAt = 0;
+
+    bool renderNext(); // the next block into pending, false at the end
+    void render(const MetricFamily &family, int module);
+    void addValue(const char *name, int module, double value); // module -1 for a display-wide value
+    void addHistogram(const char *name, int module, const MetricsHistogram &histogram, const uint32_t *bounds,
+                      double scale); // scale turns the recorded unit into the exported one
+};
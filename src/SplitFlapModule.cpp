@@ -1,93 +1,101 @@
 #include "SplitFlapModule.h"
 
-// Array of characters, in order, the first item is located on the magnet on the
-// character drum
-const char SplitFlapModule::StandardChars[37] = {' ', 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L',
-                                                 'M', 'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y',
-                                                 'Z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
-
-const char SplitFlapModule::ExtendedChars[48] = {
-    ' ', 'A', 'B', 'C', 'D', 'E',  'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
-    'P', 'Q', 'R', 'S', 'T', 'U',  'V', 'W', 'X', 'Y', 'Z', '0', '1', '2', '3', '4',
-    '5', '6', '7', '8', '9', '\'', ':', '?', '!', '.', '-', '/', '$', '@', '#', '%',
+#include "SplitFlapLog.h"
+
+const uint16_t SplitFlapModule::FullStepSequence[4] = {
+    STEPPER_PATTERN_0, STEPPER_PATTERN_1, STEPPER_PATTERN_2, STEPPER_PATTERN_3
+};
+
+const uint16_t SplitFlapModule::HalfStepSequence[8] = {
+    STEPPER_PATTERN_0, STEPPER_WAVE_0, STEPPER_PATTERN_1, STEPPER_WAVE_1,
+    STEPPER_PATTERN_2, STEPPER_WAVE_2, STEPPER_PATTERN_3, STEPPER_WAVE_3,
 };
 
-bool hasErrored = false;
+const uint16_t SplitFlapModule::WaveDriveSequence[4] = {
+    STEPPER_WAVE_0, STEPPER_WAVE_1, STEPPER_WAVE_2, STEPPER_WAVE_3
+};
+
+uint32_t SplitFlapModule::unknownChars[8] = {};
 
 // Default Constructor
 SplitFlapModule::SplitFlapModule()
-    : address(0), position(0), stepNumber(0), stepsPerRot(0), chars(StandardChars), numChars(37), charSetSize(37) {
+    : address(0), position(0), stepNumber(0), sequence(FullStepSequence), sequenceLength(4), stepsPerRot(0),
+      charset(&StandardCharset) {
     baseMagnetPosition = 710;
     magnetPosition = 710;
 }
 
 // Constructor implementation
 SplitFlapModule::SplitFlapModule(
-    uint8_t I2Caddress, int stepsPerFullRotation, int stepOffset, int magnetPos, int charsetSize
+    int I2Caddress, int stepsPerFullRotation, int stepOffset, int magnetPos, const SplitFlapCharset &charset,
+    int stepMode
 )
-    : address(I2Caddress), position(0), stepNumber(0), stepsPerRot(stepsPerFullRotation), charSetSize(charsetSize) {
+    : address(I2Caddress), position(0), stepNumber(0), stepsPerRot(stepsPerFullRotation), charset(&charset) {
     baseMagnetPosition = magnetPos;
     magnetPosition = magnetPos + stepOffset;
 
-    chars = (charsetSize == 48) ? ExtendedChars : StandardChars;
-    numChars = (charsetSize == 48) ? 48 : 37;
+    switch (stepMode) {
+        case STEP_MODE_HALF:
+            sequence = HalfStepSequence;
+            sequenceLength = 8;
+            break;
+        case STEP_MODE_WAVE:
+            sequence = WaveDriveSequence;
+            sequenceLength = 4;
+            break;
+        default:
+            sequence = FullStepSequence;
+            sequenceLength = 4;
+            break;
+    }
+}
+
+void SplitFlapModule::updateOffset(int newOffset, bool keepReference) {
+    int delta = baseMagnetPosition + newOffset + driftCorrection - magnetPosition;
+    magnetPosition += delta;
+    if (keepReference) {
+        // the count is rebased as if the magnet had just been seen with the new offset, no homing needed
+        position = ((position + delta) % stepsPerRot + stepsPerRot) % stepsPerRot;
+    } else {
+        positionKnown = false; // the count was kept against the old offset, its error says nothing
+    }
 }
 
-void SplitFlapModule::updateOffset(int newOffset) {
-    magnetPosition = baseMagnetPosition + newOffset;
+bool SplitFlapModule::magnetDetected(int &drift, int &rotations) {
+    // positive when the count is past the magnet, i.e. it counted steps the drum did not take
+    drift = ((position - magnetPosition) % stepsPerRot + stepsPerRot + stepsPerRot / 2) % stepsPerRot - stepsPerRot / 2;
+    rotations = (stepsSinceMagnet + stepsPerRot / 2) / stepsPerRot;
+    bool known = positionKnown && rotations > 0; // none is the same crossing seen again
+    position = magnetPosition;
+    positionKnown = true;
+    stepsSinceMagnet = 0;
+    return known;
 }
 
-void SplitFlapModule::writeIO(uint16_t data) {
-    Wire.beginTransmission(address);
-    Wire.write(data & 0xFF);        // Send lower byte
-    Wire.write((data >> 8) & 0xFF); // Send upper byte
-
-    byte error = Wire.endTransmission();
-
-    if (error > 0) {
-        consecutiveErrors++;
-        if (!hasErrored || consecutiveErrors == 1) {
-            hasErrored = true;
-            Serial.print("Error writing data to module ");
-            Serial.print(address);
-            Serial.print(", error code: ");
-            Serial.println(error);
-            // Error codes:
-            // 0 = success
-            // 1 = data too long to fit in transmit buffer
-            // 2 = received NACK on transmit of address
-            // 3 = received NACK on transmit of data
-            // 4 = other error
-        }
+void SplitFlapModule::setDriftCorrection(int steps) {
+    // Both move, so the drum shows the same character and only where the next move stops changes
+    int delta = steps - driftCorrection;
+    driftCorrection = steps;
+    magnetPosition += delta;
+    position = ((position + delta) % stepsPerRot + stepsPerRot) % stepsPerRot;
+}
 
-        // Attempt recovery after multiple errors
-        if (consecutiveErrors >= 3) {
-            Serial.print("Module ");
-            Serial.print(address);
-            Serial.println(" has persistent I2C errors, attempting recovery...");
-            delay(10);
-            consecutiveErrors = 0; // Reset counter after recovery attempt
-        }
-    } else {
-        // Communication successful - reset error tracking
-        if (consecutiveErrors > 0) {
-            Serial.print("Module ");
-            Serial.print(address);
-            Serial.println(" communication recovered");
-            consecutiveErrors = 0;
-            hasErrored = false;
-        }
+void SplitFlapModule::writeIO(uint16_t data) {
+    int coils = __builtin_popcount(data & PCF8575_MOTOR_COIL_MASK);
+    if (coils != energisedCoils) {
+        unsigned long now = millis();
+        coilMs += (now - energisedSince) * energisedCoils;
+        energisedSince = now;
+        energisedCoils = coils;
     }
+
+    bus->write(busSlot, data);
 }
 
 // Init Module, Setup IO Board
-void SplitFlapModule::init() {
-    float stepSize = (float) stepsPerRot / (float) numChars;
-    float currentPosition = 0;
-    for (int i = 0; i < numChars; i++) {
-        charPositions[i] = (int) currentPosition;
-        currentPosition += stepSize;
-    }
+void SplitFlapModule::init(SplitFlapBus &splitFlapBus) {
+    bus = &splitFlapBus;
+    busSlot = bus->attach(address);
 
     writeIO(PCF8575_IO_INIT_STATE);
 
@@ -108,17 +116,41 @@ void SplitFlapModule::init() {
 }
 
 int SplitFlapModule::getCharPosition(char inputChar) {
-    inputChar = toupper(inputChar);
-    for (int i = 0; i < charSetSize; i++) {
-        if (chars[i] == inputChar) {
-            return charPositions[i];
+    uint8_t c = (uint8_t) inputChar;
+    int index = charset->index[c];
+    if (index == CHARSET_UNKNOWN) {
+        // Character not found in charset - display blank, the warning is printed later by reportUnknownChars
+        unknownChars[c >> 5] |= 1u << (c & 31);
+        return charset->getPosition(0, stepsPerRot);
+    }
+    return charset->getPosition(index, stepsPerRot);
+}
+
+void SplitFlapModule::reportUnknownChars(const SplitFlapCharset &charset) {
+    for (int word = 0; word < 8; word++) {
+        uint32_t bits = unknownChars[word];
+        if (bits == 0) {
+            continue;
+        }
+        unknownChars[word] = 0;
+
+        for (int bit = 0; bit < 32; bit++) {
+            if (bits & (1u << bit)) {
+                uint8_t c = word * 32 + bit;
+                if (c == CHARSET_NOT_A_GLYPH) {
+                    LOG_WARN("Characters not in %d-char charset, displaying blank", charset.size);
+                    continue;
+                }
+                String glyph = charset.decode(String((char) toupper(c)));
+                LOG_WARN("Character '%s' (0x%02X) not in %d-char charset, displaying blank", glyph.c_str(), c,
+                         charset.size);
+            }
         }
     }
+}
 
-    // Character not found in charset - log warning and return blank
-    Serial.printf("WARNING: Character '%c' (0x%02X) not in %d-char charset, displaying blank\n",
-                  inputChar, (uint8_t)inputChar, charSetSize);
-    return 0;
+unsigned long SplitFlapModule::getCoilMs() const {
+    return coilMs + (millis() - energisedSince) * energisedCoils;
 }
 
 void SplitFlapModule::stop() {
@@ -126,118 +158,79 @@ void SplitFlapModule::stop() {
 }
 
 void SplitFlapModule::start() {
-    stepNumber = (stepNumber + 3) % 4; // effectively take one off stepNumber
-    step(false);                       // write the "previous" step high again, in case turned off
+    // write the "previous" step high again, in case turned off. stepNumber stays, taking one off it made the first
+    // step of every move write the pattern the rotor was already on and count a step the drum never took
+    writeIO(sequence[(stepNumber + sequenceLength - 1) % sequenceLength]);
 }
 
 void SplitFlapModule::step(bool updatePosition) {
-    uint16_t stepState;
-    switch (stepNumber) {
-        case 0:
-            stepState = STEPPER_PATTERN_0;
-            break;
-        case 1:
-            stepState = STEPPER_PATTERN_1;
-            break;
-        case 2:
-            stepState = STEPPER_PATTERN_2;
-            break;
-        case 3:
-            stepState = STEPPER_PATTERN_3;
-            break;
-        default:
-            // Should never happen, but safe fallback
-            stepState = PCF8575_MOTOR_STOP_STATE;
-            Serial.printf("ERROR: Invalid stepNumber %d for module 0x%02X\n", stepNumber, address);
-            break;
-    }
-    writeIO(stepState);
+    writeIO(sequence[stepNumber]);
 
     if (updatePosition) {
         position = (position + 1) % stepsPerRot;
-        stepNumber = (stepNumber + 1) % 4;
+        stepsSinceMagnet = min(stepsSinceMagnet + 1, stepsPerRot * 100); // a dead sensor must not overflow it
+        steps++;
+        stepNumber = (stepNumber + 1) % sequenceLength;
     }
 }
 
 bool SplitFlapModule::readHallEffectSensor() {
-    if (hasErrored) {
+    if (getHasErrored()) {
         return false;
     }
 
-    uint8_t requestBytes = 2;
-    Wire.requestFrom(address, requestBytes);
-    // Make sure the data is available
-    if (Wire.available() == 2) {
-        uint16_t inputState = 0;
-
-        // Read the two bytes and combine them into a 16-bit value
-        inputState = Wire.read();             // Read the lower byte
-        inputState |= (Wire.read() << 8);     // Read the upper byte and shift it left
-
-        return (inputState & (1 << 15)) != 0; // If bit is 15, return HIGH, else LOW
+    uint16_t inputState;
+    if (! bus->read(busSlot, inputState)) {
+        return false;
     }
-    return false;
+    return (inputState & (1 << 15)) != 0; // If bit is 15, return HIGH, else LOW
 }
 
 bool SplitFlapModule::testI2CConnectivity() {
-    // Try to communicate with the module by requesting 2 bytes
-    Wire.beginTransmission(address);
-    byte error = Wire.endTransmission();
-
-    // error codes:
-    // 0: success
-    // 1: data too long to fit in transmit buffer
-    // 2: received NACK on transmit of address
-    // 3: received NACK on transmit of data
-    // 4: other error
-    // 5: timeout
-
-    if (error == 0) {
-        // Module responded, try reading some data to verify full communication
-        Wire.requestFrom(address, (uint8_t)2);
-        if (Wire.available() == 2) {
-            Wire.read(); // Read and discard
-            Wire.read(); // Read and discard
-            return true;
-        }
-    }
-
-    return false;
+    return bus != nullptr && bus->probe(address);
 }
 
 void SplitFlapModule::wakeUp() {
     // Gentle wake-up sequence before any movement
     // This helps overcome static friction and ensures coils are properly energized
+    for (int slot = 0; slot < WAKE_UP_SLOTS; slot++) {
+        delay(wakeUpStep(slot));
+        yield(); // Allow other tasks to run
+    }
+}
 
-    // Step 1: Gradually energize coils with micro-steps
-    // This helps overcome stiction without jerking the mechanism
-    for (int i = 0; i < 4; i++) {
+unsigned long SplitFlapModule::wakeUpStep(int slot) {
+    if (slot < 4) {
+        // Step 1: Gradually energize coils with micro-steps
+        // This helps overcome stiction without jerking the mechanism
         step(false); // Step without updating position
-        delay(50);   // Longer delay for gentle energizing
-        yield();     // Allow other tasks to run
+        return getWakeUpDelay(slot);
     }
 
-    // Step 2: Small oscillation to break static friction
-    // Move forward slightly then back to original position
-    int originalStepNumber = stepNumber;
-    for (int i = 0; i < 2; i++) {
+    if (slot < 6) {
+        // Step 2: Small oscillation to break static friction
+        // Move forward slightly then back to original position
         step(false);
-        delay(30);
-        yield();
+        return getWakeUpDelay(slot);
     }
 
-    // Return to original step position
-    for (int i = 0; i < 2; i++) {
-        stepNumber = (stepNumber + 3) % 4; // Step backwards
+    if (slot < 8) {
+        // Return to original step position
+        stepNumber = (stepNumber + sequenceLength - 1) % sequenceLength; // Step backwards
         step(false);
-        delay(30);
-        yield();
+        return getWakeUpDelay(slot);
     }
 
-    stepNumber = originalStepNumber;
-
     // Step 3: Full power holding
     // Ensure current coil is at full strength
+    stepNumber = (stepNumber + 2) % sequenceLength; // undo the two steps backwards
     step(false);
-    delay(20);
+    return getWakeUpDelay(slot);
+}
+
+unsigned long SplitFlapModule::getWakeUpDelay(int slot) {
+    if (slot < 4) {
+        return 50; // Longer delay for gentle energizing
+    }
+    return slot < 8 ? 30 : 20;
 }
@@ -1,13 +1,16 @@
 #pragma once
 
+#include "SplitFlapBus.h"
+#include "SplitFlapCharset.h"
+
 #include <Arduino.h>
-#include <Wire.h>
 
 // PCF8575 I/O Expander Pin Configuration
 // Bits 0-3: Stepper motor control pins (outputs)
 // Bit 15: Hall effect sensor input
 #define PCF8575_IO_INIT_STATE     0b1111111111100001  // Pin 15 input, pins 0-3 output
 #define PCF8575_MOTOR_STOP_STATE  0b1111111111100001  // All motor pins LOW
+#define PCF8575_MOTOR_COIL_MASK   0b0000000000011110  // Motor coil pins
 
 // Stepper Motor Control Patterns (4-step sequence)
 // These patterns energize different coil combinations for smooth stepping
@@ -16,63 +19,106 @@
 #define STEPPER_PATTERN_2  0b1111111111111001  // Coils C+D
 #define STEPPER_PATTERN_3  0b1111111111101101  // Coils D+A
 
+// Single coil patterns, between the two coil patterns above (half-step) or on their own (wave drive)
+#define STEPPER_WAVE_0     0b1111111111100011  // Coil B
+#define STEPPER_WAVE_1     0b1111111111110001  // Coil C
+#define STEPPER_WAVE_2     0b1111111111101001  // Coil D
+#define STEPPER_WAVE_3     0b1111111111100101  // Coil A
+
+// Coil sequences, picked with the stepMode setting
+#define STEP_MODE_FULL  0  // two coils at a time, 4 states per cycle
+#define STEP_MODE_HALF  1  // alternating two coils and one, 8 states per cycle, twice the steps per rotation
+#define STEP_MODE_WAVE  2  // one coil at a time, 4 states per cycle, half the power and less torque
+
 // Initialization timing
 #define MODULE_INIT_DELAY_MS  100  // Delay between initialization steps
 
+// Power drawn by each energised coil, a 50 ohm 28BYJ-48 phase at 5V
+#define COIL_POWER_MW  500
+
+// Wake-up sequence, split into slots so it can be run without blocking
+#define WAKE_UP_SLOTS  9           // energize x4, oscillate forward x2, return x2, full power hold
+
 class SplitFlapModule {
   public:
     // Constructor declarationS
     SplitFlapModule(); // default constructor required to allocate memory for
     // SplitFlapDisplay class
-    SplitFlapModule(uint8_t I2Caddress, int stepsPerFullRotation, int stepOffset, int magnetPos, int charSetSize);
+    SplitFlapModule(
+        int I2Caddress, int stepsPerFullRotation, int stepOffset, int magnetPos, const SplitFlapCharset &charset,
+        int stepMode = STEP_MODE_FULL
+    );
+    static int getMicrosteps(int stepMode) { return stepMode == STEP_MODE_HALF ? 2 : 1; } // steps per full step
 
-    void init();
-    void updateOffset(int newOffset);                        // update the offset dynamically
+    void init(SplitFlapBus &bus);                            // attach to the bus and set up the IO board
+    void updateOffset(int newOffset, bool keepReference = false); // keepReference moves the count along, no homing
 
     void step(bool updatePosition = true);                   // step motor
     void stop();                                             // write all motor input pins to low
     void start();                                            // re-energize coils to last position, not stepping motor
     void wakeUp();                                           // gentle wake-up sequence before any movement
+    unsigned long wakeUpStep(int slot);                      // run one slot of wakeUp, returns ms to wait after it
+    static unsigned long getWakeUpDelay(int slot);           // ms to wait after a slot of wakeUp
 
     int getMagnetPosition() const { return magnetPosition; } // position where magnet is detected
-    int getCharPosition(char inputChar);                     // get integer position given single character
+    int getCharPosition(char inputChar);                     // get integer position given single character code
     int getPosition() const { return position; }             // get integer position
-    int getCharsetSize() const { return numChars; }          // getter for charset size
+    int getCharsetSize() const { return charset->size; }     // getter for charset size
+    int getStepsPerRot() const { return stepsPerRot; }       // steps per rotation of the character drum
+    static void reportUnknownChars(const SplitFlapCharset &charset); // print characters asked for not on the drum
 
     bool readHallEffectSensor();                             // return the value read by the hall effect
     // sensor
-    void magnetDetected() {
-        position = magnetPosition;
-    } // update position to magnetposition, called when magnet is detected
-
-    bool getHasErrored() const { return hasErrored; }
+    // Update position to magnetPosition, called when the magnet is detected. Returns false at the first crossing after
+    // init or an offset change, when the position was not known yet, otherwise sets drift to how far it was off after
+    // rotations turns of the drum, more than one when a move ended over the magnet and its crossing was not seen
+    bool magnetDetected(int &drift, int &rotations);
+    void setDriftCorrection(int steps);                      // move the magnet position and the count along together
+    int getDriftCorrection() const { return driftCorrection; }
+
+    int getEnergisedCoils() const { return energisedCoils; }
+    unsigned long getCoilMs() const;                         // coil-milliseconds powered since boot, 2 coils for 1ms = 2
+
+    bool getHasErrored() const { return bus != nullptr && bus->hasErrored(busSlot); }
+    unsigned long getErrors() const { return bus != nullptr ? bus->getErrors(busSlot) : 0; } // writes that failed
+    unsigned long getRecoveries() const { return bus != nullptr ? bus->getRecoveries(busSlot) : 0; }
+    unsigned long getSteps() const { return steps; } // steps taken since boot
     bool testI2CConnectivity();                              // test if module responds on I2C bus
-    uint8_t getAddress() const { return address; }           // get I2C address
+    int getAddress() const { return address; }               // get I2C address, with the multiplexer channel
+    SplitFlapBus *getBus() const { return bus; }             // bus the expander is on, null before init
 
   private:
-    uint8_t address;                // i2c address of module
+    int address;                    // i2c address of module, see BUS_MUX_BASE for expanders behind a multiplexer
     int position;                   // character drum position
     int stepNumber;                 // current position in the stepping order, to make motor move
+    const uint16_t *sequence;       // coil patterns of the step mode, in stepping order
+    int sequenceLength;
     int stepsPerRot;                // number of steps per rotation
-    bool hasErrored = false;        // flag to indicate if an error has occurred
+    SplitFlapBus *bus = nullptr;    // bus the expander is on, set by init
+    int busSlot = -1;               // the expander's slot on that bus
 
-    // Motor reliability tracking
-    int consecutiveErrors = 0;           // track I2C communication errors
+    // Coil power tracking
+    int energisedCoils = 0;
+    unsigned long energisedSince = 0;    // millis() when energisedCoils last changed
+    unsigned long coilMs = 0;            // coil-milliseconds up to energisedSince
 
     void writeIO(uint16_t data);    // write to motor in pins
 
     int magnetPosition;             // altered by offsets
     int baseMagnetPosition;         // original magnet position before offset
+    int driftCorrection = 0;        // steps added to magnetPosition by SplitFlapDrift, not saved
+    bool positionKnown = false;     // the magnet has been seen since init or the last offset change
+    int stepsSinceMagnet = 0;       // counted since the magnet was last seen
+    unsigned long steps = 0;        // counted since boot, for the metrics
     static const int motorPins[];   // Array of motor pins
     static const int HallEffectPIN; // Hall Effect Sensor Pin (On PCF8575)
 
-    const char *chars;              // pointer to active character set
-    int charPositions[48];          // support up to 48 characters
-    int numChars;                   // current number of characters
-    int charSetSize;
+    const SplitFlapCharset *charset; // active character set, shared by all modules
+    static uint32_t unknownChars[8]; // bit per byte value looked up but not on the drum, until reported
 
-    static const char StandardChars[37];
-    static const char ExtendedChars[48];
+    static const uint16_t FullStepSequence[4];
+    static const uint16_t HalfStepSequence[8];
+    static const uint16_t WaveDriveSequence[4];
 };
 
 // //PINs on the PCF8575 Board
@@ -0,0 +1,789 @@
+#include "SplitFlapMotion.h"
+
+#include "SplitFlapLog.h"
+#include "SplitFlapTrace.h"
+
+#include <algorithm>
+#include <climits>
+
+const unsigned long SplitFlapMotion::StepJitterBucketsUs[STEP_JITTER_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2000, 5000, ULONG_MAX
+};
+
+#ifdef SPLITFLAP_TRACE
+static const char *const TracePhaseNames[MOTION_PHASES] = {"idle", "wake-up", "settle", "stepping", "release", "hold"};
+#endif
+
+void SplitFlapMotion::setModules(SplitFlapModule *moduleArray, int count) {
+    modules = moduleArray;
+    numModules = count;
+
+    targetPositions.assign(count, 0);
+    resetLatches.assign(count, false);
+    needsStepping.assign(count, false);
+    steppingCount = 0;
+    nextStepTimes.assign(count, 0);
+    lastStepTimes.assign(count, 0);
+    stepIntervals.assign(count, 0);
+    stepCounts.assign(count, 0);
+    moveStartTimes.assign(count, 0);
+    nextSensorTimes.assign(count, 0);
+    sensorTriggered.assign(count, false);
+    magnetWidths.assign(count, -1);
+
+    // Reserved up front so scheduling does not allocate, a module only holds one live entry in each but a retarget
+    // can leave a stale one behind until it comes up
+    stepDeadlines.clear();
+    stepDeadlines.reserve(2 * count);
+    sensorDeadlines.clear();
+    sensorDeadlines.reserve(2 * count);
+    steppedModules.reserve(count);
+}
+
+void SplitFlapMotion::begin(const int targets[], float timePerStep, bool release, bool homing) {
+    stepInterval = (unsigned long) (timePerStep + 0.5f);
+    if (stepInterval != rampCruiseInterval) {
+        buildRamp();
+    }
+    releaseMotors = release;
+    isHoming = homing;
+
+    unsigned long currentTime = micros();
+    for (int i = 0; i < numModules; i++) {
+        bool wasStepping = needsStepping[i];
+        targetPositions[i] = targets[i];
+        setStepping(i, modules[i].getPosition() != targetPositions[i]);
+        if (needsStepping[i] && ! wasStepping) {
+            moveStartTimes[i] = currentTime;
+            armHallLatch(i); // its latch was let go while it stood still, it may be parked over the magnet
+            startStepping(i, currentTime); // joining a move in progress, step straight away
+        }
+    }
+
+    switch (phase) {
+        case MotionPhase::Idle: break;
+        case MotionPhase::Hold:
+            if (steppingCount == 0) {
+                report.skippedWakeUps += numModules;
+                return; // already showing the targets, the hold runs out as it would have
+            }
+            report.moves++;
+            report.warmStarts++;
+            TRACE_INSTANT("move", steppingCount, TRACE_TRACK_MOTION);
+            enterPhase(MotionPhase::Stepping); // coils are still energised, no need to wake the motors up again
+            return;
+        case MotionPhase::Release:
+            enterPhase(MotionPhase::Stepping); // coils are still energised, carry on towards the new targets
+            return;
+        case MotionPhase::Stepping:
+            if (steppingCount > 0) {
+                steppingStart = currentTime; // the new targets are stepped towards from now on
+            }
+            return;
+        default: return;                      // already waking up, the new targets are picked up on the fly
+    }
+
+    bool anyStepping = false;
+    for (int i = 0; i < numModules; i++) {
+        armHallLatch(i);
+        if (needsStepping[i]) {
+            anyStepping = true;
+        } else {
+            report.skippedWakeUps++;
+        }
+    }
+
+    if (! anyStepping) {
+        return; // already showing the targets, nothing to wake up for
+    }
+    report.moves++;
+    TRACE_INSTANT("move", steppingCount, TRACE_TRACK_MOTION);
+
+    // Wake up the motors that have to move before starting movement
+    // This gentle sequence ensures coils are energized and overcomes static friction
+    wakeUpSlot = 0;
+    wakeUpDelay = 0;
+    enterPhase(MotionPhase::WakeUp);
+}
+
+void SplitFlapMotion::tick() {
+    unsigned long currentTime = micros();
+
+    // Collect the writes of this tick and send them in one burst at the end
+    for (SplitFlapBus *bus : buses) {
+        bus->beginBatch();
+    }
+
+    switch (phase) {
+        case MotionPhase::Idle: break;
+        case MotionPhase::WakeUp: tickWakeUp(currentTime); break;
+        case MotionPhase::Settle:
+            // give the motor time to align to magnetic field
+            if (currentTime - phaseStartTime >= MOTOR_START_STOP_DELAY_MS * 1000UL) {
+                enterPhase(MotionPhase::Stepping);
+            }
+            break;
+        case MotionPhase::Stepping: tickStepping(currentTime); break;
+        case MotionPhase::Release:
+            // allow all motors time to settle
+            if (currentTime - phaseStartTime >= MOTOR_START_STOP_DELAY_MS * 1000UL) {
+                stopAll();
+            }
+            break;
+        case MotionPhase::Hold:
+            // nothing else came along within the hold window
+            if (currentTime - phaseStartTime >= holdTimeMs * 1000UL) {
+                stopAll();
+            }
+            break;
+    }
+
+    flushBuses();
+}
+
+void SplitFlapMotion::flushBuses() {
+    // The other controllers work through their batches in their own tasks while this one does the first
+    for (size_t i = 1; i < buses.size(); i++) {
+        if (buses[i]->hasPending()) {
+            buses[i]->flushAsync();
+        } else {
+            buses[i]->flush(); // nothing to send, not worth a task switch
+        }
+    }
+    buses[0]->flush();
+    for (size_t i = 1; i < buses.size(); i++) {
+        buses[i]->waitFlush();
+    }
+}
+
+unsigned long SplitFlapMotion::nextDeadline() const {
+    switch (phase) {
+        case MotionPhase::WakeUp: return phaseStartTime + wakeUpDelay;
+        case MotionPhase::Settle:
+        case MotionPhase::Release: return phaseStartTime + MOTOR_START_STOP_DELAY_MS * 1000UL;
+        case MotionPhase::Hold: return phaseStartTime + holdTimeMs * 1000UL;
+        case MotionPhase::Stepping: {
+            // with INT wired up there is nothing to read until an edge arrives, and the edge wakes the task itself
+            bool windowed = hallWindowed();
+            bool found = ! windowed && (! hasHallInterrupt() || hallEdgePending || hallPassPending);
+            unsigned long deadline = nextSensorCheckTime;
+            auto consider = [&](unsigned long time) {
+                if (! found || (long) (time - deadline) < 0) {
+                    deadline = time;
+                    found = true;
+                }
+            };
+            // a stale entry on top only means an early wake-up that finds nothing to do
+            if (! stepDeadlines.empty()) {
+                consider(stepDeadlines.front().time);
+            }
+            if (windowed && ! sensorDeadlines.empty()) {
+                consider(sensorDeadlines.front().time);
+            }
+            return found ? deadline : micros();
+        }
+        default: return micros();
+    }
+}
+
+void SplitFlapMotion::setStepping(int module, bool stepping) {
+    if (needsStepping[module] != stepping) {
+        steppingCount += stepping ? 1 : -1;
+        needsStepping[module] = stepping;
+    }
+}
+
+void SplitFlapMotion::armHallLatch(int module) {
+    resetLatches[module] = true; // the magnet under the sensor at the start is not a crossing
+    sensorTriggered[module] = false;
+}
+
+void SplitFlapMotion::startStepping(int module, unsigned long currentTime) {
+    nextStepTimes[module] = currentTime;
+    nextSensorTimes[module] = currentTime;
+    lastStepTimes[module] = 0;
+    stepCounts[module] = 0; // from rest, start at the bottom of the ramp
+
+    if (needsStepping[module]) {
+        pushDeadline(stepDeadlines, currentTime, module);
+        pushDeadline(sensorDeadlines, currentTime, module);
+    }
+}
+
+// Wrapping comparison of micros() deadlines, std heaps put the greatest on top so the later time is the lesser
+static bool deadlineAfter(unsigned long a, unsigned long b) {
+    return (long) (a - b) > 0;
+}
+
+void SplitFlapMotion::pushDeadline(std::vector<Deadline> &deadlines, unsigned long time, int module) {
+    deadlines.push_back({time, module});
+    std::push_heap(deadlines.begin(), deadlines.end(), [](const Deadline &a, const Deadline &b) {
+        return deadlineAfter(a.time, b.time);
+    });
+}
+
+SplitFlapMotion::Deadline SplitFlapMotion::popDeadline(std::vector<Deadline> &deadlines) {
+    std::pop_heap(deadlines.begin(), deadlines.end(), [](const Deadline &a, const Deadline &b) {
+        return deadlineAfter(a.time, b.time);
+    });
+    Deadline deadline = deadlines.back();
+    deadlines.pop_back();
+    return deadline;
+}
+
+void SplitFlapMotion::tickWakeUp(unsigned long currentTime) {
+    if (currentTime - phaseStartTime < wakeUpDelay) {
+        return;
+    }
+
+    if (wakeUpSlot >= WAKE_UP_SLOTS) {
+        for (int i = 0; i < numModules; i++) {
+            if (needsStepping[i]) {
+                modules[i].start(); // not sure if this helps or not, likely that it does not based on testing
+            }
+        }
+        enterPhase(MotionPhase::Settle);
+        return;
+    }
+
+    // One pass over the bus per slot, the wait after it is shared by all modules so the whole display wakes up in
+    // the time a single module takes. Modules already at their target stay asleep.
+    unsigned long slotDelay = 0;
+    for (int i = 0; i < numModules; i++) {
+        if (needsStepping[i]) {
+            slotDelay = max(slotDelay, modules[i].wakeUpStep(wakeUpSlot));
+        }
+    }
+    wakeUpDelay = slotDelay * 1000UL;
+    phaseStartTime = currentTime;
+    wakeUpSlot++;
+}
+
+void SplitFlapMotion::tickStepping(unsigned long currentTime) {
+    while (! stepDeadlines.empty() && ! deadlineAfter(stepDeadlines.front().time, currentTime)) {
+        Deadline due = popDeadline(stepDeadlines);
+        int i = due.module;
+        if (! needsStepping[i] || due.time != nextStepTimes[i]) {
+            continue; // stopped or retargeted since this was scheduled
+        }
+
+        unsigned long stepTime = micros();
+        unsigned long lateness = stepTime - nextStepTimes[i];
+        if (lastStepTimes[i] != 0) {
+            unsigned long interval = stepTime - lastStepTimes[i];
+            unsigned long expected = stepIntervals[i];
+            recordJitter(interval > expected ? interval - expected : expected - interval);
+        }
+        lastStepTimes[i] = stepTime;
+        modules[i].step();
+        stepCounts[i]++;
+        if (edgeScan) {
+            checkHallEffectSensor(i); // sees the drum as of the previous step, the same lag at both edges
+        }
+
+        // Schedule from the deadline rather than from now so lateness does not accumulate, unless a whole step
+        // period was missed, then start over instead of rushing the motor to catch up
+        stepIntervals[i] = nextInterval(i);
+        nextStepTimes[i] += lateness > stepIntervals[i] ? lateness + stepIntervals[i] : stepIntervals[i];
+
+        if (metrics != nullptr && stepCounts[i] == 1) {
+            metrics->recordWakeUp(i, (stepTime - moveStartTimes[i]) / 1000);
+        }
+        if (modules[i].getPosition() == targetPositions[i]) { // this module is not in the correct position,
+            // requires stepping
+            setStepping(i, false);
+            if (metrics != nullptr) {
+                metrics->recordMove(i, (stepTime - moveStartTimes[i]) / 1000);
+            }
+        } else {
+            steppedModules.push_back(i);
+        }
+    }
+
+    // Back on the heap only now, a deadline that is already due again waits for the next tick instead of
+    // overwriting this step's coil pattern in the batch
+    for (int i : steppedModules) {
+        pushDeadline(stepDeadlines, nextStepTimes[i], i);
+    }
+    steppedModules.clear();
+
+    if (edgeScan) {
+        // every moving sensor has just been read
+    } else if (hallWindowed()) {
+        checkHallWindows(currentTime);
+    } else if (hallCheckDue(currentTime)) {
+        checkHallEffectSensors();
+    }
+
+    if (steppingCount > 0) {
+        return;
+    }
+
+    if (! releaseMotors) {
+        finish();
+    } else if (holdTimeMs > 0) {
+        enterPhase(MotionPhase::Hold);
+    } else {
+        enterPhase(MotionPhase::Release);
+    }
+}
+
+bool SplitFlapMotion::hallCheckDue(unsigned long currentTime) {
+    if ((long) (currentTime - nextSensorCheckTime) < 0) {
+        return false;
+    }
+
+    if (! hasHallInterrupt()) { // check hall effect sensor every HALL_EFFECT_CHECK_INTERVAL_US
+        nextSensorCheckTime += HALL_EFFECT_CHECK_INTERVAL_US;
+        if ((long) (currentTime - nextSensorCheckTime) >= 0) {
+            nextSensorCheckTime = currentTime + HALL_EFFECT_CHECK_INTERVAL_US;
+        }
+        return true;
+    }
+
+    if (hallEdgePending) {
+        unsigned long latency = micros() - hallEdgeTime;
+        hallEdgePending = false; // an edge from here on starts another pass
+        report.hallEdges++;
+        report.hallLatencyMaxUs = max(report.hallLatencyMaxUs, latency);
+    } else if (! hallPassPending) {
+        return false;
+    }
+
+    hallPassPending = false;
+    nextSensorCheckTime = currentTime + HALL_INTERRUPT_HOLDOFF_US;
+    return true;
+}
+
+void SplitFlapMotion::checkHallEffectSensors() {
+    report.hallPasses++;
+
+    // check every modules sensor
+    for (int i = 0; i < numModules; i++) {
+        if (needsStepping[i]) { // only check sensors where the module is still moving
+            checkHallEffectSensor(i);
+        } else {
+            resetLatches[i] = false;
+        }
+    }
+
+    if (! hasHallInterrupt() || digitalRead(hallInterruptPin) == HIGH) {
+        return;
+    }
+
+    // INT is shared, a module that has stopped moving can still be holding it low and would hide the next edge
+    for (int i = 0; i < numModules; i++) {
+        if (! needsStepping[i]) {
+            modules[i].readHallEffectSensor();
+        }
+    }
+
+    if (digitalRead(hallInterruptPin) == LOW) {
+        // every expander has been read and the line is still low, poll until it is released again
+        hallPassPending = true;
+        nextSensorCheckTime = micros() + HALL_EFFECT_CHECK_INTERVAL_US;
+    }
+}
+
+void SplitFlapMotion::checkHallWindows(unsigned long currentTime) {
+    bool anyRead = false;
+    while (! sensorDeadlines.empty() && ! deadlineAfter(sensorDeadlines.front().time, currentTime)) {
+        Deadline due = popDeadline(sensorDeadlines);
+        int i = due.module;
+        if (! needsStepping[i] || due.time != nextSensorTimes[i]) {
+            continue;
+        }
+        checkHallEffectSensor(i);
+        nextSensorTimes[i] = currentTime + nextSensorDelay(i); // never due again before the next tick
+        pushDeadline(sensorDeadlines, nextSensorTimes[i], i);
+        anyRead = true;
+    }
+
+    if (anyRead) {
+        report.hallPasses++;
+    }
+}
+
+void SplitFlapMotion::checkHallEffectSensor(int module) {
+    report.hallReads++;
+
+    if (! modules[module].readHallEffectSensor()) {
+        if (edgeScan && resetLatches[module] && sensorTriggered[module] && magnetWidths[module] < 0) {
+            // first falling edge after the magnet was detected, the count was set to the magnet position then
+            int stepsPerRot = modules[module].getStepsPerRot();
+            magnetWidths[module] =
+                (modules[module].getPosition() - modules[module].getMagnetPosition() + stepsPerRot) % stepsPerRot;
+        }
+        resetLatches[module] = false;
+        return;
+    }
+    if (resetLatches[module]) {
+        return; // still over the magnet it was over at the last read
+    }
+
+    // Track that this module's sensor was triggered (for debug summary)
+    sensorTriggered[module] = true;
+
+    // How far the count was off goes to a lock-free log, printing it here would hold up the steps
+    int drift, rotations;
+    if (modules[module].magnetDetected(drift, rotations) && driftLog != nullptr) {
+        driftLog->push(DriftRecord{(int16_t) module, (int16_t) drift, (int16_t) rotations, (uint32_t) millis()});
+    }
+    resetLatches[module] = true;
+}
+
+void SplitFlapMotion::setEdgeScan(bool enabled) {
+    edgeScan = enabled;
+    if (enabled) {
+        magnetWidths.assign(numModules, -1); // the widths of the last scan stay readable once it is switched off
+    }
+}
+
+unsigned long SplitFlapMotion::nextSensorDelay(int module) {
+    int stepsPerRot = modules[module].getStepsPerRot();
+    int toMagnet = (modules[module].getMagnetPosition() - modules[module].getPosition() + stepsPerRot) % stepsPerRot;
+    int pastMagnet = (stepsPerRot - toMagnet) % stepsPerRot; // lost steps make the magnet turn up late
+
+    if (toMagnet <= hallWindowSteps || pastMagnet <= hallWindowSteps) {
+        return HALL_WINDOW_CHECK_INTERVAL_US;
+    }
+
+    // No step is shorter than the cruise period, so the window cannot come up before this
+    unsigned long untilWindow = (unsigned long) (toMagnet - hallWindowSteps) * stepInterval;
+    return min(untilWindow, (unsigned long) HALL_SWEEP_INTERVAL_US);
+}
+
+void SplitFlapMotion::setHallInterrupt(int pin) {
+    if (hasHallInterrupt()) {
+        detachInterrupt(digitalPinToInterrupt(hallInterruptPin));
+    }
+
+    hallInterruptPin = pin;
+    if (! hasHallInterrupt()) {
+        return;
+    }
+
+    pinMode(pin, INPUT_PULLUP); // the expanders' INT outputs are open drain
+    attachInterruptArg(digitalPinToInterrupt(pin), hallInterrupt, this, FALLING);
+}
+
+void IRAM_ATTR SplitFlapMotion::hallInterrupt(void *arg) {
+    SplitFlapMotion *motion = static_cast<SplitFlapMotion *>(arg);
+    if (! motion->hallEdgePending) {
+        motion->hallEdgeTime = micros();
+        motion->hallEdgePending = true;
+    }
+
+#ifdef ARDUINO_ARCH_ESP32
+    // wake the task from its wait for the next step deadline
+    if (motion->task != nullptr) {
+        BaseType_t higherPriorityTaskWoken = pdFALSE;
+        vTaskNotifyGiveFromISR(motion->task, &higherPriorityTaskWoken);
+        if (higherPriorityTaskWoken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+#endif
+}
+
+void SplitFlapMotion::stopAll() {
+    for (int i = 0; i < numModules; i++) {
+        modules[i].stop();
+    }
+    finish();
+}
+
+void SplitFlapMotion::setRamp(float startStepsPerSecond, float stepsPerSecondSquared) {
+    rampStartRate = startStepsPerSecond;
+    rampAcceleration = stepsPerSecondSquared;
+    rampCruiseInterval = 0;
+}
+
+void SplitFlapMotion::buildRamp() {
+    // v = sqrt(v0^2 + 2an) after n steps of constant acceleration, up to the first step that reaches cruise rate
+    rampCruiseInterval = stepInterval;
+    rampLength = 0;
+    if (rampAcceleration <= 0 || rampStartRate <= 0) {
+        return;
+    }
+
+    while (rampLength < MAX_RAMP_STEPS) {
+        float rate = sqrtf(rampStartRate * rampStartRate + 2 * rampAcceleration * rampLength);
+        unsigned long interval = min((unsigned long) (1000000 / rate), (unsigned long) UINT16_MAX);
+        if (interval <= stepInterval) {
+            break;
+        }
+        rampIntervals[rampLength++] = interval;
+    }
+}
+
+unsigned long SplitFlapMotion::nextInterval(int module) {
+    int stepsPerRot = modules[module].getStepsPerRot();
+    int remaining = (targetPositions[module] - modules[module].getPosition() + stepsPerRot) % stepsPerRot;
+
+    // The slower of the acceleration and deceleration limits, so the last step is taken at the start rate again
+    int rampStep = min(stepCounts[module] - 1, remaining - 1);
+    if (rampStep >= 0 && rampStep < rampLength) {
+        return rampIntervals[rampStep];
+    }
+    return stepInterval;
+}
+
+unsigned long SplitFlapMotion::rampInterval(int rampStep, unsigned long cruiseInterval) const {
+    if (rampCruiseInterval == cruiseInterval) {
+        return rampStep < rampLength ? rampIntervals[rampStep] : cruiseInterval;
+    }
+    if (rampAcceleration <= 0 || rampStartRate <= 0 || rampStep >= MAX_RAMP_STEPS) {
+        return cruiseInterval;
+    }
+    // same as buildRamp, the periods only get shorter so the ramp ends where they reach the cruise period
+    float rate = sqrtf(rampStartRate * rampStartRate + 2 * rampAcceleration * rampStep);
+    return max(min((unsigned long) (1000000 / rate), (unsigned long) UINT16_MAX), cruiseInterval);
+}
+
+unsigned long SplitFlapMotion::rampTime(int steps, unsigned long cruiseInterval) const {
+    // The period after step c of n is at ramp step min(c - 1, n - c - 1), see nextInterval. Over the n - 1 periods
+    // that climbs from 0 and comes back down symmetrically, so each ramp step up to the middle counts twice.
+    int periods = steps - 1;
+    if (periods <= 0) {
+        return 0;
+    }
+    int half = periods / 2;
+    unsigned long total = 0;
+    int rampStep = 0;
+    for (; rampStep < half; rampStep++) {
+        unsigned long interval = rampInterval(rampStep, cruiseInterval);
+        if (interval == cruiseInterval) {
+            break;
+        }
+        total += 2 * interval;
+    }
+    total += 2 * (unsigned long) (half - rampStep) * cruiseInterval;
+    if (periods % 2 != 0) {
+        total += rampInterval(half, cruiseInterval);
+    }
+    return total;
+}
+
+MotionPlan SplitFlapMotion::plan(const int targets[], float timePerStep) const {
+    MotionPlan result = {};
+    result.steps.resize(numModules);
+    result.moduleMs.resize(numModules);
+    unsigned long cruiseInterval = (unsigned long) (timePerStep + 0.5f);
+
+    bool anyStepping = false;
+    unsigned long steppingUs = 0;
+    for (int i = 0; i < numModules; i++) {
+        int stepsPerRot = modules[i].getStepsPerRot();
+        result.steps[i] = (targets[i] - modules[i].getPosition() + stepsPerRot) % stepsPerRot;
+        unsigned long moduleUs = rampTime(result.steps[i], cruiseInterval);
+        result.moduleMs[i] = (moduleUs + 999) / 1000;
+        steppingUs = max(steppingUs, moduleUs);
+        anyStepping = anyStepping || result.steps[i] > 0;
+    }
+    if (! anyStepping) {
+        return result; // already showing the targets
+    }
+
+    // Wake-up and settle still to come, a move arriving while the coils are energised starts stepping straight away
+    unsigned long startUs = 0;
+    unsigned long elapsedUs = micros() - phaseStartTime;
+    switch (phase) {
+        case MotionPhase::Idle: startUs = getWakeUpMs() * 1000UL; break;
+        case MotionPhase::WakeUp:
+            startUs = wakeUpDelay - min(elapsedUs, wakeUpDelay);
+            for (int slot = wakeUpSlot; slot < WAKE_UP_SLOTS; slot++) {
+                startUs += SplitFlapModule::getWakeUpDelay(slot) * 1000UL;
+            }
+            startUs += MOTOR_START_STOP_DELAY_MS * 1000UL;
+            break;
+        case MotionPhase::Settle:
+            startUs = MOTOR_START_STOP_DELAY_MS * 1000UL - min(elapsedUs, MOTOR_START_STOP_DELAY_MS * 1000UL);
+            break;
+        default: break;
+    }
+
+    result.startUs = startUs;
+    result.startMs = (startUs + 999) / 1000;
+    result.totalMs = (startUs + steppingUs + 999) / 1000;
+    result.busyMs = result.totalMs + (holdTimeMs > 0 ? 0 : MOTOR_START_STOP_DELAY_MS);
+    return result;
+}
+
+unsigned long SplitFlapMotion::getWakeUpMs() {
+    unsigned long wakeUpMs = MOTOR_START_STOP_DELAY_MS;
+    for (int slot = 0; slot < WAKE_UP_SLOTS; slot++) {
+        wakeUpMs += SplitFlapModule::getWakeUpDelay(slot);
+    }
+    return wakeUpMs;
+}
+
+void SplitFlapMotion::setHoldTime(unsigned long seconds) {
+    holdTimeMs = min(seconds, (unsigned long) MAX_HOLD_TIME_S) * 1000UL;
+}
+
+MotionReport SplitFlapMotion::getReport() const {
+    MotionReport current = report;
+    current.phaseMs[(int) phase] += (micros() - phaseEnterTime) / 1000; // include the phase in progress
+    return current;
+}
+
+void SplitFlapMotion::recordJitter(unsigned long error) {
+    int bucket = 0;
+    while (error >= StepJitterBucketsUs[bucket]) {
+        bucket++;
+    }
+    stepJitter[bucket]++;
+}
+
+void SplitFlapMotion::finish() {
+    enterPhase(MotionPhase::Idle);
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+    // Log hall sensor summary if this is a homing operation, built on the stack as this runs on the motion task
+    if (isHoming) {
+        char triggered[LOG_MESSAGE_LENGTH] = "";
+        size_t length = 0;
+        for (int i = 0; i < numModules && length < sizeof(triggered); i++) {
+            if (sensorTriggered[i]) {
+                length += snprintf(triggered + length, sizeof(triggered) - length, "%s%d", length > 0 ? ", " : "", i);
+            }
+        }
+        LOG_INFO("Hall sensor summary - Triggered modules: %s", length > 0 ? triggered : "None");
+    }
+#endif
+}
+
+void SplitFlapMotion::enterPhase(MotionPhase nextPhase) {
+    unsigned long currentTime = micros();
+    report.phaseMs[(int) phase] += (currentTime - phaseEnterTime) / 1000;
+    if (phase != MotionPhase::Idle) {
+        // One event per phase on a track of its own, numbered by the move it belongs to
+        TRACE_COMPLETE(TracePhaseNames[(int) phase], currentTime - phaseEnterTime, report.moves, TRACE_TRACK_MOTION);
+    }
+
+    phase = nextPhase;
+    phaseStartTime = currentTime;
+    phaseEnterTime = currentTime;
+
+    if (nextPhase == MotionPhase::Stepping) {
+        stepDeadlines.clear(); // drop the stale entries of the last move
+        sensorDeadlines.clear();
+        for (int i = 0; i < numModules; i++) {
+            startStepping(i, phaseStartTime);
+        }
+        nextSensorCheckTime = phaseStartTime;
+        hallPassPending = true; // read every sensor once at the start, with or without an edge
+        steppingStart = phaseStartTime;
+    }
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+
+void SplitFlapMotion::startTask() {
+    if (task != nullptr) {
+        return;
+    }
+
+    commandQueue = xQueueCreate(MOTION_QUEUE_LENGTH, sizeof(MotionCommand));
+
+#ifdef MOTION_TASK_CORE
+    xTaskCreatePinnedToCore(taskEntry, "motion", MOTION_TASK_STACK, this, MOTION_TASK_PRIORITY, &task, MOTION_TASK_CORE);
+#else
+    xTaskCreate(taskEntry, "motion", MOTION_TASK_STACK, this, MOTION_TASK_PRIORITY, &task);
+#endif
+
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = wakeTask;
+    timerArgs.arg = this;
+    timerArgs.name = "motion";
+    esp_timer_create(&timerArgs, &wakeTimer);
+}
+
+bool SplitFlapMotion::hasTask() const {
+    return task != nullptr;
+}
+
+void SplitFlapMotion::post(const int targets[], float timePerStep, bool release, bool homing) {
+    if (task == nullptr) {
+        begin(targets, timePerStep, release, homing);
+        return;
+    }
+
+    MotionCommand command;
+    for (int i = 0; i < numModules; i++) {
+        command.targetPositions[i] = targets[i];
+    }
+    command.timePerStep = timePerStep;
+    command.releaseMotors = release;
+    command.isHoming = homing;
+    command.sequence = ++nextSequence;
+
+    postedSequence = command.sequence; // mark busy before the task can see the command
+    xQueueSend(commandQueue, &command, portMAX_DELAY);
+    xTaskNotifyGive(task);
+}
+
+bool SplitFlapMotion::isRunning() const {
+    if (task == nullptr) {
+        return isBusy();
+    }
+    return finishedSequence.load() != postedSequence.load();
+}
+
+void SplitFlapMotion::taskEntry(void *motion) {
+    static_cast<SplitFlapMotion *>(motion)->taskLoop();
+}
+
+void SplitFlapMotion::wakeTask(void *motion) {
+    xTaskNotifyGive(static_cast<SplitFlapMotion *>(motion)->task);
+}
+
+void SplitFlapMotion::taskLoop() {
+    MotionCommand command;
+
+    for (;;) {
+        while (xQueueReceive(commandQueue, &command, 0) == pdTRUE) {
+            begin(command.targetPositions, command.timePerStep, command.releaseMotors, command.isHoming);
+            appliedSequence = command.sequence;
+        }
+
+        tick();
+
+        if (! isBusy()) {
+            finishedSequence = appliedSequence;
+        }
+        if (! isActive()) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // sleep until the next command arrives
+            continue;
+        }
+
+        // Sleep until the next deadline, a new command wakes the task early
+        long wait = (long) (nextDeadline() - micros());
+        if (wait > 0) {
+            esp_timer_start_once(wakeTimer, wait);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            esp_timer_stop(wakeTimer);
+        }
+    }
+}
+
+#else
+
+// No FreeRTOS on the host, whoever posts a move ticks it
+
+void SplitFlapMotion::startTask() {}
+
+bool SplitFlapMotion::hasTask() const {
+    return false;
+}
+
+void SplitFlapMotion::post(const int targets[], float timePerStep, bool release, bool homing) {
+    begin(targets, timePerStep, release, homing);
+}
+
+bool SplitFlapMotion::isRunning() const {
+    return isBusy();
+}
+
+#endif
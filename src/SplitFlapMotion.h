@@ -0,0 +1,255 @@
+#pragma once
+
+#include "SplitFlapDrift.h"
+#include "SplitFlapMetrics.h"
+#include "SplitFlapModule.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <vector>
+
+#define MAX_MODULES (BUS_EXPANDERS * BUS_MUX_CHANNELS) // eight expanders on each multiplexer channel
+
+// Timing constants for motor control
+#define HALL_EFFECT_CHECK_INTERVAL_US  (20 * 1000)  // 20ms minimum to avoid sensor bouncing
+#define HALL_INTERRUPT_DISABLED        -1           // intPin value that polls the sensors instead
+#define HALL_INTERRUPT_HOLDOFF_US      (2 * 1000)   // minimum between reads started by INT, rides out sensor bounce
+#define HALL_WINDOW_CHECK_INTERVAL_US  (5 * 1000)   // between reads of a sensor while its magnet is expected
+#define HALL_SWEEP_INTERVAL_US         (50 * 1000)  // between reads outside the window, shorter than the magnet takes to
+                                                    // pass the sensor at cruise so a module that lost steps is caught
+#define MOTOR_START_STOP_DELAY_MS      200          // Time for motor to align to magnetic field
+#define MAX_HOLD_TIME_S                600          // upper limit of the warm-hold window
+#define MAX_RAMP_STEPS                 1024         // longest acceleration ramp, a gentler ramp tops out below cruise
+
+// Step interval error histogram buckets: <50us, <100us, <250us, <500us, <1ms, <2ms, <5ms, >=5ms
+#define STEP_JITTER_BUCKETS  8
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#define MOTION_TASK_PRIORITY  20    // above the network stack's TCP/IP task, below WiFi and esp_timer
+#define MOTION_TASK_STACK     4096
+#define MOTION_QUEUE_LENGTH   4     // pending move commands
+
+struct MotionCommand
+{
+    int targetPositions[MAX_MODULES]; // copied through the queue, only the first numModules are used
+    float timePerStep;
+    bool releaseMotors;
+    bool isHoming;
+    uint32_t sequence;
+};
+#endif
+
+// Stages of a move, tick() only ever does the small amount of work that is due in the current one
+enum class MotionPhase {
+    Idle,
+    WakeUp,   // gentle wake-up sequence, every module runs the same slot at once
+    Settle,   // coils energised, giving the rotors time to align to the field
+    Stepping, // stepping modules towards their targets while watching the hall effect sensors
+    Release,  // all targets reached, letting the motors settle before the coils are released
+    Hold      // all targets reached, coils kept energised so a move arriving within the hold window starts stepping
+              // straight away
+};
+
+#define MOTION_PHASES 6
+
+// Where the time went since boot, to tune the hold window against the power it costs
+struct MotionReport
+{
+    unsigned long moves;            // moves started from rest or from the hold window
+    unsigned long warmStarts;       // of those, moves that skipped wake-up and settle thanks to the hold window
+    unsigned long skippedWakeUps;   // module wake-ups skipped because the module was already at its target
+    unsigned long phaseMs[MOTION_PHASES];
+    unsigned long hallPasses;       // times the hall effect sensors were read
+    unsigned long hallEdges;        // of those, reads started by an edge on the INT line
+    unsigned long hallLatencyMaxUs; // longest time from an INT edge to the sensors being read
+    unsigned long hallReads;        // single sensors read, fewer than passes times modules with a window
+};
+
+// What a move would take if it was started now, from plan()
+struct MotionPlan
+{
+    std::vector<int> steps;              // steps each module takes to its target, drums only turn forward
+    std::vector<unsigned long> moduleMs; // from the first step until the module shows its target
+    unsigned long startMs;               // wake-up and settle before the first step, 0 when the coils are energised
+    unsigned long startUs;               // the same to the microsecond, for starting a move at a given time
+    unsigned long totalMs;               // until every module shows its target
+    unsigned long busyMs;                // until the engine is free again, including the settle before release
+};
+
+// Non-blocking motion engine. begin() hands it the targets and tick() advances steps, hall checks and the wake-up and
+// settle delays incrementally. Every step has an absolute deadline, so time lost to a late tick is not carried over
+// into the following steps.
+//
+// The deadlines of the modules still moving are kept in min-heaps, so a tick only touches the modules that are due
+// and finding the next deadline is a look at the top. The cost of a step stays flat as modules are added, rather
+// than every tick scanning the whole display.
+//
+// Each module follows a trapezoidal velocity profile: it starts at the ramp start rate, accelerates to the cruise
+// rate given to begin() and decelerates again over its last steps. Step periods come from a ramp table built once
+// per cruise rate, so the per-step cost is a lookup.
+//
+// The hall effect sensors are polled every HALL_EFFECT_CHECK_INTERVAL_US, unless setHallInterrupt() is given the GPIO
+// the expanders' INT outputs are wired to. Then they are only read after the line falls, which the PCF8575 does when an
+// input changes, and an edge while the task waits for its next step deadline wakes it straight away. If the line is
+// still low once every expander has been read, it is treated as stuck and the sensors are polled until it recovers.
+//
+// Without INT, setHallWindow() narrows the polling down to where the magnet is expected. Each module's position says
+// how far its magnet is, so its sensor is read every HALL_WINDOW_CHECK_INTERVAL_US within the window on either side
+// of the magnet position and otherwise only every HALL_SWEEP_INTERVAL_US, or earlier if the window comes up first at
+// cruise rate. The slow sweep still catches a module that has lost enough steps to be far off its position. Homing
+// starts from unknown positions, so it always polls every sensor.
+//
+// setEdgeScan() is for calibration at a slow speed: every module's sensor is read straight after each of its steps,
+// so both edges of the magnet are found to the step and getMagnetWidth() says how many steps the magnet read HIGH.
+//
+// With modules on two I2C controllers, each tick's batch on the second bus is handed to that bus's task while this one
+// flushes the first, so the transfers of both run at the same time.
+//
+// On the ESP32 startTask() moves the engine into its own high-priority task that sleeps until esp_timer wakes it at
+// the next deadline, and post() hands it moves through a queue. Without the task, post() starts the move directly and
+// the caller is expected to tick() it, which is how the native build runs.
+class SplitFlapMotion {
+  public:
+    SplitFlapMotion(SplitFlapBus &bus) : buses{&bus} {}
+
+    void setModules(SplitFlapModule *modules, int count); // sizes the per-module state, call while idle
+    void addBus(SplitFlapBus &bus) { buses.push_back(&bus); } // another controller, flushed alongside the first
+    void setDriftLog(DriftLog *log) { driftLog = log; } // where magnet crossings are recorded, null to not
+    void setMetrics(SplitFlapMetrics *metrics) { this->metrics = metrics; } // move timings, null to not record
+
+    // Start moving towards targetPositions, or retarget the move already in progress
+    void begin(const int targetPositions[], float timePerStep, bool releaseMotors = true, bool isHoming = false);
+    void tick();
+    bool isBusy() const { return phase != MotionPhase::Idle && phase != MotionPhase::Hold; }
+    bool isActive() const { return phase != MotionPhase::Idle; } // busy, or holding and still needs tick()
+    MotionPhase getPhase() const { return phase; }
+    unsigned long nextDeadline() const; // micros() at which tick() next has work to do, only valid while active
+
+    void setHallInterrupt(int pin); // GPIO wired to the expanders' INT outputs, HALL_INTERRUPT_DISABLED to poll
+    bool hasHallInterrupt() const { return hallInterruptPin != HALL_INTERRUPT_DISABLED; }
+    void setHallWindow(int steps) { hallWindowSteps = max(steps, 0); } // 0 polls every sensor at the fixed interval
+    int getHallWindow() const { return hallWindowSteps; }
+    void setEdgeScan(bool enabled); // read each moving module's sensor after every step, call while idle
+    int getMagnetWidth(int module) const { return magnetWidths[module]; } // steps from edge to edge, -1 until seen
+    void setRamp(float startStepsPerSecond, float stepsPerSecondSquared); // acceleration 0 steps at a constant rate
+    void setHoldTime(unsigned long seconds); // keep coils energised this long after a move, 0 releases straight away
+    unsigned long getHoldTime() const { return holdTimeMs / 1000; }
+    MotionReport getReport() const;
+    MotionPlan plan(const int targetPositions[], float timePerStep) const; // estimate a move, moves nothing
+    static unsigned long getWakeUpMs(); // wake-up and settle of a move from idle, the longest start a move can have
+    unsigned long getSteppingStart() const { return steppingStart.load(); } // micros() the latest move began stepping
+
+    void startTask();
+    bool hasTask() const;
+    void post(const int targetPositions[], float timePerStep, bool releaseMotors = true, bool isHoming = false);
+    bool isRunning() const;             // a posted move has not finished yet
+
+    const unsigned long *getStepJitter() const { return stepJitter; }
+    static const unsigned long StepJitterBucketsUs[STEP_JITTER_BUCKETS]; // upper bound of each bucket
+
+  private:
+    struct Deadline
+    {
+        unsigned long time;
+        int module;
+    };
+
+    SplitFlapModule *modules = nullptr;
+    std::vector<SplitFlapBus *> buses; // the modules' buses, every tick's writes are batched on each
+    DriftLog *driftLog = nullptr;
+    SplitFlapMetrics *metrics = nullptr;
+    int numModules = 0;
+
+    MotionPhase phase = MotionPhase::Idle;
+    unsigned long phaseStartTime;  // micros() when the current phase started, or the current wake-up slot
+    unsigned long phaseEnterTime = 0; // micros() when the current phase started
+    unsigned long holdTimeMs = 0;
+    std::atomic<unsigned long> steppingStart{0}; // set by the motion task, read by the cluster from loop()
+    MotionReport report = {};
+
+    unsigned long stepInterval;    // microseconds between steps of a single module at cruise rate
+    bool releaseMotors;
+    bool isHoming;
+
+    std::vector<int> targetPositions;
+    std::vector<bool> resetLatches;    // start with latch on to prevent case where the motion starts with the magnet
+                                       // over the sensor
+    std::vector<bool> needsStepping;   // modules that still require moving
+    int steppingCount = 0;             // of those, how many are set
+    std::vector<unsigned long> nextStepTimes; // deadline of each module's next step
+    std::vector<unsigned long> lastStepTimes; // when each module really stepped last, 0 before its first step
+    std::vector<unsigned long> stepIntervals; // period scheduled after each module's last step
+    std::vector<int> stepCounts;       // steps since each module started moving, its place on the ramp
+    std::vector<unsigned long> moveStartTimes; // micros() when each module was given its target, for the metrics
+    unsigned long nextSensorCheckTime; // deadline of the next read of all the hall effect sensors
+    std::vector<unsigned long> nextSensorTimes; // deadline of each module's next read, with a hall window
+    std::vector<bool> sensorTriggered; // Track which modules triggered their hall sensor
+
+    // Soonest first. Entries are not removed when a module stops or is rescheduled, one whose time no longer matches
+    // the module's deadline is skipped when it comes up.
+    std::vector<Deadline> stepDeadlines;
+    std::vector<Deadline> sensorDeadlines;
+    std::vector<int> steppedModules;   // modules stepped by the current tick, rescheduled once it is done
+
+    int hallInterruptPin = HALL_INTERRUPT_DISABLED;
+    volatile bool hallEdgePending = false;  // INT fell since the sensors were last read, set by the ISR
+    volatile unsigned long hallEdgeTime;    // micros() of the first of those edges
+    bool hallPassPending = false;           // read the sensors without waiting for an edge
+    int hallWindowSteps = 0;                // steps either side of the magnet position read densely, 0 for no window
+    bool edgeScan = false;                  // read the sensor after every step rather than on a schedule
+    std::vector<int> magnetWidths;          // steps between the edges of the last magnet crossed during a scan
+
+    float rampStartRate = 0;           // steps per second the motors can start and stop at
+    float rampAcceleration = 0;        // steps per second squared
+    uint16_t rampIntervals[MAX_RAMP_STEPS]; // step period after each step of the ramp, slowest first
+    int rampLength = 0;
+    unsigned long rampCruiseInterval = 0; // cruise period the ramp table was built for, 0 when it needs building
+
+    int wakeUpSlot;                    // next slot of the wake-up sequence
+    unsigned long wakeUpDelay;         // microseconds to wait after the previous slot
+
+    unsigned long stepJitter[STEP_JITTER_BUCKETS] = {}; // how far step intervals were off, since boot
+
+    void setStepping(int module, bool stepping);
+    void armHallLatch(int module); // before a module starts or rejoins stepping, from whatever phase
+    void startStepping(int module, unsigned long currentTime);
+    void flushBuses();
+    static void pushDeadline(std::vector<Deadline> &deadlines, unsigned long time, int module);
+    static Deadline popDeadline(std::vector<Deadline> &deadlines);
+    void tickWakeUp(unsigned long currentTime);
+    void tickStepping(unsigned long currentTime);
+    bool hallCheckDue(unsigned long currentTime);
+    bool hallWindowed() const { return hallWindowSteps > 0 && ! hasHallInterrupt() && ! isHoming; }
+    void checkHallEffectSensors();
+    void checkHallWindows(unsigned long currentTime);
+    void checkHallEffectSensor(int module);
+    unsigned long nextSensorDelay(int module);
+    static void hallInterrupt(void *motion);
+    void buildRamp();
+    unsigned long nextInterval(int module);
+    unsigned long rampInterval(int rampStep, unsigned long cruiseInterval) const;
+    unsigned long rampTime(int steps, unsigned long cruiseInterval) const;
+    void recordJitter(unsigned long error);
+    void stopAll();                    // release the coils of every module and finish
+    void finish();
+    void enterPhase(MotionPhase nextPhase);
+
+#ifdef ARDUINO_ARCH_ESP32
+    QueueHandle_t commandQueue = nullptr;
+    TaskHandle_t task = nullptr;
+    esp_timer_handle_t wakeTimer = nullptr;
+    std::atomic<uint32_t> postedSequence{0};   // last command handed to the task
+    std::atomic<uint32_t> finishedSequence{0}; // last command the task has finished
+    uint32_t nextSequence = 0;                 // only touched by the posting side
+    uint32_t appliedSequence = 0;              // only touched by the task
+
+    static void taskEntry(void *motion);
+    static void wakeTask(void *motion);
+    void taskLoop();
+#endif
+};
@@ -1,10 +1,13 @@
 #include "SplitFlapMqtt.h"
+#include "SplitFlapLog.h"
+#include "SplitFlapTrace.h"
 #include "SplitFlapWebServer.h"
 
 SplitFlapMqtt::SplitFlapMqtt(JsonSettings &settings, WiFiClient &wifiClient)
     : settings(settings), wifiClient(wifiClient), mqttClient(wifiClient), display(nullptr), webServer(nullptr) {}
 
 void SplitFlapMqtt::setup() {
+    TRACE_SCOPE("mqtt.setup");
     mqttServer = settings.getString("mqtt_server");
     mqttPort = settings.getInt("mqtt_port");
     mqttUser = settings.getString("mqtt_user");
@@ -14,8 +17,11 @@ void SplitFlapMqtt::setup() {
     String name = settings.getString("name");
 
     topic_command = "splitflap/" + mdns + "/set";
+    topic_alert = "splitflap/" + mdns + "/alert";
     topic_state = "splitflap/" + mdns + "/state";
     topic_avail = "splitflap/" + mdns + "/availability";
+    topic_attributes = "splitflap/" + mdns + "/attributes";
+    topic_metrics = "splitflap/" + mdns + "/metrics";
     topic_config_text = "homeassistant/text/splitflap_text_" + mdns + "/config";
     topic_config_sensor = "homeassistant/sensor/splitflap_sensor_" + mdns + "/config";
 
@@ -25,10 +31,14 @@ void SplitFlapMqtt::setup() {
         for (unsigned int i = 0; i < length; i++) {
             message += (char) payload[i];
         }
-        Serial.printf("[MQTT] Message received: %s\n", message.c_str());
-        if (display) {
+        LOG_INFO("[MQTT] Message received: %s", message.c_str());
+        if (display && topic_alert == topic) {
+            // shown as soon as possible, cutting into whatever is moving, and left to the modes afterwards
             float maxVel = settings.getFloat("maxVel");
-            display->writeString(message, maxVel, false);
+            display->queueString(message, CommandSource::Alert, CommandPriority::Alert, true, maxVel);
+        } else if (display) {
+            float maxVel = settings.getFloat("maxVel");
+            display->queueString(message, CommandSource::Mqtt, CommandPriority::Text, false, maxVel); // loop() shows it
             // Update the web server's state to prevent mode logic from overwriting
             if (webServer) {
                 webServer->setInputString(message);      // Update input to match
@@ -41,8 +51,9 @@ void SplitFlapMqtt::setup() {
 }
 
 void SplitFlapMqtt::connectToMqtt() {
+    TRACE_SCOPE("mqtt.connect");
     if (! mqttClient.connected()) {
-        Serial.println("[MQTT] Attempting to connect...");
+        LOG_INFO("[MQTT] Attempting to connect...");
         String mdns = settings.getString("mdns");
         String name = settings.getString("name");
 
@@ -53,7 +64,7 @@ void SplitFlapMqtt::connectToMqtt() {
         }
 
         if (mqttClient.connected()) {
-            Serial.println("[MQTT] Connected to broker");
+            LOG_INFO("[MQTT] Connected to broker");
 
             // clang-format off
             String payload_text = "{"
@@ -87,13 +98,14 @@ void SplitFlapMqtt::connectToMqtt() {
             // clang-format on
 
             mqttClient.subscribe(topic_command.c_str());
+            mqttClient.subscribe(topic_alert.c_str());
             mqttClient.publish(topic_avail.c_str(), "online", true);
             mqttClient.publish(topic_state.c_str(), "", true);
 
             mqttClient.publish(topic_config_text.c_str(), payload_text.c_str(), true);
             mqttClient.publish(topic_config_sensor.c_str(), payload_sensor.c_str(), true);
         } else {
-            Serial.println("[MQTT] Failed to connect");
+            LOG_WARN("[MQTT] Failed to connect");
         }
     }
 }
@@ -107,13 +119,84 @@ void SplitFlapMqtt::setWebServer(SplitFlapWebServer *ws) {
 }
 
 void SplitFlapMqtt::publishState(const String &message) {
-    Serial.println("[MQTT] Publishing state: " + message);
+    LOG_INFO("[MQTT] Publishing state: %s", message.c_str());
     mqttClient.publish(topic_state.c_str(), message.c_str(), true);
+    publishAttributes(message, 0, false);
+}
+
+void SplitFlapMqtt::publishEta(const String &target, unsigned long etaMs) {
+    publishAttributes(target, etaMs, true);
+}
+
+void SplitFlapMqtt::publishAttributes(const String &target, unsigned long etaMs, bool moving) {
+    JsonDocument attributes;
+    attributes["target"] = target;
+    attributes["moving"] = moving;
+    attributes["etaMs"] = etaMs;
+
+    String payload;
+    serializeJson(attributes, payload);
+    mqttClient.publish(topic_attributes.c_str(), payload.c_str(), true);
 }
 
 void SplitFlapMqtt::loop() {
     mqttClient.loop();
     checkConnection();  // Check and reconnect if needed
+
+    unsigned long metricsInterval = max(settings.getInt("metricsInterval"), 0) * 1000UL;
+    if (metricsInterval > 0 && display && mqttClient.connected() && millis() - lastMetricsTime >= metricsInterval) {
+        lastMetricsTime = millis();
+        publishMetrics();
+    }
+}
+
+void SplitFlapMqtt::publishMetrics() {
+    // Means rather than histograms, a message per module stays small whatever the size of the board
+    const SplitFlapMetrics &metrics = display->getMetrics();
+    std::vector<ModuleDrift> drift = display->getDrift();
+    float microsteps = display->getMicrosteps();
+    unsigned long steps = 0;
+    unsigned long errors = 0;
+    unsigned long recoveries = 0;
+    int flagged = 0;
+    for (int i = 0; i < display->getNumModules(); i++) {
+        const SplitFlapModule &module = display->getModules()[i];
+        const ModuleMetrics &moduleMetrics = metrics.getModule(i);
+        steps += module.getSteps();
+        errors += module.getErrors();
+        recoveries += module.getRecoveries();
+        flagged += drift[i].trouble;
+
+        JsonDocument values;
+        values["steps"] = module.getSteps();
+        values["i2cErrors"] = module.getErrors();
+        values["i2cRecoveries"] = module.getRecoveries();
+        values["crossings"] = drift[i].crossings;
+        values["drift"] = drift[i].last / microsteps;
+        values["moves"] = moduleMetrics.moveMs.count;
+        values["moveMs"] = moduleMetrics.moveMs.count ? moduleMetrics.moveMs.sum / moduleMetrics.moveMs.count : 0;
+        values["wakeUpMs"] =
+            moduleMetrics.wakeUpMs.count ? moduleMetrics.wakeUpMs.sum / moduleMetrics.wakeUpMs.count : 0;
+
+        String payload;
+        serializeJson(values, payload);
+        mqttClient.publish((topic_metrics + "/" + i).c_str(), payload.c_str());
+    }
+
+    JsonDocument totals;
+    totals["uptime"] = millis() / 1000;
+    totals["loopRate"] = metrics.getLoopRate();
+    totals["heapFree"] = ESP.getFreeHeap();
+    totals["heapMinFree"] = ESP.getMinFreeHeap();
+    totals["moves"] = display->getMotion().getReport().moves;
+    totals["steps"] = steps;
+    totals["i2cErrors"] = errors;
+    totals["i2cRecoveries"] = recoveries;
+    totals["flagged"] = flagged;
+
+    String payload;
+    serializeJson(totals, payload);
+    mqttClient.publish(topic_metrics.c_str(), payload.c_str());
 }
 
 void SplitFlapMqtt::checkConnection() {
@@ -126,7 +209,7 @@ void SplitFlapMqtt::checkConnection() {
 
     // Detect state change from connected to disconnected
     if (wasConnected && !currentlyConnected) {
-        Serial.println("[MQTT] Connection lost!");
+        LOG_WARN("[MQTT] Connection lost!");
         // Publish offline status before losing connection completely
         mqttClient.publish(topic_avail.c_str(), "offline", true);
     }
@@ -138,13 +221,13 @@ void SplitFlapMqtt::checkConnection() {
         // Check if enough time has passed since last attempt
         if (now - lastReconnectAttempt >= reconnectInterval) {
             lastReconnectAttempt = now;
-            Serial.println("[MQTT] Attempting to reconnect...");
+            LOG_INFO("[MQTT] Attempting to reconnect...");
             connectToMqtt();
         }
     } else {
         // Connected - detect state change from disconnected to connected
         if (!wasConnected) {
-            Serial.println("[MQTT] Connection established/restored!");
+            LOG_INFO("[MQTT] Connection established/restored!");
         }
     }
 
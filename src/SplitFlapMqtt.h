@@ -16,6 +16,7 @@ class SplitFlapMqtt {
     void setup();
     void loop();                                               // needed for PubSubClient3
     void publishState(const String &message);
+    void publishEta(const String &target, unsigned long etaMs); // a move to target started, arrives in etaMs
     void setDisplay(SplitFlapDisplay *display);
     void setWebServer(SplitFlapWebServer *server);
     bool isConnected();
@@ -30,6 +31,8 @@ class SplitFlapMqtt {
     SplitFlapWebServer *webServer;
 
     void connectToMqtt();
+    void publishAttributes(const String &target, unsigned long etaMs, bool moving);
+    void publishMetrics(); // display-wide totals, then a message per module
 
     // MQTT config
     String mqttServer;
@@ -37,12 +40,16 @@ class SplitFlapMqtt {
     String mqttUser;
     String mqttPass;
     String topic_command;
+    String topic_alert;      // text shown ahead of everything else
     String topic_state;
     String topic_avail;
+    String topic_attributes; // target, ETA and whether the display is moving, for the state sensor
+    String topic_metrics;    // the metrics of /api/metrics in short, every metricsInterval seconds
     String topic_config_text;
     String topic_config_sensor;
 
     unsigned long lastAttempt = 0;
+    unsigned long lastMetricsTime = 0;
     int retryCount = 0;
 
     // MQTT reconnection tracking
@@ -0,0 +1,165 @@
+#include "SplitFlapTrace.h"
+
+#ifdef SPLITFLAP_TRACE
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#define TRACE_TRACK_HOST 2 // the host build runs everything on one thread
+#endif
+
+struct TraceSlot
+{
+    std::atomic<uint32_t> sequence; // index + 1 once written, 0 while it is being written
+    TraceEvent event;
+};
+
+TraceSlot SplitFlapTrace::slots[TRACE_LENGTH];
+std::atomic<uint32_t> SplitFlapTrace::next(0);
+
+uint64_t SplitFlapTrace::now() {
+#ifdef ARDUINO_ARCH_ESP32
+    return esp_timer_get_time();
+#else
+    return host::nowUs(); // unlike micros() it does not move the virtual clock, tracing leaves the timings alone
+#endif
+}
+
+void SplitFlapTrace::complete(const char *name, uint32_t durationUs, int32_t arg, uint32_t track) {
+    record(name, now() - durationUs, durationUs, arg, track, 'X');
+}
+
+void SplitFlapTrace::instant(const char *name, int32_t arg, uint32_t track) {
+    record(name, now(), 0, arg, track, 'i');
+}
+
+void SplitFlapTrace::record(
+    const char *name, uint64_t startUs, uint32_t durationUs, int32_t arg, uint32_t track, char type
+) {
+    if (track == TRACE_TRACK_TASK) {
+#ifdef ARDUINO_ARCH_ESP32
+        track = (uint32_t) (uintptr_t) xTaskGetCurrentTaskHandle();
+#else
+        track = TRACE_TRACK_HOST;
+#endif
+    }
+
+    uint32_t index = next.fetch_add(1, std::memory_order_relaxed);
+    TraceSlot &slot = slots[index % TRACE_LENGTH];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release); // a reader sees the slot taken before it sees it change
+    slot.event.startUs = startUs;
+    slot.event.name = name;
+    slot.event.durationUs = durationUs;
+    slot.event.track = track;
+    slot.event.arg = arg;
+    slot.event.type = type;
+    slot.sequence.store(index + 1, std::memory_order_release); // publishes the event
+}
+
+bool SplitFlapTrace::get(uint32_t index, TraceEvent &event) {
+    TraceSlot &slot = slots[index % TRACE_LENGTH];
+    if (slot.sequence.load(std::memory_order_acquire) != index + 1) return false;
+    event = slot.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == index + 1; // not overwritten while it was copied
+}
+
+const char *SplitFlapTrace::getTrackName(uint32_t track) {
+    if (track == TRACE_TRACK_MOTION) return "motion phases";
+#ifdef ARDUINO_ARCH_ESP32
+    // Only tasks that live until reboot record events, the handle is still good
+    return pcTaskGetName((TaskHandle_t) (uintptr_t) track);
+#else
+    return "main";
+#endif
+}
+
+TraceExporter::TraceExporter() {
+    end = SplitFlapTrace::getRecorded();
+    index = end > TRACE_LENGTH ? end - TRACE_LENGTH : 0;
+
+    TraceEvent event;
+    for (uint32_t i = index; i < end && trackCount < TRACE_MAX_TRACKS; i++) {
+        if (! SplitFlapTrace::get(i, event)) continue;
+        bool known = false;
+        for (int t = 0; t < trackCount; t++) {
+            known = known || tracks[t] == event.track;
+        }
+        if (! known) tracks[trackCount++] = event.track;
+    }
+}
+
+size_t TraceExporter::read(uint8_t *buffer, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        if (pendingAt >= pending.length()) {
+            pending = "";
+            pendingAt = 0;
+            if (! renderNext()) {
+                break;
+            }
+        }
+        size_t count = min(length - written, pending.length() - pendingAt);
+        memcpy(buffer + written, pending.c_str() + pendingAt, count);
+        written += count;
+        pendingAt += count;
+    }
+    return written;
+}
+
+bool TraceExporter::renderNext() {
+    if (done) {
+        return false;
+    }
+
+    char line[160];
+    if (track < 0) {
+        pending += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        pending += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"splitflap\"}}";
+        track = 0;
+        return true;
+    }
+
+    if (track < trackCount) {
+        snprintf(line, sizeof(line),
+                 ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                 (unsigned long) tracks[track], SplitFlapTrace::getTrackName(tracks[track]));
+        pending += line;
+        track++;
+        return true;
+    }
+
+    // Skips what was overwritten since the export started
+    TraceEvent event;
+    while (index < end) {
+        if (SplitFlapTrace::get(index++, event)) {
+            renderEvent(event);
+            return true;
+        }
+    }
+
+    pending += "\n]}\n";
+    done = true;
+    return true;
+}
+
+void TraceExporter::renderEvent(const TraceEvent &event) {
+    char line[200];
+    int length = snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%lu",
+                          event.name, event.type, (unsigned long long) event.startUs, (unsigned long) event.track);
+    if (event.type == 'X') {
+        length += snprintf(line + length, sizeof(line) - length, ",\"dur\":%lu", (unsigned long) event.durationUs);
+    } else {
+        length += snprintf(line + length, sizeof(line) - length, ",\"s\":\"t\"");
+    }
+    if (event.arg != TRACE_NO_ARG) {
+        length += snprintf(line + length, sizeof(line) - length, ",\"args\":{\"value\":%ld}", (long) event.arg);
+    }
+    snprintf(line + length, sizeof(line) - length, "}");
+    pending += line;
+}
+
+#endif
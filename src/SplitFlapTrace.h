@@ -0,0 +1,103 @@
+#pragma once
+
+// Trace points for finding out where the time goes, at boot and within a move. Building with -D SPLITFLAP_TRACE
+// records them into a ring allocated up front, and /api/trace returns it as Chrome trace_event JSON to open in
+// chrome://tracing or ui.perfetto.dev. Without the flag the macros expand to nothing and none of this is compiled.
+//
+//   TRACE_SCOPE("display.init");                     // from here to the end of the block
+//   TRACE_SCOPE("module.init", address);             // with a number shown as the event's value
+//   TRACE_COMPLETE("stepping", durationUs, modules); // something that ends now and was timed by the caller
+//   TRACE_INSTANT("move", modules);                  // a point in time
+//
+// Names have to be string literals, only the pointer is kept.
+
+#ifdef SPLITFLAP_TRACE
+
+#include <Arduino.h>
+#include <atomic>
+
+#ifndef TRACE_LENGTH
+#define TRACE_LENGTH 256 // events kept, 40 bytes each, the oldest are overwritten
+#endif
+#define TRACE_NO_ARG       INT32_MIN // event without a value
+#define TRACE_TRACK_TASK   0         // the task recording the event
+#define TRACE_TRACK_MOTION 1         // motion phases, a timeline of their own whichever task runs the engine
+#define TRACE_MAX_TRACKS   8         // named in the export, events of further tracks are still exported
+
+struct TraceEvent
+{
+    uint64_t startUs;    // since boot
+    const char *name;
+    uint32_t durationUs; // 0 for an instant
+    uint32_t track;
+    int32_t arg;
+    char type;           // 'X' complete or 'i' instant, as in trace_event
+};
+
+struct TraceSlot;
+
+// The ring. Recording claims a slot with one atomic add and marks it written with one store, so any task and the
+// motion engine can record without a lock. Readers copy a slot and check its sequence before and after, a slot
+// overwritten while it was copied is skipped.
+class SplitFlapTrace {
+  public:
+    static uint64_t now(); // microseconds since boot, 64 bit so a trace spans any uptime
+    static void complete(const char *name, uint32_t durationUs, int32_t arg = TRACE_NO_ARG,
+                         uint32_t track = TRACE_TRACK_TASK);
+    static void instant(const char *name, int32_t arg = TRACE_NO_ARG, uint32_t track = TRACE_TRACK_TASK);
+
+    static uint32_t getRecorded() { return next.load(std::memory_order_acquire); } // events since boot
+    static bool get(uint32_t index, TraceEvent &event); // false once the event is overwritten or not written yet
+    static const char *getTrackName(uint32_t track);
+
+  private:
+    static TraceSlot slots[TRACE_LENGTH];
+    static std::atomic<uint32_t> next;
+
+    static void record(const char *name, uint64_t startUs, uint32_t durationUs, int32_t arg, uint32_t track, char type);
+};
+
+class TraceScope {
+  public:
+    TraceScope(const char *name, int32_t arg = TRACE_NO_ARG) : name(name), arg(arg), startUs(SplitFlapTrace::now()) {}
+    ~TraceScope() { SplitFlapTrace::complete(name, SplitFlapTrace::now() - startUs, arg); }
+
+  private:
+    const char *name;
+    int32_t arg;
+    uint64_t startUs;
+};
+
+// Renders the ring as trace_event JSON an event at a time, like MetricsExporter, so it streams through a small buffer
+class TraceExporter {
+  public:
+    TraceExporter();
+    size_t read(uint8_t *buffer, size_t length); // next bytes of the JSON, 0 once it is all out
+
+  private:
+    uint32_t index; // next event to render
+    uint32_t end;   // recorded when the export started, later events wait for the next one
+    int track = -1; // next track name to render, -1 before the opening
+    uint32_t tracks[TRACE_MAX_TRACKS];
+    int trackCount = 0;
+    bool done = false;
+    String pending;
+    size_t pendingAt = 0;
+
+    bool renderNext();
+    void renderEvent(const TraceEvent &event);
+};
+
+#define TRACE_CONCAT_(a, b)  a##b
+#define TRACE_CONCAT(a, b)   TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...)     TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+#define TRACE_COMPLETE(...)  SplitFlapTrace::complete(__VA_ARGS__)
+#define TRACE_INSTANT(...)   SplitFlapTrace::instant(__VA_ARGS__)
+
+#else
+
+#define TRACE_SCOPE(...)
+#define TRACE_COMPLETE(...)
+#define TRACE_INSTANT(...)
+
+#endif
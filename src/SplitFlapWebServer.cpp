@@ -1,8 +1,12 @@
 #include "SplitFlapWebServer.h"
+#include "SplitFlapCluster.h"
 #include "SplitFlapDisplay.h"
+#include "SplitFlapLog.h"
+#include "SplitFlapTrace.h"
 
 #include <ArduinoJson.h>
 #include <AsyncJson.h>
+#include <memory>
 
 #define AP_SSID "Split Flap Display"
 
@@ -15,19 +19,21 @@
 #endif
 
 SplitFlapWebServer::SplitFlapWebServer(JsonSettings &settings)
-    : settings(settings), server(80), multiWordDelay(1000), rebootRequired(false), attemptReconnect(false),
-      multiWordCurrentIndex(0), numMultiWords(0), wifiCheckInterval(1000), connectionMode(0), checkDateInterval(250),
-      centering(1), inputString(""), multiInputString(""), writtenString("") {
+    : settings(settings), server(80), logEvents("/api/logs"), multiWordDelay(1000), rebootRequired(false),
+      attemptReconnect(false), multiWordCurrentIndex(0), numMultiWords(0), wifiCheckInterval(1000), connectionMode(0),
+      checkDateInterval(250), centering(1), inputString(""), multiInputString(""), writtenString("") {
     lastSwitchMultiTime = millis();
 }
 
 void SplitFlapWebServer::init() {
+    TRACE_SCOPE("webServer.init");
     if (! LittleFS.begin()) {
-        Serial.println("An Error has occurred while mounting LittleFS");
+        LOG_ERROR("An Error has occurred while mounting LittleFS");
         return;
     }
 
     setTimezone();
+    loadCharset();
 }
 
 void SplitFlapWebServer::setTimezone() {
@@ -38,7 +44,7 @@ void SplitFlapWebServer::setTimezone() {
 
     File file = LittleFS.open("/timezones.json", "r");
     if (! file) {
-        Serial.println("Failed to open timezones.json; defaulting to UTC");
+        LOG_WARN("Failed to open timezones.json; defaulting to UTC");
         configTzTime(defaultTz, sntpServer);
         return;
     }
@@ -52,7 +58,7 @@ void SplitFlapWebServer::setTimezone() {
     DeserializationError error = deserializeJson(timezones, buffer.get());
 
     if (error) {
-        Serial.println("Failed to parse timezones.json: " + String(error.c_str()));
+        LOG_WARN("Failed to parse timezones.json: %s", error.c_str());
         configTzTime(defaultTz, sntpServer);
         return;
     }
@@ -67,10 +73,31 @@ void SplitFlapWebServer::setTimezone() {
         }
     }
 
-    Serial.println("POSIX Timezone set to: " + posixTimezone);
+    LOG_INFO("POSIX Timezone set to: %s", posixTimezone.c_str());
     configTzTime(posixTimezone.c_str(), sntpServer);
 }
 
+void SplitFlapWebServer::loadCharset() {
+    if (! LittleFS.exists(CHARSET_FILE)) {
+        return;
+    }
+
+    File file = LittleFS.open(CHARSET_FILE, "r");
+    if (! file) {
+        LOG_WARN("Failed to open " CHARSET_FILE);
+        return;
+    }
+    String json = file.readString();
+    file.close();
+
+    String error;
+    if (! loadCustomCharset(json.c_str(), error)) {
+        LOG_WARN("Failed to load " CHARSET_FILE ": %s", error.c_str());
+        return;
+    }
+    LOG_INFO("Custom charset: %d flaps", getCharset(CHARSET_CUSTOM).size);
+}
+
 // Totally didn't use AI to make these functions
 //  Function to get current minute as a string
 String SplitFlapWebServer::getCurrentMinute() {
@@ -159,7 +186,7 @@ void SplitFlapWebServer::checkWiFi() {
         if (status == WL_CONNECTED) {
             // Successfully connected - reset reconnection tracking
             if (isReconnecting) {
-                Serial.println("WiFi reconnected successfully!");
+                LOG_INFO("WiFi reconnected successfully!");
                 isReconnecting = false;
                 reconnectAttempts = 0;
             }
@@ -167,13 +194,12 @@ void SplitFlapWebServer::checkWiFi() {
             // WiFi is disconnected
             if (!isReconnecting) {
                 // First detection of disconnection
-                Serial.print("WiFi lost! Status: ");
-                Serial.println(status);
+                LOG_WARN("WiFi lost! Status: %d", (int) status);
                 isReconnecting = true;
                 reconnectAttempts = 0;
                 lastReconnectAttempt = millis();
 
-                Serial.println("Attempting reconnection (attempt 1)...");
+                LOG_INFO("Attempting reconnection (attempt 1)...");
                 WiFi.disconnect();
                 WiFi.reconnect();
                 reconnectAttempts = 1;
@@ -187,13 +213,13 @@ void SplitFlapWebServer::checkWiFi() {
                     reconnectAttempts++;
 
                     if (reconnectAttempts >= maxReconnectAttempts) {
-                        Serial.println("Max reconnection attempts reached. Giving up.");
-                        Serial.println("Please restart the device or check WiFi credentials.");
+                        LOG_ERROR("Max reconnection attempts reached. Giving up.");
+                        LOG_ERROR("Please restart the device or check WiFi credentials.");
                         // Stop trying to prevent infinite loop
                         isReconnecting = false;
                     } else {
-                        Serial.printf("Reconnection attempt %d/%d (waited %lums)...\n",
-                                    reconnectAttempts, maxReconnectAttempts, timeSinceLastAttempt);
+                        LOG_INFO("Reconnection attempt %d/%d (waited %lums)...", reconnectAttempts,
+                                 maxReconnectAttempts, timeSinceLastAttempt);
                         WiFi.disconnect();
                         delay(100);
                         WiFi.reconnect();
@@ -211,9 +237,8 @@ bool SplitFlapWebServer::loadWiFiCredentials() {
     String password = String(WIFI_PASS).isEmpty() ? settings.getString("password") : String(WIFI_PASS);
 
     if (ssid != "" && password != "") {
-        Serial.println("Wi-Fi credentials loaded successfully.");
-        Serial.print("Connecting to Network: ");
-        Serial.println(ssid);
+        LOG_INFO("Wi-Fi credentials loaded successfully.");
+        LOG_INFO("Connecting to Network: %s", ssid.c_str());
         WiFi.mode(WIFI_STA);
 #ifdef WIFI_TX_POWER
         delay(100);
@@ -227,7 +252,9 @@ bool SplitFlapWebServer::loadWiFiCredentials() {
 
 void SplitFlapWebServer::checkRebootRequired() {
     if (rebootRequired) {
-        Serial.println("Reboot required. Restarting...");
+        LOG_INFO("Reboot required. Restarting...");
+        settings.flush(); // settings are written behind, make sure the ones that need the reboot are stored
+        SplitFlapLog::flush();
         delay(1000);
         ESP.restart();
     }
@@ -237,6 +264,7 @@ void SplitFlapWebServer::handleOta() {
     ArduinoOTA.handle();
 }
 void SplitFlapWebServer::enableOta() {
+    TRACE_SCOPE("ota.enable");
     // Skip OTA initialisation if no password is set
     if (settings.getString("otaPass") == "") {
         return;
@@ -246,7 +274,8 @@ void SplitFlapWebServer::enableOta() {
     ArduinoOTA.setPassword(settings.getString("otaPass").c_str());
 
     ArduinoOTA
-        .onStart([]() {
+        .onStart([this]() {
+        settings.flush(); // the update ends in a reboot
         String type;
         if (ArduinoOTA.getCommand() == U_FLASH) {
             type = "sketch";
@@ -254,35 +283,37 @@ void SplitFlapWebServer::enableOta() {
             type = "filesystem";
             LittleFS.end(); // Unmount the filesystem before update
         }
-        Serial.println("Start updating " + type);
+        LOG_INFO("Start updating %s", type.c_str());
     })
         .onEnd([]() {
-        Serial.println("\nEnd");
+        LOG_INFO("End");
         LittleFS.begin(); // Remount filesystem
     })
         .onProgress([](unsigned int progress, unsigned int total) {
-        Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+        LOG_DEBUG("Progress: %u%%", (progress / (total / 100)));
     }).onError([](ota_error_t error) {
-        Serial.printf("Error[%u]: ", error);
         LittleFS.begin(); // Remount filesystem
         if (error == OTA_AUTH_ERROR) {
-            Serial.println("Auth Failed");
+            LOG_ERROR("Error[%u]: Auth Failed", error);
         } else if (error == OTA_BEGIN_ERROR) {
-            Serial.println("Begin Failed");
+            LOG_ERROR("Error[%u]: Begin Failed", error);
         } else if (error == OTA_CONNECT_ERROR) {
-            Serial.println("Connect Failed");
+            LOG_ERROR("Error[%u]: Connect Failed", error);
         } else if (error == OTA_RECEIVE_ERROR) {
-            Serial.println("Receive Failed");
+            LOG_ERROR("Error[%u]: Receive Failed", error);
         } else if (error == OTA_END_ERROR) {
-            Serial.println("End Failed");
+            LOG_ERROR("Error[%u]: End Failed", error);
+        } else {
+            LOG_ERROR("Error[%u]", error);
         }
     });
 
     ArduinoOTA.begin();
-    Serial.println("OTA Initialized");
+    LOG_INFO("OTA Initialized");
 }
 
 bool SplitFlapWebServer::connectToWifi() {
+    TRACE_SCOPE("wifi.connect");
     if (loadWiFiCredentials()) {
         unsigned long startAttemptTime = millis();
         const unsigned long timeout = 20000; // 20 seconds
@@ -290,12 +321,11 @@ bool SplitFlapWebServer::connectToWifi() {
 
         while (WiFi.status() != WL_CONNECTED) {
             if (millis() - startAttemptTime >= timeout) {
-                Serial.println("_");
-                Serial.println("Wi-Fi connection failed! Timeout reached.");
+                LOG_WARN("Wi-Fi connection failed! Timeout reached.");
                 return false; // Return false if unable to connect in 30 seconds
             }
             if ((millis() - lastPrintTime) > 1000) {
-                Serial.print(".");
+                LOG_INFO("Waiting for Wi-Fi (%lus)", (millis() - startAttemptTime) / 1000);
                 lastPrintTime = millis();
             }
             yield();
@@ -308,14 +338,15 @@ bool SplitFlapWebServer::connectToWifi() {
         WiFi.setAutoReconnect(true);
         WiFi.persistent(true); // Saves Wi-Fi settings to flash memory
         WiFi.setSleep(false);
-        Serial.println("Connected to Wi-Fi!");
-        Serial.println("IP Address: http://" + WiFi.localIP().toString());
+        LOG_INFO("Connected to Wi-Fi!");
+        LOG_INFO("IP Address: http://%s", WiFi.localIP().toString().c_str());
         return true;
     }
     return false;
 }
 
 void SplitFlapWebServer::startAccessPoint() {
+    TRACE_SCOPE("wifi.accessPoint");
     connectionMode = 0;
     const char *apSSID = AP_SSID;
     WiFi.softAP(apSSID);
@@ -323,53 +354,62 @@ void SplitFlapWebServer::startAccessPoint() {
     delay(100);
     WiFi.setTxPower((wifi_power_t) WIFI_TX_POWER);
 #endif
-    Serial.println("AP Mode Started!");
-    Serial.println("Connect to: " + String(apSSID));
-    Serial.println("AP IP Address: http://" + WiFi.softAPIP().toString());
+    LOG_INFO("AP Mode Started!");
+    LOG_INFO("Connect to: %s", apSSID);
+    LOG_INFO("AP IP Address: http://%s", WiFi.softAPIP().toString().c_str());
 }
 
 void fourOhFour(AsyncWebServerRequest *request) {
-    Serial.println("Request: " + request->url());
-    Serial.println("Method: " + String(request->methodToString()));
+    LOG_INFO("Request: %s", request->url().c_str());
+    LOG_INFO("Method: %s", request->methodToString());
     request->send(404);
 }
 
 void SplitFlapWebServer::endMDNS() {
     MDNS.end();
-    Serial.println("mDNS responder stopped");
+    LOG_INFO("mDNS responder stopped");
 }
 
 void SplitFlapWebServer::startMDNS() {
+    TRACE_SCOPE("mdns.start");
     if (! MDNS.begin(settings.getString("mdns").c_str())) {
-        Serial.println("Error setting up MDNS responder!");
+        LOG_ERROR("Error setting up MDNS responder!");
+        SplitFlapLog::flush();
         while (1) {
             delay(1000);
         }
     }
 
-    Serial.println("mDNS: http://" + settings.getString("mdns") + ".local");
+    LOG_INFO("mDNS: http://%s.local", settings.getString("mdns").c_str());
 }
 
 void SplitFlapWebServer::startWebServer() {
+    TRACE_SCOPE("webServer.start");
     server.on("/", HTTP_GET, [this](AsyncWebServerRequest *request) { request->redirect("/index.html"); });
 
-    File root = LittleFS.open("/");
-    if (! root || ! root.isDirectory()) {
-        Serial.println("Failed to open directory or not a directory");
-        return;
-    }
+    // One handler for the whole interface, driven by the manifest the filesystem build writes. A filesystem image
+    // from before the manifest gets a serveStatic per .gz file as it always did.
+    if (assets.load(LittleFS)) {
+        server.addHandler(&assets);
+    } else {
+        File root = LittleFS.open("/");
+        if (! root || ! root.isDirectory()) {
+            LOG_ERROR("Failed to open directory or not a directory");
+            return;
+        }
 
-    File file = root.openNextFile();
-    while (file) {
-        if (String(file.name()).endsWith(".gz")) {
-            const char *filename = file.name();
-            String tempFilename = (String("/") + String(filename));
-            tempFilename.replace(".gz", "");
-            filename = tempFilename.c_str();
+        File file = root.openNextFile();
+        while (file) {
+            if (String(file.name()).endsWith(".gz")) {
+                const char *filename = file.name();
+                String tempFilename = (String("/") + String(filename));
+                tempFilename.replace(".gz", "");
+                filename = tempFilename.c_str();
 
-            server.serveStatic(filename, LittleFS, filename, "max-age=600");
+                server.serveStatic(filename, LittleFS, filename, "max-age=600");
+            }
+            file = root.openNextFile();
         }
-        file = root.openNextFile();
     }
 
     server.on("/settings", HTTP_GET, [this](AsyncWebServerRequest *request) {
@@ -395,8 +435,8 @@ void SplitFlapWebServer::startWebServer() {
             return request->send(405, "application/json", "{\"error\":\"Method Not Allowed\"}");
         }
 
-        Serial.println("Received settings update request");
-        Serial.println(json.as<String>());
+        LOG_INFO("Received settings update request");
+        LOG_DEBUG("%s", json.as<String>().c_str());
 
         bool rebootRequired = false;
         bool reconnect = false;
@@ -421,6 +461,43 @@ void SplitFlapWebServer::startWebServer() {
             response["message"] = "Settings updated successfully, Module count has changed. Rebooting...";
         }
 
+        if (json["i2cClock"].is<int>() && json["i2cClock"].as<int>() != settings.getInt("i2cClock")) {
+            rebootRequired = true; // The bus clock is checked against every module at startup
+            response["message"] = "Settings updated successfully, I2C clock has changed. Rebooting...";
+        }
+
+        if (json["hallIntPin"].is<int>() && json["hallIntPin"].as<int>() != settings.getInt("hallIntPin")) {
+            rebootRequired = true; // The interrupt is attached when the display starts
+            response["message"] = "Settings updated successfully, Hall INT pin has changed. Rebooting...";
+        }
+
+        if ((json["sda2Pin"].is<int>() && json["sda2Pin"].as<int>() != settings.getInt("sda2Pin")) ||
+            (json["scl2Pin"].is<int>() && json["scl2Pin"].as<int>() != settings.getInt("scl2Pin")) ||
+            (json["moduleBuses"].is<String>() &&
+             json["moduleBuses"].as<String>() != settings.getString("moduleBuses"))) {
+            rebootRequired = true; // Modules are given to a controller, and the second one started, at startup
+            response["message"] = "Settings updated successfully, I2C buses have changed. Rebooting...";
+        }
+
+        if ((json["clusterRole"].is<int>() && json["clusterRole"].as<int>() != settings.getInt("clusterRole")) ||
+            (json["clusterSlot"].is<int>() && json["clusterSlot"].as<int>() != settings.getInt("clusterSlot")) ||
+            (json["clusterPort"].is<int>() && json["clusterPort"].as<int>() != settings.getInt("clusterPort")) ||
+            (json["clusterLeader"].is<String>() &&
+             json["clusterLeader"].as<String>() != settings.getString("clusterLeader"))) {
+            rebootRequired = true; // The cluster joins, or starts listening, once at startup
+            response["message"] = "Settings updated successfully, cluster settings have changed. Rebooting...";
+        }
+
+        if (json["charset"].is<int>() && json["charset"].as<int>() != settings.getInt("charset")) {
+            rebootRequired = true; // Every module is set up with the character set of its drum at startup
+            response["message"] = "Settings updated successfully, character set has changed. Rebooting...";
+        }
+
+        if (json["stepMode"].is<int>() && json["stepMode"].as<int>() != settings.getInt("stepMode")) {
+            rebootRequired = true; // Positions are counted in the steps of the step mode, re-home with the new one
+            response["message"] = "Settings updated successfully, Step mode has changed. Rebooting...";
+        }
+
         if (json["mdns"].is<String>() && json["mdns"].as<String>() != settings.getString("mdns")) {
             reconnect = true;
             response["message"] =
@@ -440,10 +517,17 @@ void SplitFlapWebServer::startWebServer() {
 
         // Check if offset settings are being updated
         bool offsetsChanged = false;
-        if (json["moduleOffsets"].is<const char*>() || json["displayOffset"].is<int>()) {
+        if (json["moduleOffsets"].is<const char*>() || json["magnetCorrections"].is<const char*>() ||
+            json["displayOffset"].is<int>()) {
             offsetsChanged = true;
         }
 
+        bool holdTimeChanged = json["holdTime"].is<int>() && json["holdTime"].as<int>() != settings.getInt("holdTime");
+        bool hallWindowChanged =
+            json["hallWindow"].is<int>() && json["hallWindow"].as<int>() != settings.getInt("hallWindow");
+        bool driftCorrectionChanged = json["driftCorrection"].is<int>() &&
+                                      json["driftCorrection"].as<int>() != settings.getInt("driftCorrection");
+
         if (! settings.fromJson(json)) {
             response["message"] = "Failed to save settings";
             response["type"] = "error";
@@ -458,6 +542,18 @@ void SplitFlapWebServer::startWebServer() {
             response["message"] = "Settings saved and offsets updated successfully!";
         }
 
+        if (holdTimeChanged && this->display != nullptr) {
+            this->display->setHoldTime(settings.getInt("holdTime"));
+        }
+
+        if (hallWindowChanged && this->display != nullptr) {
+            this->display->setHallWindow(settings.getInt("hallWindow"));
+        }
+
+        if (driftCorrectionChanged && this->display != nullptr) {
+            this->display->setDriftCorrection(settings.getInt("driftCorrection") != 0);
+        }
+
         response["type"] = "success";
         response["persistent"] = reconnect;
 
@@ -474,8 +570,8 @@ void SplitFlapWebServer::startWebServer() {
             return request->send(405, "application/json", "{\"error\":\"Method Not Allowed\"}");
         }
 
-        Serial.println("Received text update request");
-        Serial.println(json.as<String>());
+        LOG_INFO("Received text update request");
+        LOG_DEBUG("%s", json.as<String>().c_str());
 
         // {"mode":"single","words":["adfasdf"],"delay":1,"center":false}
         // {"mode":"multiple","words":["asdf","asdfasdf","fffff"],"delay":"14","center":true}
@@ -504,14 +600,14 @@ void SplitFlapWebServer::startWebServer() {
         }
 
         this->setMultiDelay(delay * 1000);
-        Serial.println("Delay: " + String(this->getMultiWordDelay()));
+        LOG_INFO("Delay: %d", (int) this->getMultiWordDelay());
 
         centering = json["center"].as<bool>() ? 1 : 0;
-        Serial.println("centering: " + String(centering ? "true" : "false"));
+        LOG_INFO("centering: %s", centering ? "true" : "false");
 
         if (json["mode"] == "single") {
             String word = decodeURIComponent(json["words"][0].as<String>());
-            Serial.println("Single Word: " + word);
+            LOG_INFO("Single Word: %s", word.c_str());
 
             // Check for #home command in mode 6
             if (settings.getInt("mode") == 6 && word == "#home") {
@@ -535,8 +631,8 @@ void SplitFlapWebServer::startWebServer() {
 
             this->setMultiInputString(words);
             this->numMultiWords = wordsArray.size();
-            Serial.println("Multiple Words: " + words);
-            Serial.println("Number of Words: " + String(this->numMultiWords));
+            LOG_INFO("Multiple Words: %s", words.c_str());
+            LOG_INFO("Number of Words: %d", (int) this->numMultiWords);
 
             this->setMode(1);
         }
@@ -547,107 +643,301 @@ void SplitFlapWebServer::startWebServer() {
         request->send(200, "application/json", response.as<String>());
     }));
 
-    // Test individual module endpoint - using explicit paths for each module
-    for (int i = 0; i < 8; i++) {
-        String testPath = "/api/module/" + String(i) + "/test";
-        server.on(testPath.c_str(), HTTP_POST, [this, i](AsyncWebServerRequest *request) {
-            JsonDocument response;
+    // Module endpoints, /api/module/{index}/test and /api/module/{index}/offset for any number of modules. The offset
+    // carries a JSON body, so its handler goes first and takes the JSON requests, the other one the rest.
+    server.addHandler(new AsyncCallbackJsonWebHandler(
+        "/api/module",
+        [this](AsyncWebServerRequest *request, JsonVariant &json) {
+        if (request->method() != HTTP_POST) {
+            return request->send(405, "application/json", "{\"error\":\"Method Not Allowed\"}");
+        }
+        handleModuleRequest(request, &json);
+    }
+    ));
 
-            if (this->display == nullptr) {
-                response["message"] = "Display not initialized";
-                response["type"] = "error";
-                return request->send(500, "application/json", response.as<String>());
-            }
+    server.on("/api/module/*", HTTP_POST, [this](AsyncWebServerRequest *request) {
+        handleModuleRequest(request, nullptr);
+    });
+
+    // I2C connectivity test endpoint
+    server.on("/api/i2c/test", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
+
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
 
-            if (i >= this->display->getNumModules()) {
-                response["message"] = "Invalid module ID";
-                response["type"] = "error";
-                return request->send(400, "application/json", response.as<String>());
+        JsonArray results = response["modules"].to<JsonArray>();
+        int numModules = this->display->getNumModules();
+        SplitFlapModule* modules = this->display->getModules();
+
+        for (int i = 0; i < numModules; i++) {
+            JsonObject module = results.add<JsonObject>();
+            module["index"] = i;
+            module["address"] = SplitFlapBus::getDeviceAddress(modules[i].getAddress());
+            if (SplitFlapBus::getChannel(modules[i].getAddress()) != BUS_MUX_NONE) {
+                module["channel"] = SplitFlapBus::getChannel(modules[i].getAddress());
             }
+            if (this->display->getNumBuses() > 1) {
+                module["bus"] = modules[i].getBus() == &this->display->getBus(1) ? 1 : 0;
+            }
+            module["connected"] = modules[i].testI2CConnectivity();
+        }
 
-            Serial.print("Testing module: ");
-            Serial.println(i);
+        response["message"] = "I2C connectivity test complete";
+        response["type"] = "success";
+        request->send(200, "application/json", response.as<String>());
+    });
 
-            // Update offsets before testing to apply any recent changes
-            this->display->updateOffsets();
+    // Motion engine state and how far step intervals have been off since boot
+    server.on("/api/plan", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
 
-            this->display->testModule(i);
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
 
-            response["message"] = "Module test complete";
-            response["type"] = "success";
-            request->send(200, "application/json", response.as<String>());
-        });
-    }
+        if (! request->hasParam("text")) {
+            response["message"] = "Missing text parameter";
+            response["type"] = "error";
+            return request->send(400, "application/json", response.as<String>());
+        }
 
-    // Update individual module offset endpoint - using explicit paths for each module
-    for (int i = 0; i < 8; i++) {
-        String offsetPath = "/api/module/" + String(i) + "/offset";
-        server.addHandler(new AsyncCallbackJsonWebHandler(
-            offsetPath.c_str(),
-            [this, i](AsyncWebServerRequest *request, JsonVariant &json) {
-            if (request->method() != HTTP_POST) {
-                return request->send(405, "application/json", "{\"error\":\"Method Not Allowed\"}");
-            }
+        // Same layout and speed as the single input mode would use, nothing moves
+        String text = request->getParam("text")->value();
+        bool center = request->hasParam("centering") ? request->getParam("centering")->value().toInt() != 0
+                                                     : centering != 0;
+        MotionPlan plan = this->display->planString(text, MAX_RPM, center);
+
+        response["text"] = text;
+        response["startMs"] = plan.startMs;
+        response["totalMs"] = plan.totalMs;
+        response["busyMs"] = plan.busyMs;
+        JsonArray modules = response["modules"].to<JsonArray>();
+        for (int i = 0; i < this->display->getNumModules(); i++) {
+            JsonObject module = modules.add<JsonObject>();
+            module["steps"] = plan.steps[i];
+            module["ms"] = plan.moduleMs[i];
+        }
 
-            JsonDocument response;
+        request->send(200, "application/json", response.as<String>());
+    });
 
-            if (this->display == nullptr) {
-                response["message"] = "Display not initialized";
-                response["type"] = "error";
-                return request->send(500, "application/json", response.as<String>());
-            }
+    server.on("/api/motion", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
 
-            if (i >= this->display->getNumModules()) {
-                response["message"] = "Invalid module ID";
-                response["type"] = "error";
-                return request->send(400, "application/json", response.as<String>());
-            }
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
+
+        const SplitFlapMotion &motion = this->display->getMotion();
+        response["busy"] = motion.isRunning();
+        response["task"] = motion.hasTask();
+        response["holdTime"] = motion.getHoldTime();
+
+        // Time budget since boot
+        MotionReport report = motion.getReport();
+        response["moves"] = report.moves;
+        response["warmStarts"] = report.warmStarts;
+        response["skippedWakeUps"] = report.skippedWakeUps;
+        const char *phaseNames[MOTION_PHASES] = {"idle", "wakeUp", "settle", "stepping", "release", "hold"};
+        JsonObject phaseMs = response["phaseMs"].to<JsonObject>();
+        for (int i = 0; i < MOTION_PHASES; i++) {
+            phaseMs[phaseNames[i]] = report.phaseMs[i];
+        }
 
-            if (!json["offset"].is<int>()) {
-                response["message"] = "Invalid offset value";
-                response["type"] = "error";
-                return request->send(400, "application/json", response.as<String>());
+        // Hall effect sensor reads, polled or started by the expanders' INT line
+        JsonObject hall = response["hall"].to<JsonObject>();
+        hall["interrupt"] = motion.hasHallInterrupt();
+        hall["window"] = motion.getHallWindow();
+        hall["passes"] = report.hallPasses;
+        hall["reads"] = report.hallReads;
+        hall["edges"] = report.hallEdges;
+        hall["latencyMaxUs"] = report.hallLatencyMaxUs;
+
+        // Coil power, estimated from how long each module has had a pattern written
+        int numModules = this->display->getNumModules();
+        SplitFlapModule *modules = this->display->getModules();
+        int energisedCoils = 0;
+        unsigned long coilMs = 0;
+        for (int i = 0; i < numModules; i++) {
+            energisedCoils += modules[i].getEnergisedCoils();
+            coilMs += modules[i].getCoilMs();
+        }
+        response["coilPowerMw"] = energisedCoils * COIL_POWER_MW;
+        response["coilEnergyJ"] = coilMs / 1000.0 * COIL_POWER_MW / 1000.0;
+
+        JsonObject jitter = response["stepJitter"].to<JsonObject>();
+        JsonArray buckets = jitter["bucketsUs"].to<JsonArray>();
+        JsonArray counts = jitter["counts"].to<JsonArray>();
+        const unsigned long *stepJitter = motion.getStepJitter();
+        for (int i = 0; i < STEP_JITTER_BUCKETS; i++) {
+            // last bucket is open ended
+            if (i < STEP_JITTER_BUCKETS - 1) {
+                buckets.add(SplitFlapMotion::StepJitterBucketsUs[i]);
             }
+            counts.add(stepJitter[i]);
+        }
+
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // I2C traffic, since boot and over the last second
+    server.on("/api/bus", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
+
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
 
-            int offset = json["offset"].as<int>();
+        // Wire at the top level, Wire1 in the same shape under secondBus when modules are on it
+        auto fillBus = [](SplitFlapBus &bus, JsonObject out) {
+            out["clock"] = bus.getClock();
+
+            const SplitFlapBusStats &totals = bus.getStats();
+            JsonObject total = out["total"].to<JsonObject>();
+            total["transactions"] = totals.transactions;
+            total["writes"] = totals.writes;
+            total["droppedWrites"] = totals.droppedWrites;
+            total["reads"] = totals.reads;
+            total["errors"] = totals.errors;
+            total["busyMs"] = totals.busyUs / 1000;
+            total["muxSelects"] = totals.muxSelects;
+
+            SplitFlapBusStats window = bus.getWindowStats();
+            unsigned long windowUs = bus.getWindowUs();
+            out["transactionsPerSecond"] = windowUs ? window.transactions * 1000000.0 / windowUs : 0;
+            out["utilisation"] = windowUs ? (float) window.busyUs / windowUs : 0;
+        };
+
+        fillBus(this->display->getBus(0), response.to<JsonObject>());
+        if (this->display->getNumBuses() > 1) {
+            fillBus(this->display->getBus(1), response["secondBus"].to<JsonObject>());
+        }
 
-            Serial.print("Setting module ");
-            Serial.print(i);
-            Serial.print(" offset to: ");
-            Serial.println(offset);
+        request->send(200, "application/json", response.as<String>());
+    });
 
-            // Get current offsets
-            std::vector<int> offsets = settings.getIntVector("moduleOffsets");
+    // How far each module's step count was off at its magnet, in full steps
+    server.on("/api/drift", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
 
-            // Update the specific module offset
-            if (i < offsets.size()) {
-                offsets[i] = offset;
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
+
+        float microsteps = SplitFlapModule::getMicrosteps(settings.getInt("stepMode"));
+        response["correction"] = settings.getInt("driftCorrection") != 0;
+        response["dropped"] = this->display->getDriftDropped();
+        JsonArray modules = response["modules"].to<JsonArray>();
+        for (const ModuleDrift &drift : this->display->getDrift()) {
+            JsonObject module = modules.add<JsonObject>();
+            module["crossings"] = drift.crossings;
+            module["missed"] = drift.missed;
+            module["last"] = drift.last / microsteps;
+            module["worst"] = drift.worst / microsteps;
+            module["stepsLost"] = drift.stepsLost / microsteps;
+            module["stepsGained"] = drift.stepsGained / microsteps;
+            module["mean"] = drift.mean / microsteps;
+            module["deviation"] = drift.deviation / microsteps;
+            module["correction"] = drift.correction / microsteps;
+            module["trouble"] = drift.trouble;
+        }
+
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // Counters and histograms per module and for the display as a whole, as Prometheus text. Streamed in chunks, the
+    // text of a large board does not fit in memory at once.
+    server.on("/api/metrics", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        if (this->display == nullptr) {
+            return request->send(500, "text/plain", "Display not initialized");
+        }
+
+        std::shared_ptr<MetricsExporter> exporter = std::make_shared<MetricsExporter>(*this->display);
+        request->send(request->beginChunkedResponse(
+            "text/plain; version=0.0.4", [exporter](uint8_t *buffer, size_t maxLen, size_t index) {
+                return exporter->read(buffer, maxLen);
             }
+        ));
+    });
 
-            // Convert back to comma-separated string
-            String offsetStr = "";
-            for (size_t j = 0; j < offsets.size(); j++) {
-                offsetStr += String(offsets[j]);
-                if (j < offsets.size() - 1) {
-                    offsetStr += ",";
-                }
+    // What the asset handler serves and how the requests for it were answered
+    server.on("/api/assets", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        WebAssetStats stats = assets.getStats();
+        JsonDocument response;
+        response["ramBytes"] = assets.getRamBytes();
+        response["ramHits"] = stats.ramHits;
+        response["fileHits"] = stats.fileHits;
+        response["notModified"] = stats.notModified;
+
+        JsonArray list = response["assets"].to<JsonArray>();
+        for (const WebAsset &asset : assets.getAssets()) {
+            JsonObject entry = list.add<JsonObject>();
+            entry["path"] = asset.path;
+            entry["size"] = asset.size;
+            entry["cached"] = asset.cached >= 0;
+            entry["immutable"] = asset.immutable;
+            entry["hits"] = asset.hits;
+        }
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // Where the time went at boot and in the latest moves, as Chrome trace_event JSON for chrome://tracing or
+    // ui.perfetto.dev. Only there in builds with -D SPLITFLAP_TRACE.
+    server.on("/api/trace", HTTP_GET, [this](AsyncWebServerRequest *request) {
+#ifdef SPLITFLAP_TRACE
+        std::shared_ptr<TraceExporter> exporter = std::make_shared<TraceExporter>();
+        request->send(request->beginChunkedResponse(
+            "application/json", [exporter](uint8_t *buffer, size_t maxLen, size_t index) {
+                return exporter->read(buffer, maxLen);
             }
+        ));
+#else
+        JsonDocument response;
+        response["message"] = "Tracing is not built in, build with -D SPLITFLAP_TRACE";
+        response["type"] = "error";
+        request->send(404, "application/json", response.as<String>());
+#endif
+    });
 
-            // Save to settings
-            settings.putString("moduleOffsets", offsetStr.c_str());
+    // Scan every module's magnet and save offsets that centre them alike, runs from loop() for a drum revolution or so
+    // per pass
+    server.on("/api/calibrate", HTTP_POST, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
 
-            // Update display offsets dynamically
-            this->display->updateOffsets();
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
+        }
 
-            response["message"] = "Offset updated successfully";
-            response["type"] = "success";
-            request->send(200, "application/json", response.as<String>());
+        if (this->display->isCalibrating()) {
+            response["message"] = "Calibration already running";
+            response["type"] = "error";
+            return request->send(409, "application/json", response.as<String>());
         }
-        ));
-    }
 
-    // I2C connectivity test endpoint
-    server.on("/api/i2c/test", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        int passes = request->hasParam("passes") ? request->getParam("passes")->value().toInt() : CALIBRATION_PASSES;
+        this->display->requestCalibration(passes);
+
+        response["message"] = "Calibration started";
+        response["type"] = "success";
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // Whether it is still running and what the last run found, in full steps
+    server.on("/api/calibrate", HTTP_GET, [this](AsyncWebServerRequest *request) {
         JsonDocument response;
 
         if (this->display == nullptr) {
@@ -656,27 +946,119 @@ void SplitFlapWebServer::startWebServer() {
             return request->send(500, "application/json", response.as<String>());
         }
 
-        JsonArray results = response["modules"].to<JsonArray>();
-        int numModules = this->display->getNumModules();
-        SplitFlapModule* modules = this->display->getModules();
+        response["running"] = this->display->isCalibrating();
+        JsonArray modules = response["modules"].to<JsonArray>();
+        if (! this->display->isCalibrating()) { // the results are replaced at the end of a run
+            for (const ModuleCalibration &result : this->display->getCalibration()) {
+                JsonObject module = modules.add<JsonObject>();
+                module["passes"] = result.passes;
+                module["width"] = result.width;
+                module["spread"] = result.spread;
+                module["oldCorrection"] = result.oldCorrection;
+                module["correction"] = result.correction;
+                module["calibrated"] = result.calibrated;
+            }
+        }
 
-        for (int i = 0; i < numModules; i++) {
-            JsonObject module = results.add<JsonObject>();
-            module["index"] = i;
-            module["address"] = modules[i].getAddress();
-            module["connected"] = modules[i].testI2CConnectivity();
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // Settings writes to flash, and the ones the write-behind cache kept off it
+    server.on("/api/settings", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
+
+        JsonSettingsStats stats = settings.getStats();
+        response["updates"] = stats.updates;
+        response["avoidedWrites"] = stats.unchanged + stats.coalesced;
+        response["unchanged"] = stats.unchanged;
+        response["coalesced"] = stats.coalesced;
+        response["writes"] = stats.writes;
+        response["commits"] = stats.commits;
+        response["pending"] = settings.isDirty();
+
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    server.on("/api/queue", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
+
+        if (this->display == nullptr) {
+            response["message"] = "Display not initialized";
+            response["type"] = "error";
+            return request->send(500, "application/json", response.as<String>());
         }
 
-        response["message"] = "I2C connectivity test complete";
-        response["type"] = "success";
+        CommandQueueStats stats = this->display->getQueueStats();
+        response["depth"] = stats.depth;
+        response["maxDepth"] = stats.maxDepth;
+        response["capacity"] = COMMAND_QUEUE_LENGTH;
+        response["queued"] = stats.queued;
+        response["coalesced"] = stats.coalesced;
+        response["dropped"] = stats.dropped;
+        response["run"] = stats.run;
+        response["preempted"] = stats.preempted;
+
         request->send(200, "application/json", response.as<String>());
     });
 
+    // Role in a cluster of controllers, the members a leader knows about and how well they kept together
+    server.on("/api/cluster", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        JsonDocument response;
+
+        if (this->cluster == nullptr || this->cluster->getRole() == ClusterRole::Off) {
+            response["role"] = "off";
+            return request->send(200, "application/json", response.as<String>());
+        }
+
+        ClusterStats stats = this->cluster->getStats();
+        response["role"] = this->cluster->isLeader() ? "leader" : "member";
+        response["slot"] = settings.getInt("clusterSlot");
+        response["moves"] = stats.moves;
+        response["lastMove"] = stats.lastMove;
+        response["resends"] = stats.resends;
+        response["lateStarts"] = stats.lateStarts;
+
+        if (this->cluster->isLeader()) {
+            JsonArray members = response["members"].to<JsonArray>();
+            for (const ClusterMember &member : this->cluster->getMembers()) {
+                JsonObject entry = members.add<JsonObject>();
+                entry["slot"] = member.slot;
+                entry["ip"] = member.ip.toString();
+                entry["modules"] = member.modules;
+                entry["synced"] = member.synced;
+                entry["lastSeenMs"] = millis() - member.lastSeen;
+            }
+            response["participants"] = stats.participants;
+            response["reported"] = stats.reported;
+            response["startSpreadUs"] = stats.startSpreadUs;
+            response["finishSpreadUs"] = stats.finishSpreadUs;
+            response["maxStartSpreadUs"] = stats.maxStartSpreadUs;
+        } else {
+            response["synced"] = stats.synced;
+            response["offsetUs"] = stats.offsetUs;
+            response["rttUs"] = stats.rttUs;
+        }
+
+        request->send(200, "application/json", response.as<String>());
+    });
+
+    // Logged lines as server-sent events, from the time a client connects. The drain task sends them, so a slow
+    // client holds up the log rather than the code that logged.
+    server.addHandler(&logEvents);
+    SplitFlapLog::setSink(sendLog, this);
+
     server.onNotFound(fourOhFour);
 
     server.begin();
 }
 
+void SplitFlapWebServer::sendLog(const char *line, const LogMessage &message, void *arg) {
+    SplitFlapWebServer *webServer = static_cast<SplitFlapWebServer *>(arg);
+    if (webServer->logEvents.count() > 0) {
+        webServer->logEvents.send(line, "log", message.timeMs);
+    }
+}
+
 String SplitFlapWebServer::decodeURIComponent(String encodedString) {
     String decodedString = encodedString;
     // Replace common URL-encoded characters with their actual symbols
@@ -716,3 +1098,89 @@ String SplitFlapWebServer::decodeURIComponent(String encodedString) {
 
     return decodedString;
 }
+
+int SplitFlapWebServer::getModulePathIndex(const String &url, String &action) {
+    // /api/module/{index}/{action}
+    const char *prefix = "/api/module/";
+    if (! url.startsWith(prefix)) {
+        return -1;
+    }
+    int indexStart = strlen(prefix);
+    int indexEnd = url.indexOf('/', indexStart);
+    if (indexEnd <= indexStart) {
+        return -1;
+    }
+    for (int i = indexStart; i < indexEnd; i++) {
+        if (! isDigit(url[i])) {
+            return -1;
+        }
+    }
+    action = url.substring(indexEnd + 1);
+    return url.substring(indexStart, indexEnd).toInt();
+}
+
+void SplitFlapWebServer::handleModuleRequest(AsyncWebServerRequest *request, JsonVariant *json) {
+    JsonDocument response;
+
+    String action;
+    int i = getModulePathIndex(request->url(), action);
+    if (i < 0 || (action != "test" && action != "offset")) {
+        response["message"] = "Not found";
+        response["type"] = "error";
+        return request->send(404, "application/json", response.as<String>());
+    }
+
+    if (this->display == nullptr) {
+        response["message"] = "Display not initialized";
+        response["type"] = "error";
+        return request->send(500, "application/json", response.as<String>());
+    }
+
+    if (i >= this->display->getNumModules()) {
+        response["message"] = "Invalid module ID";
+        response["type"] = "error";
+        return request->send(400, "application/json", response.as<String>());
+    }
+
+    if (action == "test") {
+        LOG_INFO("Testing module: %d", i);
+
+        // Update offsets before testing to apply any recent changes
+        this->display->updateOffsets();
+
+        this->display->requestModuleTest(i); // runs from loop(), the move takes several seconds
+
+        response["message"] = "Module test started";
+        response["type"] = "success";
+        return request->send(200, "application/json", response.as<String>());
+    }
+
+    if (json == nullptr || ! (*json)["offset"].is<int>()) {
+        response["message"] = "Invalid offset value";
+        response["type"] = "error";
+        return request->send(400, "application/json", response.as<String>());
+    }
+
+    int offset = (*json)["offset"].as<int>();
+
+    LOG_INFO("Setting module %d offset to: %d", i, offset);
+
+    // Get current offsets, modules past the end of the list have none yet
+    std::vector<int> offsets = settings.getIntVector("moduleOffsets");
+    if ((int) offsets.size() <= i) {
+        offsets.resize(i + 1, 0);
+    }
+
+    // Update the specific module offset
+    offsets[i] = offset;
+
+    // Save to settings, written to flash once the calibration clicks stop
+    settings.putIntVector("moduleOffsets", offsets);
+
+    // Update display offsets dynamically
+    this->display->updateOffsets();
+
+    response["message"] = "Offset updated successfully";
+    response["type"] = "success";
+    request->send(200, "application/json", response.as<String>());
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "JsonSettings.h"
+#include "SplitFlapAssets.h"
+#include "SplitFlapLog.h"
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
@@ -9,8 +11,10 @@
 #include <ESPmDNS.h>
 #include <LittleFS.h>
 #include <WiFi.h>
+#include <mutex>
 #include <time.h>
 
+class SplitFlapCluster;
 class SplitFlapDisplay; // Forward declaration
 
 class SplitFlapWebServer {
@@ -18,6 +22,7 @@ class SplitFlapWebServer {
     SplitFlapWebServer(JsonSettings &settings);
     void init();
     void setTimezone();
+    void loadCharset(); // custom drum from CHARSET_FILE, if there is one
     void checkRebootRequired();
 
     // Wifi Connectivity
@@ -40,12 +45,25 @@ class SplitFlapWebServer {
     int getMode();
 
     // Mode 0 - Single String
-    String getInputString() const { return inputString; }
-    String getWrittenString() const { return writtenString; }
-    void setWrittenString(String input) { writtenString = input; }
+    // The inputs are set by web and MQTT callbacks and read by loop(), stringLock keeps them whole
+    String getInputString() const {
+        std::lock_guard<std::mutex> guard(stringLock);
+        return inputString;
+    }
+    String getWrittenString() const {
+        std::lock_guard<std::mutex> guard(stringLock);
+        return writtenString;
+    }
+    void setWrittenString(String input) {
+        std::lock_guard<std::mutex> guard(stringLock);
+        writtenString = input;
+    }
 
     // Mode 1, Multi Input
-    String getMultiInputString() const { return multiInputString; }
+    String getMultiInputString() const {
+        std::lock_guard<std::mutex> guard(stringLock);
+        return multiInputString;
+    }
     int getMultiWordDelay() const { return multiWordDelay; }
     unsigned long getLastSwitchMultiTime() { return lastSwitchMultiTime; }
     void setLastSwitchMultiTime(unsigned long input) { lastSwitchMultiTime = input; }
@@ -67,13 +85,23 @@ class SplitFlapWebServer {
     int getCentering() { return centering; }
     
     void setDisplay(SplitFlapDisplay *displayPtr) { display = displayPtr; }
-    void setInputString(String input) { inputString = input; }  // Made public for mode 6
+    void setCluster(SplitFlapCluster *clusterPtr) { cluster = clusterPtr; }
+    void setInputString(String input) {  // Made public for mode 6
+        std::lock_guard<std::mutex> guard(stringLock);
+        inputString = input;
+    }
 
   private:
     JsonSettings &settings;
 
     String decodeURIComponent(String encodedString);
-    void setMultiInputString(String input) { multiInputString = input; }
+    static int getModulePathIndex(const String &url, String &action); // -1 unless url is /api/module/{index}/...
+    void handleModuleRequest(AsyncWebServerRequest *request, JsonVariant *json); // json is null without a body
+    static void sendLog(const char *line, const LogMessage &message, void *arg); // log sink, on the drain task
+    void setMultiInputString(String input) {
+        std::lock_guard<std::mutex> guard(stringLock);
+        multiInputString = input;
+    }
 
     void setMode(int targetMode);
     void setMultiDelay(int input) { multiWordDelay = input; }
@@ -88,6 +116,7 @@ class SplitFlapWebServer {
     unsigned long lastSwitchMultiTime;
     int multiWordDelay;
     int multiWordCurrentIndex;
+    mutable std::mutex stringLock;
     String multiInputString; // latest multi input from user
 
     String inputString;      // latest single input from user
@@ -105,5 +134,8 @@ class SplitFlapWebServer {
     bool isReconnecting = false;
 
     AsyncWebServer server; // Declare server as a class member
+    AsyncEventSource logEvents; // /api/logs, every logged line from the time a client connects
+    SplitFlapAssets assets;     // the web interface, empty when the filesystem has no manifest
     SplitFlapDisplay *display = nullptr; // Pointer to display for offset updates
+    SplitFlapCluster *cluster = nullptr; // for /api/cluster, set once WiFi is up
 };
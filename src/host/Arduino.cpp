@@ -0,0 +1,209 @@
+#include "Arduino.h"
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <thread>
+
+HardwareSerial Serial;
+
+static uint64_t clockUs = 0;
+static uint32_t microsCostUs = 1;
+static uint64_t concurrentStartUs = 0; // caller's time when the concurrent work started
+static uint64_t concurrentEndUs = 0;   // when the concurrent work finished, 0 when there is none
+static std::mt19937 rng(1);
+static bool realTime = false;
+static uint64_t realTimeBaseUs = 0; // clock when real time started
+static std::chrono::steady_clock::time_point realTimeStart;
+
+struct PinInterrupt
+{
+    void (*handler)(void *);
+    void *arg;
+    int mode;
+};
+
+static std::map<uint8_t, int> pinLevels;          // inputs read HIGH until the simulated hardware pulls them low
+static std::map<uint8_t, PinInterrupt> interrupts;
+
+// In real time the clock never falls behind the wall clock, and time the firmware spends waiting or on the bus is
+// slept through
+static void keepUp(bool wait) {
+    if (! realTime) {
+        return;
+    }
+    auto realUs = [] {
+        return realTimeBaseUs + std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - realTimeStart
+                                ).count();
+    };
+    uint64_t real = realUs();
+    if (wait && clockUs > real) {
+        std::this_thread::sleep_for(std::chrono::microseconds(clockUs - real));
+        real = realUs();
+    }
+    clockUs = std::max(clockUs, real);
+}
+
+uint64_t host::nowUs() {
+    keepUp(false);
+    return clockUs;
+}
+
+void host::advanceUs(uint64_t us) {
+    clockUs += us;
+    keepUp(true);
+}
+
+void host::setRealTime(bool enabled) {
+    realTime = enabled;
+    realTimeBaseUs = clockUs;
+    realTimeStart = std::chrono::steady_clock::now();
+}
+
+void host::setMicrosCost(uint32_t us) {
+    microsCostUs = us;
+}
+
+void host::beginConcurrent() {
+    concurrentStartUs = clockUs;
+}
+
+void host::endConcurrent() {
+    concurrentEndUs = std::max(concurrentEndUs, clockUs);
+    clockUs = concurrentStartUs;
+}
+
+void host::joinConcurrent() {
+    clockUs = std::max(clockUs, concurrentEndUs);
+    concurrentEndUs = 0;
+}
+
+void host::setPinLevel(uint8_t pin, int level) {
+    int previous = digitalRead(pin);
+    pinLevels[pin] = level;
+
+    auto it = interrupts.find(pin);
+    if (it == interrupts.end() || level == previous) {
+        return;
+    }
+    int edge = level == HIGH ? RISING : FALLING;
+    if (it->second.mode & edge) {
+        it->second.handler(it->second.arg);
+    }
+}
+
+unsigned long micros() {
+    clockUs += microsCostUs;
+    keepUp(false);
+    return (unsigned long) clockUs;
+}
+
+unsigned long millis() {
+    keepUp(false);
+    return (unsigned long) (clockUs / 1000);
+}
+
+void delay(unsigned long ms) {
+    clockUs += (uint64_t) ms * 1000;
+    keepUp(true);
+}
+
+void delayMicroseconds(unsigned int us) {
+    clockUs += us;
+    keepUp(true);
+}
+
+void yield() {
+    clockUs += 1;
+    keepUp(true);
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+int digitalRead(uint8_t pin) {
+    auto it = pinLevels.find(pin);
+    return it == pinLevels.end() ? HIGH : it->second;
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode) {
+    interrupts[pin] = PinInterrupt{handler, arg, mode};
+}
+
+void detachInterrupt(uint8_t pin) {
+    interrupts.erase(pin);
+}
+
+long random(long max) {
+    return random(0, max);
+}
+
+long random(long min, long max) {
+    if (max <= min) {
+        return min;
+    }
+    return min + (long) (rng() % (unsigned long) (max - min));
+}
+
+void randomSeed(unsigned long seed) {
+    rng.seed(seed);
+}
+
+size_t HardwareSerial::print(char c) {
+    char str[2] = {c, 0};
+    return write(str);
+}
+
+size_t HardwareSerial::printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    write(buf);
+    return len < 0 ? 0 : (size_t) len;
+}
+
+size_t HardwareSerial::write(const char *str) {
+    if (quiet) {
+        return strlen(str);
+    }
+    return fputs(str, stdout) < 0 ? 0 : strlen(str);
+}
+
+bool String::equalsIgnoreCase(const String &other) const {
+    if (length() != other.length()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < length(); i++) {
+        if (tolower((unsigned char) value[i]) != tolower((unsigned char) other.value[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void String::replace(const String &find, const String &replacement) {
+    if (find.value.empty()) {
+        return;
+    }
+    std::string::size_type pos = 0;
+    while ((pos = value.find(find.value, pos)) != std::string::npos) {
+        value.replace(pos, find.value.length(), replacement.value);
+        pos += replacement.value.length();
+    }
+}
+
+void String::trim() {
+    std::string::size_type begin = value.find_first_not_of(" \t\r\n");
+    std::string::size_type end = value.find_last_not_of(" \t\r\n");
+    value = begin == std::string::npos ? "" : value.substr(begin, end - begin + 1);
+}
+
+void String::toUpperCase() {
+    for (char &c : value) c = toupper((unsigned char) c);
+}
+
+void String::toLowerCase() {
+    for (char &c : value) c = tolower((unsigned char) c);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// Arduino core replacement for the native (host) build.
+//
+// Time is virtual: micros()/millis() read a simulated clock that only moves forward when the firmware waits
+// (delay, yield, polling micros) or talks to the simulated I2C bus. This keeps host runs deterministic and lets
+// move timings be measured without real hardware. Host builds talking to each other over the network switch to real
+// time with host::setRealTime(), the clock then keeps up with the wall clock and waiting sleeps.
+
+#include "WString.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x01
+#define OUTPUT       0x03
+#define INPUT_PULLUP 0x05
+
+#define RISING  0x01
+#define FALLING 0x02
+#define CHANGE  0x03
+
+#define IRAM_ATTR
+
+#define digitalPinToInterrupt(pin) (pin)
+
+namespace host {
+uint64_t nowUs();                // current virtual time in microseconds
+void advanceUs(uint64_t us);     // move virtual time forward
+void setMicrosCost(uint32_t us); // virtual time consumed by every micros() call, so polling loops progress
+void setPinLevel(uint8_t pin, int level); // drive an input from the simulated hardware, runs attached interrupts
+void beginConcurrent(); // what runs until endConcurrent() happens alongside the caller, as on another controller
+void endConcurrent();   // back to the caller's time, the concurrent work is not charged to it
+void joinConcurrent();  // wait for the concurrent work, the clock moves on to whichever finished last
+void setRealTime(bool enabled); // from now on the clock runs no slower than the wall clock
+} // namespace host
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode);
+void detachInterrupt(uint8_t pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+template <typename T, typename L, typename H>
+inline T constrain(T value, L low, H high) {
+    return value < low ? (T) low : (value > high ? (T) high : value);
+}
+
+using std::max;
+using std::min;
+
+class HardwareSerial {
+  public:
+    void begin(unsigned long) {}
+    void setQuiet(bool quiet) { this->quiet = quiet; } // host only, silences firmware output
+
+    size_t print(const String &str) { return write(str.c_str()); }
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c);
+    size_t print(int number) { return print(String(number)); }
+    size_t print(unsigned int number) { return print(String(number)); }
+    size_t print(long number) { return print(String(number)); }
+    size_t print(unsigned long number) { return print(String(number)); }
+    size_t print(double number) { return print(String(number)); }
+
+    size_t println() { return write("\n"); }
+    template <typename T>
+    size_t println(T value) {
+        return print(value) + println();
+    }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  private:
+    bool quiet = false;
+
+    size_t write(const char *str);
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,10 @@
+#include "SplitFlapMqtt.h"
+
+// The host build has no broker, so the display always sees MQTT as disconnected
+
+bool SplitFlapMqtt::isConnected() {
+    return false;
+}
+
+void SplitFlapMqtt::publishState(const String &) {}
+void SplitFlapMqtt::publishEta(const String &, unsigned long) {}
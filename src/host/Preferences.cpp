@@ -0,0 +1,96 @@
+#include "Preferences.h"
+
+PreferencesStats Preferences::stats;
+
+bool Preferences::begin(const char *name, bool readOnly, const char *) {
+    ns = name;
+    opened = true;
+    this->readOnly = readOnly;
+    stats.opens++;
+    host::advanceUs(NVS_OPEN_COST_US);
+    return true;
+}
+
+void Preferences::end() {
+    opened = false;
+}
+
+bool Preferences::clear() {
+    if (! opened || readOnly) {
+        return false;
+    }
+    entries().clear();
+    stats.writes++;
+    host::advanceUs(NVS_WRITE_COST_US);
+    return true;
+}
+
+bool Preferences::remove(const char *key) {
+    if (! opened || readOnly) {
+        return false;
+    }
+    stats.writes++;
+    host::advanceUs(NVS_WRITE_COST_US);
+    return entries().erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+    return opened && entries().count(key) > 0;
+}
+
+int Preferences::getInt(const char *key, int defaultValue) {
+    const Entry *entry = find(key, 'i');
+    return entry ? entry->intValue : defaultValue;
+}
+
+float Preferences::getFloat(const char *key, float defaultValue) {
+    const Entry *entry = find(key, 'f');
+    return entry ? entry->floatValue : defaultValue;
+}
+
+String Preferences::getString(const char *key, String defaultValue) {
+    const Entry *entry = find(key, 's');
+    return entry ? entry->strValue : defaultValue;
+}
+
+size_t Preferences::putInt(const char *key, int value) {
+    return put(key, Entry{'i', value, 0, String()}) ? sizeof(value) : 0;
+}
+
+size_t Preferences::putFloat(const char *key, float value) {
+    return put(key, Entry{'f', 0, value, String()}) ? sizeof(value) : 0;
+}
+
+size_t Preferences::putString(const char *key, const char *value) {
+    return put(key, Entry{'s', 0, 0, String(value)}) ? strlen(value) : 0;
+}
+
+std::map<String, Preferences::Entry> &Preferences::entries() {
+    static std::map<String, std::map<String, Entry>> storage; // namespace -> key -> value
+    return storage[ns];
+}
+
+const Preferences::Entry *Preferences::find(const char *key, char type) {
+    if (! opened) {
+        return nullptr;
+    }
+    stats.reads++;
+    host::advanceUs(NVS_READ_COST_US);
+
+    auto it = entries().find(key);
+    if (it == entries().end() || it->second.type != type) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+size_t Preferences::put(const char *key, const Entry &entry) {
+    if (! opened || readOnly) {
+        return 0;
+    }
+    stats.writes++;
+    host::advanceUs(NVS_WRITE_COST_US);
+
+    entries()[key] = entry;
+    return 1;
+}
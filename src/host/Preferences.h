@@ -0,0 +1,60 @@
+#pragma once
+
+// Preferences (NVS) replacement for the native (host) build.
+//
+// Values live in memory for the lifetime of the process. Each call advances the virtual clock by a rough estimate of
+// what the same NVS operation costs on an ESP32 so settings access shows up in host timings.
+
+#include <Arduino.h>
+#include <map>
+
+#define NVS_OPEN_COST_US  80   // nvs_open + nvs_close
+#define NVS_READ_COST_US  30   // nvs_get_* lookup
+#define NVS_WRITE_COST_US 2000 // nvs_set_* + nvs_commit, includes the flash write
+
+struct PreferencesStats
+{
+    unsigned long opens = 0;
+    unsigned long reads = 0;
+    unsigned long writes = 0;
+};
+
+class Preferences {
+  public:
+    bool begin(const char *name, bool readOnly = false, const char *partition = nullptr);
+    void end();
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+
+    int getInt(const char *key, int defaultValue = 0);
+    float getFloat(const char *key, float defaultValue = NAN);
+    String getString(const char *key, String defaultValue = String());
+
+    size_t putInt(const char *key, int value);
+    size_t putFloat(const char *key, float value);
+    size_t putString(const char *key, const char *value);
+    size_t putString(const char *key, String value) { return putString(key, value.c_str()); }
+
+    static const PreferencesStats &getStats() { return stats; } // host only, counts across all instances
+    static void resetStats() { stats = PreferencesStats(); }
+
+  private:
+    struct Entry
+    {
+        char type; // 'i', 'f' or 's'
+        int intValue;
+        float floatValue;
+        String strValue;
+    };
+
+    String ns;
+    bool opened = false;
+    bool readOnly = true;
+
+    static PreferencesStats stats;
+
+    std::map<String, Entry> &entries();
+    const Entry *find(const char *key, char type);
+    size_t put(const char *key, const Entry &entry);
+};
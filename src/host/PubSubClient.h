@@ -0,0 +1,15 @@
+#pragma once
+
+// PubSubClient stand-in for the native (host) build. The host build never connects to a broker, it only needs the
+// type so SplitFlapMqtt.h can be included by the display.
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+class PubSubClient {
+  public:
+    PubSubClient(WiFiClient &) {}
+
+    bool connected() { return false; }
+    bool publish(const char *, const char *, bool = false) { return false; }
+};
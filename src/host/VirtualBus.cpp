@@ -0,0 +1,161 @@
+#include "VirtualBus.h"
+
+// Electrical phase (in half steps) for each combination of the coil bits 1-4, -1 when the combination does not hold
+// the rotor. Matches STEPPER_PATTERN_0..3 at phases 0, 2, 4 and 6.
+static const int8_t CoilPhases[16] = {-1, 1, 7, 0, 5, -1, 6, -1, 3, 2, -1, -1, 4, -1, -1, -1};
+
+void VirtualDrum::energise(uint16_t outputs) {
+    int field = CoilPhases[(outputs >> 1) & 0x0F];
+    if (field < 0) {
+        return; // coils released, the rotor stays in its detent
+    }
+
+    // The rotor follows the field the short way round, a half turn of the field is ambiguous and leaves it in place
+    int delta = (field - phase + 8) % 8;
+    if (delta == 0 || delta == 4) {
+        return;
+    }
+    int move = delta < 4 ? delta : delta - 8;
+    phase = field;
+    if (slipPermille > 0 && random(1000) < slipPermille) {
+        return; // the rotor turned and the drum did not, a lost step
+    }
+
+    position = (position + move + halfStepsPerRot) % halfStepsPerRot;
+    halfStepsMoved += abs(move);
+}
+
+uint16_t VirtualPcf8575::readInputs() const {
+    uint16_t inputs = latch;
+    if (latch & (1 << 15)) {
+        inputs = drum.magnetPresent() ? (inputs | (1 << 15)) : (inputs & ~(1 << 15));
+    }
+    return inputs;
+}
+
+VirtualPcf8575 &VirtualBus::addDevice(int address, int stepsPerRot, int startPosition) {
+    VirtualPcf8575 &device = deviceMap[address];
+    device.drum.halfStepsPerRot = stepsPerRot * 2;
+    device.drum.position = ((startPosition * 2) % device.drum.halfStepsPerRot + device.drum.halfStepsPerRot) %
+        device.drum.halfStepsPerRot;
+    device.drum.phase = device.drum.position % 8;
+    return device;
+}
+
+VirtualPcf8575 *VirtualBus::device(int address) {
+    auto it = deviceMap.find(address);
+    return it == deviceMap.end() ? nullptr : &it->second;
+}
+
+VirtualPcf8575 *VirtualBus::respond(uint8_t address, bool &collision) {
+    VirtualPcf8575 *found = device(address);
+    collision = false;
+    for (int channel = 0; channel < 8; channel++) {
+        VirtualPcf8575 *behind = (muxChannels & (1 << channel)) ? device(1000 + channel * 100 + address) : nullptr;
+        if (behind != nullptr) {
+            collision = collision || found != nullptr;
+            found = behind;
+        }
+    }
+    return found;
+}
+
+uint8_t VirtualBus::write(uint8_t address, const uint8_t *data, size_t length) {
+    if (address == muxAddress) {
+        transfer(length);
+        muxChannels = length > 0 ? data[length - 1] : muxChannels;
+        return 0;
+    }
+
+    bool collision;
+    VirtualPcf8575 *target = respond(address, collision);
+    transfer(target ? length : 0);
+    if (! target) {
+        stats.nacks++;
+        return 2; // NACK on transmit of address
+    }
+    if (collision) {
+        stats.collisions++;
+        return 4; // other error, two devices driving the bus
+    }
+
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        uint16_t latch = data[i] | (data[i + 1] << 8);
+        target->writes++;
+        if (latch == target->latch) {
+            target->redundantWrites++;
+        }
+        target->latch = latch;
+        target->intAsserted = false;
+
+        // The drum moving the magnet past the sensor is an input change
+        uint16_t inputs = target->readInputs();
+        target->drum.energise(latch);
+        if (target->readInputs() != inputs) {
+            target->intAsserted = true;
+        }
+    }
+    updateInt();
+    return 0;
+}
+
+size_t VirtualBus::read(uint8_t address, uint8_t *data, size_t length) {
+    bool collision;
+    VirtualPcf8575 *target = respond(address, collision);
+    transfer(target ? length : 0);
+    if (! target || collision) {
+        stats.nacks += target ? 0 : 1;
+        stats.collisions += collision ? 1 : 0;
+        return 0;
+    }
+
+    uint16_t inputs = target->readInputs();
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (i % 2 == 0) ? (inputs & 0xFF) : (inputs >> 8);
+    }
+    target->reads++;
+    target->intAsserted = false;
+    updateInt();
+    return length;
+}
+
+void VirtualBus::resetStats() {
+    stats = VirtualBusStats();
+    for (auto &pair : deviceMap) {
+        pair.second.writes = 0;
+        pair.second.redundantWrites = 0;
+        pair.second.reads = 0;
+    }
+}
+
+void VirtualBus::transfer(size_t bytes) {
+    // start + (address + data) * (8 bits + ack) + stop
+    uint64_t bits = 2 + (1 + bytes) * 9;
+    uint64_t us = (bits * 1000000 + clockHz - 1) / clockHz;
+
+    stats.transactions++;
+    stats.bytes += bytes;
+    stats.busyUs += us;
+    host::advanceUs(us);
+}
+
+void VirtualBus::updateInt() {
+    if (intPin < 0) {
+        return;
+    }
+
+    // open drain, expanders on either bus wired to the same pin pull it low together
+    bool asserted = false;
+    for (uint8_t busNum = 0; busNum < 2; busNum++) {
+        VirtualBus &bus = host::bus(busNum);
+        for (auto &pair : bus.deviceMap) {
+            asserted |= bus.intPin == intPin && pair.second.intAsserted;
+        }
+    }
+    host::setPinLevel(intPin, asserted ? LOW : HIGH);
+}
+
+VirtualBus &host::bus(uint8_t busNum) {
+    static VirtualBus buses[2];
+    return buses[busNum % 2];
+}
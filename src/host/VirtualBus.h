@@ -0,0 +1,91 @@
+#pragma once
+
+// Simulated I2C bus for the native (host) build.
+//
+// Every PCF8575 at a configured address drives a virtual 28BYJ-48 and character drum. Coil patterns written to
+// bits 1-4 move the rotor towards the energised phase, and bit 15 reads back HIGH while the drum's magnet is over
+// the hall effect sensor. Transfers advance the virtual clock by their on-the-wire time so bus load shows up in move
+// timings.
+//
+// Like the real part, a PCF8575 asserts its open-drain INT output when an input changes and releases it when it is
+// read or written. The outputs of every device are wired together onto the GPIO given to setIntPin().
+//
+// Devices are added by the address the firmware uses for them, so one behind the TCA9548A multiplexer is added as
+// 1000 + channel * 100 + address and only answers while its channel is switched on. The multiplexer is there once
+// addMux() is called, it takes a single byte with a bit per channel.
+
+#include <Arduino.h>
+#include <map>
+
+struct VirtualDrum
+{
+    int halfStepsPerRot = 4096; // 2048 full steps per drum rotation, a real gearbox is not always a whole number
+    int position = 0;           // drum position in half steps, 0 is the leading edge of a magnetWidth 96 magnet
+    int phase = 0;              // electrical phase of the rotor, 0-7
+    int magnetWidth = 96;       // half steps during which the hall sensor reads the magnet
+    int magnetCentre = 48;      // half step the magnet is centred on, a sensor reading it wider switches earlier
+    int slipPermille = 0;       // chance that the drum does not follow a step of the rotor, as when it binds
+
+    unsigned long halfStepsMoved = 0;
+
+    void energise(uint16_t outputs); // update the rotor from the coil bits of a PCF8575 write
+    bool magnetPresent() const {
+        return (position - magnetCentre + magnetWidth / 2 + halfStepsPerRot) % halfStepsPerRot < magnetWidth;
+    }
+};
+
+struct VirtualPcf8575
+{
+    uint16_t latch = 0xFFFF; // output latch, bits written HIGH double as inputs
+    VirtualDrum drum;
+    bool intAsserted = false; // an input changed since the last read or write
+
+    unsigned long writes = 0;
+    unsigned long redundantWrites = 0; // writes that did not change the latch
+    unsigned long reads = 0;
+
+    uint16_t readInputs() const;
+};
+
+struct VirtualBusStats
+{
+    unsigned long transactions = 0;
+    unsigned long nacks = 0;
+    unsigned long collisions = 0; // transactions more than one device answered, failed with error 4
+    unsigned long bytes = 0;
+    uint64_t busyUs = 0; // time spent clocking data on the bus
+};
+
+class VirtualBus {
+  public:
+    VirtualPcf8575 &addDevice(int address, int stepsPerRot, int startPosition);
+    VirtualPcf8575 *device(int address); // by the address it was added with
+    std::map<int, VirtualPcf8575> &devices() { return deviceMap; }
+    void addMux(uint8_t address) { muxAddress = address; }
+
+    void setClock(uint32_t hz) { clockHz = hz; }
+    uint32_t getClock() const { return clockHz; }
+    void setIntPin(int pin) { intPin = pin; } // GPIO the INT outputs are wired to, -1 when they are not connected
+
+    uint8_t write(uint8_t address, const uint8_t *data, size_t length); // Wire style error code, 0 on success
+    size_t read(uint8_t address, uint8_t *data, size_t length);         // number of bytes read, 0 on NACK
+
+    const VirtualBusStats &getStats() const { return stats; }
+    void resetStats();
+
+  private:
+    std::map<int, VirtualPcf8575> deviceMap;
+    int muxAddress = -1;
+    uint8_t muxChannels = 0; // channels switched on
+    uint32_t clockHz = 100000;
+    int intPin = -1;
+    VirtualBusStats stats;
+
+    VirtualPcf8575 *respond(uint8_t address, bool &collision); // the device answering on the wire
+    void transfer(size_t bytes); // account for start, address, data and stop bits
+    void updateInt();            // drive the shared INT line from the devices' outputs
+};
+
+namespace host {
+VirtualBus &bus(uint8_t busNum = 0);
+} // namespace host
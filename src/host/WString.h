@@ -0,0 +1,125 @@
+#pragma once
+
+// Minimal Arduino String replacement for the native (host) build.
+// Only the subset of the Arduino API used by the firmware is implemented.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+class String {
+  public:
+    String() {}
+    String(const char *str) : value(str ? str : "") {}
+    String(const std::string &str) : value(str) {}
+    String(char c) : value(1, c) {}
+    String(int number) : value(std::to_string(number)) {}
+    String(unsigned int number) : value(std::to_string(number)) {}
+    String(long number) : value(std::to_string(number)) {}
+    String(unsigned long number) : value(std::to_string(number)) {}
+    String(long long number) : value(std::to_string(number)) {}
+    String(unsigned long long number) : value(std::to_string(number)) {}
+    String(float number, unsigned int decimals = 2) { formatFloat(number, decimals); }
+    String(double number, unsigned int decimals = 2) { formatFloat(number, decimals); }
+
+    unsigned int length() const { return value.length(); }
+    bool isEmpty() const { return value.empty(); }
+    const char *c_str() const { return value.c_str(); }
+    void reserve(unsigned int size) { value.reserve(size); }
+
+    char operator[](unsigned int index) const { return index < value.length() ? value[index] : 0; }
+    char &operator[](unsigned int index) { return value[index]; }
+    char charAt(unsigned int index) const { return (*this)[index]; }
+
+    String substring(unsigned int from) const { return substring(from, length()); }
+    String substring(unsigned int from, unsigned int to) const {
+        if (from > to) {
+            std::swap(from, to);
+        }
+        if (from >= value.length()) {
+            return String();
+        }
+        return String(value.substr(from, to - from));
+    }
+
+    int indexOf(char c, unsigned int from = 0) const { return toIndex(value.find(c, from)); }
+    int indexOf(const String &str, unsigned int from = 0) const { return toIndex(value.find(str.value, from)); }
+
+    bool startsWith(const String &prefix) const { return value.compare(0, prefix.value.length(), prefix.value) == 0; }
+    bool endsWith(const String &suffix) const {
+        return value.length() >= suffix.value.length() &&
+            value.compare(value.length() - suffix.value.length(), suffix.value.length(), suffix.value) == 0;
+    }
+    bool equals(const String &other) const { return value == other.value; }
+    bool equalsIgnoreCase(const String &other) const;
+
+    void replace(const String &find, const String &replacement);
+    void remove(unsigned int index) { remove(index, length()); }
+    void remove(unsigned int index, unsigned int count) {
+        if (index < value.length()) {
+            value.erase(index, count);
+        }
+    }
+    void trim();
+    void toUpperCase();
+    void toLowerCase();
+
+    long toInt() const { return std::strtol(value.c_str(), nullptr, 10); }
+    float toFloat() const { return std::strtof(value.c_str(), nullptr); }
+
+    bool concat(const String &str) {
+        value += str.value;
+        return true;
+    }
+    bool concat(const char *str) {
+        value += str ? str : "";
+        return true;
+    }
+    bool concat(const char *str, unsigned int len) {
+        value.append(str, len);
+        return true;
+    }
+    bool concat(char c) {
+        value += c;
+        return true;
+    }
+
+    String &operator+=(const String &rhs) {
+        concat(rhs);
+        return *this;
+    }
+    String &operator+=(const char *rhs) {
+        concat(rhs);
+        return *this;
+    }
+    String &operator+=(char rhs) {
+        concat(rhs);
+        return *this;
+    }
+    String &operator+=(int rhs) { return *this += String(rhs); }
+    String &operator+=(unsigned int rhs) { return *this += String(rhs); }
+    String &operator+=(long rhs) { return *this += String(rhs); }
+    String &operator+=(unsigned long rhs) { return *this += String(rhs); }
+
+    friend String operator+(const String &lhs, const String &rhs) { return String(lhs.value + rhs.value); }
+    friend String operator+(const String &lhs, const char *rhs) { return String(lhs.value + (rhs ? rhs : "")); }
+    friend String operator+(const char *lhs, const String &rhs) { return String((lhs ? lhs : "") + rhs.value); }
+    friend String operator+(const String &lhs, char rhs) { return String(lhs.value + rhs); }
+
+    friend bool operator==(const String &lhs, const String &rhs) { return lhs.value == rhs.value; }
+    friend bool operator==(const String &lhs, const char *rhs) { return lhs.value == (rhs ? rhs : ""); }
+    friend bool operator!=(const String &lhs, const String &rhs) { return lhs.value != rhs.value; }
+    friend bool operator!=(const String &lhs, const char *rhs) { return ! (lhs == rhs); }
+    friend bool operator<(const String &lhs, const String &rhs) { return lhs.value < rhs.value; }
+
+  private:
+    std::string value;
+
+    static int toIndex(std::string::size_type pos) { return pos == std::string::npos ? -1 : (int) pos; }
+    void formatFloat(double number, unsigned int decimals) {
+        char buf[48];
+        std::snprintf(buf, sizeof(buf), "%.*f", (int) decimals, number);
+        value = buf;
+    }
+};
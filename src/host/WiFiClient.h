@@ -0,0 +1,5 @@
+#pragma once
+
+// WiFiClient stand-in for the native (host) build, there is no network stack behind it
+
+class WiFiClient {};
@@ -0,0 +1,98 @@
+#include "WiFiUdp.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool IPAddress::fromString(const String &address) {
+    in_addr parsed;
+    if (inet_pton(AF_INET, address.c_str(), &parsed) != 1) {
+        return false;
+    }
+    memcpy(bytes, &parsed.s_addr, sizeof(bytes));
+    return true;
+}
+
+String IPAddress::toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return text;
+}
+
+static sockaddr_in toSockaddr(IPAddress ip, uint16_t port) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    uint8_t bytes[4] = {ip[0], ip[1], ip[2], ip[3]};
+    memcpy(&address.sin_addr.s_addr, bytes, sizeof(bytes));
+    return address;
+}
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+    stop();
+    socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socketFd < 0) {
+        return 0;
+    }
+
+    sockaddr_in address = toSockaddr(IPAddress(0, 0, 0, 0), port);
+    if (bind(socketFd, (sockaddr *) &address, sizeof(address)) < 0) {
+        stop();
+        return 0;
+    }
+    fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL) | O_NONBLOCK); // parsePacket() polls, as on the ESP32
+    return 1;
+}
+
+void WiFiUDP::stop() {
+    if (socketFd >= 0) {
+        close(socketFd);
+        socketFd = -1;
+    }
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+    packetAddress = ip;
+    packetPort = port;
+    outgoing.clear();
+    return socketFd >= 0;
+}
+
+size_t WiFiUDP::write(const uint8_t *data, size_t size) {
+    outgoing.append((const char *) data, size);
+    return size;
+}
+
+int WiFiUDP::endPacket() {
+    sockaddr_in address = toSockaddr(packetAddress, packetPort);
+    ssize_t sent = sendto(socketFd, outgoing.data(), outgoing.size(), 0, (sockaddr *) &address, sizeof(address));
+    return sent == (ssize_t) outgoing.size();
+}
+
+int WiFiUDP::parsePacket() {
+    char buffer[1500];
+    sockaddr_in address = {};
+    socklen_t addressLength = sizeof(address);
+    ssize_t received = socketFd < 0 ? -1
+                                     : recvfrom(socketFd, buffer, sizeof(buffer), 0, (sockaddr *) &address,
+                                                &addressLength);
+    if (received <= 0) {
+        incoming.clear();
+        return 0;
+    }
+
+    incoming.assign(buffer, received);
+    uint8_t *bytes = (uint8_t *) &address.sin_addr.s_addr;
+    remoteAddress = IPAddress(bytes[0], bytes[1], bytes[2], bytes[3]);
+    remotePortNumber = ntohs(address.sin_port);
+    return (int) received;
+}
+
+int WiFiUDP::read(char *buffer, size_t length) {
+    size_t count = min(length, incoming.size());
+    memcpy(buffer, incoming.data(), count);
+    incoming.erase(0, count);
+    return (int) count;
+}
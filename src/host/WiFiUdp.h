@@ -0,0 +1,46 @@
+#pragma once
+
+// WiFiUDP stand-in for the native (host) build, on real sockets so several host builds can talk over loopback
+
+#include <Arduino.h>
+
+class IPAddress {
+  public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+
+    bool fromString(const String &address);
+    String toString() const;
+    uint8_t operator[](int index) const { return bytes[index]; }
+    bool operator==(const IPAddress &other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+    bool operator!=(const IPAddress &other) const { return ! (*this == other); }
+
+  private:
+    uint8_t bytes[4] = {0, 0, 0, 0};
+};
+
+class WiFiUDP {
+  public:
+    ~WiFiUDP() { stop(); }
+
+    uint8_t begin(uint16_t port); // 1 once bound to the port on every interface
+    void stop();
+
+    int beginPacket(IPAddress ip, uint16_t port);
+    size_t write(const uint8_t *data, size_t size);
+    int endPacket();
+
+    int parsePacket(); // size of the next datagram, 0 if there is none
+    int read(char *buffer, size_t length);
+    IPAddress remoteIP() const { return remoteAddress; }
+    uint16_t remotePort() const { return remotePortNumber; }
+
+  private:
+    int socketFd = -1;
+    IPAddress packetAddress;
+    uint16_t packetPort = 0;
+    std::string outgoing;
+    std::string incoming;
+    IPAddress remoteAddress;
+    uint16_t remotePortNumber = 0;
+};
@@ -0,0 +1,53 @@
+#include "Wire.h"
+
+#include "VirtualBus.h"
+
+TwoWire Wire(0);
+TwoWire Wire1(1);
+
+bool TwoWire::begin(int, int, uint32_t frequency) {
+    if (frequency > 0) {
+        setClock(frequency);
+    }
+    return true;
+}
+
+bool TwoWire::setClock(uint32_t frequency) {
+    host::bus(busNum).setClock(frequency);
+    return true;
+}
+
+uint32_t TwoWire::getClock() {
+    return host::bus(busNum).getClock();
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+    txAddress = address;
+    txLength = 0;
+    txOverflow = false;
+}
+
+size_t TwoWire::write(uint8_t data) {
+    if (txLength >= sizeof(txBuffer)) {
+        txOverflow = true;
+        return 0;
+    }
+    txBuffer[txLength++] = data;
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(bool) {
+    if (txOverflow) {
+        return 1; // data too long to fit in transmit buffer
+    }
+    return host::bus(busNum).write(txAddress, txBuffer, txLength);
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, bool) {
+    if (quantity > sizeof(rxBuffer)) {
+        quantity = sizeof(rxBuffer);
+    }
+    rxIndex = 0;
+    rxLength = (int) host::bus(busNum).read(address, rxBuffer, quantity);
+    return (uint8_t) rxLength;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// Wire (TwoWire) replacement for the native (host) build, backed by the simulated bus in VirtualBus.h
+
+#include <Arduino.h>
+
+#define SOC_I2C_NUM 2 // two controllers, like the ESP32-S3
+
+class TwoWire {
+  public:
+    TwoWire(uint8_t busNum) : busNum(busNum) {}
+
+    bool begin(int sdaPin = -1, int sclPin = -1, uint32_t frequency = 0);
+    bool end() { return true; }
+    bool setClock(uint32_t frequency);
+    uint32_t getClock();
+
+    void beginTransmission(uint8_t address);
+    void beginTransmission(int address) { beginTransmission((uint8_t) address); }
+    size_t write(uint8_t data);
+    uint8_t endTransmission(bool sendStop = true);
+
+    uint8_t requestFrom(uint8_t address, uint8_t quantity, bool sendStop = true);
+    uint8_t requestFrom(int address, int quantity) { return requestFrom((uint8_t) address, (uint8_t) quantity); }
+    int available() { return rxLength - rxIndex; }
+    int read() { return rxIndex < rxLength ? rxBuffer[rxIndex++] : -1; }
+
+  private:
+    uint8_t busNum;
+
+    uint8_t txAddress = 0;
+    uint8_t txBuffer[32];
+    size_t txLength = 0;
+    bool txOverflow = false;
+
+    uint8_t rxBuffer[32];
+    int rxLength = 0;
+    int rxIndex = 0;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
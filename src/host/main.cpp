@@ -0,0 +1,645 @@
+// Host harness for the native build
+//
+// Drives SplitFlapDisplay against the simulated PCF8575 bus and reports how long each operation takes in virtual
+// time, how much I2C traffic it generated, the energy the coils used and how far the firmware's idea of each drum
+// position has drifted from the simulated drum since homing.
+//
+//   pio run -e native && .pio/build/native/program [--modules N] [--seed N] [--set key=value ...] [--charset file]
+//                                                  [--cluster leader|member] [--drum-steps N]
+//                                                  [--slip module:permille] [--magnet module:steps] [--metrics]
+//                                                  [--trace file] [--verbose]
+//
+// --set overrides a setting before init, values with a decimal point are stored as floats, e.g. --set accel=0.0,
+//       values that are not numbers as strings
+// --charset loads a custom drum description, as /charset.json on the device, and selects it
+// --cluster homes, then runs in real time as a cluster leader or member on loopback instead of the usual scenarios.
+//       Start the members first, each in a slot of its own, then the leader:
+//
+//         program --cluster member --set clusterSlot=1 & program --cluster member --set clusterSlot=2 &
+//         program --cluster leader
+// --drum-steps makes the simulated drums take N full steps per rotation rather than stepsPerRot, e.g. 2038 for the
+//       63.68:1 gearbox of a real 28BYJ-48
+// --slip makes one module's drum miss this many steps in a thousand, as a binding drum would, -1 for every module
+// --magnet makes one module's sensor read its magnet over this many full steps rather than 48, centred on the same
+//       spot, as a stronger magnet or a sensor closer to it would, then calibrates
+// --metrics prints what /api/metrics would serve at the end of the run
+// --trace writes what /api/trace would serve at the end of the run to a file, the latest TRACE_LENGTH events in
+//       virtual time
+
+#include "JsonSettings.h"
+#include "SplitFlapCluster.h"
+#include "SplitFlapDisplay.h"
+#include "SplitFlapTrace.h"
+#include "VirtualBus.h"
+
+#include <Arduino.h>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <map>
+
+// clang-format off
+JsonSettings settings = JsonSettings("config", {
+    // General Settings read by loop()
+    {"timeFormat", JsonSetting("{HH}:{mm}")},
+    // Hardware Settings, same defaults as SplitFlapDisplay.ino
+    {"moduleCount", JsonSetting(8)},
+    {"moduleAddresses", JsonSetting({0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27})},
+    {"moduleBuses", JsonSetting(std::vector<int>())}, // 0 for Wire, 1 for Wire1
+    {"magnetPosition", JsonSetting(730)},
+    {"moduleOffsets", JsonSetting({0, 0, 0, 0, 0, 0, 0, 0})},
+    {"magnetCorrections", JsonSetting(std::vector<int>())},
+    {"displayOffset", JsonSetting(0)},
+    {"sdaPin", JsonSetting(8)},
+    {"sclPin", JsonSetting(9)},
+    {"sda2Pin", JsonSetting(-1)},
+    {"scl2Pin", JsonSetting(-1)},
+    {"i2cClock", JsonSetting(400000)},
+    {"hallIntPin", JsonSetting(-1)},
+    {"hallWindow", JsonSetting(32)},
+    {"driftCorrection", JsonSetting(1)},
+    {"stepsPerRot", JsonSetting(2048)},
+    {"stepMode", JsonSetting(0)},
+    {"maxVel", JsonSetting(20.0f)},
+    {"accel", JsonSetting(30.0f)},
+    {"charset", JsonSetting(37)},
+    {"holdTime", JsonSetting(0)},
+    // Cluster Settings, the leader on loopback
+    {"clusterRole", JsonSetting(0)},
+    {"clusterSlot", JsonSetting(0)},
+    {"clusterLeader", JsonSetting("127.0.0.1")},
+    {"clusterPort", JsonSetting(4210)},
+    // Operational States
+    {"mode", JsonSetting(0)}
+});
+// clang-format on
+
+SplitFlapDisplay display(settings);
+SplitFlapCluster cluster(settings);
+
+static bool homed = false;
+static int driftReference[MAX_MODULES]; // firmware position minus drum position right after homing
+
+// Simulated drum position, in the steps of the step mode since the leading edge of the magnet
+static int drumPosition(int module) {
+    SplitFlapModule &splitFlapModule = display.getModules()[module];
+    int busNum = splitFlapModule.getBus() == &display.getBus(0) ? 0 : 1;
+    VirtualDrum &drum = host::bus(busNum).device(splitFlapModule.getAddress())->drum;
+    return (long) drum.position * splitFlapModule.getStepsPerRot() / drum.halfStepsPerRot;
+}
+
+// Difference between where the firmware thinks the drum is and where the simulated drum really is, in the steps of
+// the step mode
+static int drumDrift(int module) {
+    SplitFlapModule &splitFlapModule = display.getModules()[module];
+    int stepsPerRot = splitFlapModule.getStepsPerRot();
+    return (splitFlapModule.getPosition() - drumPosition(module) + stepsPerRot) % stepsPerRot;
+}
+
+// How far the firmware's position is off the drum's, counting both from the leading edge of the magnet, so sensor
+// lag shows up as a small constant error and a drum that takes more or fewer steps per rotation as a growing one
+static int displayError(int module) {
+    SplitFlapModule &splitFlapModule = display.getModules()[module];
+    int stepsPerRot = splitFlapModule.getStepsPerRot();
+    int magnetPosition = splitFlapModule.getMagnetPosition() - splitFlapModule.getDriftCorrection();
+    int error = splitFlapModule.getPosition() - magnetPosition - drumPosition(module);
+    return (error % stepsPerRot + stepsPerRot + stepsPerRot / 2) % stepsPerRot - stepsPerRot / 2;
+}
+
+// How far the firmware's position is off the drum's, counting from where the flaps are rather than from the magnet
+// edge, so a sensor that switches earlier or later than the others shows up until calibration makes up for it. The
+// simulated drums have no flaps set off against their magnets, so moduleOffsets stand for the ones real drums would
+// have and count as where the flaps are.
+static int alignmentError(int module) {
+    SplitFlapModule &splitFlapModule = display.getModules()[module];
+    int stepsPerRot = splitFlapModule.getStepsPerRot();
+    int microsteps = SplitFlapModule::getMicrosteps(settings.getInt("stepMode"));
+    std::vector<int> offsets = settings.getIntVector("moduleOffsets");
+    int offset = module < (int) offsets.size() ? offsets[module] : 0;
+    int magnetPosition = (settings.getInt("magnetPosition") + offset + settings.getInt("displayOffset")) * microsteps +
+        splitFlapModule.getDriftCorrection();
+    int error = splitFlapModule.getPosition() - magnetPosition - drumPosition(module);
+    return (error % stepsPerRot + stepsPerRot + stepsPerRot / 2) % stepsPerRot - stepsPerRot / 2;
+}
+
+static unsigned long coilMs() {
+    unsigned long total = 0;
+    for (int i = 0; i < display.getNumModules(); i++) {
+        total += display.getModules()[i].getCoilMs();
+    }
+    return total;
+}
+
+static uint64_t report(const char *label, std::function<void()> operation) {
+    for (int busNum = 0; busNum < MAX_BUSES; busNum++) {
+        host::bus(busNum).resetStats();
+    }
+    uint64_t start = host::nowUs();
+    unsigned long startCoilMs = coilMs();
+
+    operation();
+
+    uint64_t elapsedUs = host::nowUs() - start;
+
+    // Transactions add up over both buses, utilisation is the busier one's
+    unsigned long transactions = 0;
+    uint64_t busyUs = 0;
+    unsigned long reads = 0;
+    unsigned long redundant = 0;
+    for (int busNum = 0; busNum < MAX_BUSES; busNum++) {
+        VirtualBus &bus = host::bus(busNum);
+        transactions += bus.getStats().transactions;
+        busyUs = max(busyUs, bus.getStats().busyUs);
+        for (auto &pair : bus.devices()) {
+            reads += pair.second.reads;
+            redundant += pair.second.redundantWrites;
+        }
+    }
+
+    int totalDrift = 0; // in full steps
+    for (int i = 0; homed && i < display.getNumModules(); i++) {
+        int stepsPerRot = display.getModules()[i].getStepsPerRot();
+        int drift = (drumDrift(i) - driftReference[i] + stepsPerRot) % stepsPerRot;
+        totalDrift += min(drift, stepsPerRot - drift) * settings.getInt("stepsPerRot") / stepsPerRot;
+    }
+
+    printf(
+        "%-14s %9.1f ms  %6lu i2c  %5lu reads  %5lu redundant  bus %5.1f%%  coils %6.1f J  drift %d steps\n",
+        label,
+        elapsedUs / 1000.0,
+        transactions,
+        reads,
+        redundant,
+        elapsedUs ? 100.0 * busyUs / elapsedUs : 0.0,
+        (coilMs() - startCoilMs) * COIL_POWER_MW / 1e6,
+        totalDrift
+    );
+    return elapsedUs;
+}
+
+// loop() as far as the cluster is concerned, in real time
+static void clusterLoop(unsigned long ms, std::function<bool()> done = [] { return false; }) {
+    unsigned long start = millis();
+    while (millis() - start < ms && ! done()) {
+        cluster.loop();
+        display.tick();
+        delayMicroseconds(100);
+    }
+}
+
+// The leader splits a few strings over the members that joined and reports how far apart the controllers started
+// and finished each one, members follow until the leader is gone
+static int runCluster() {
+    host::setRealTime(true);
+    cluster.setup(display);
+    if (cluster.getRole() == ClusterRole::Off) {
+        return 1;
+    }
+
+    if (cluster.getRole() == ClusterRole::Member) {
+        bool synced = false;
+        clusterLoop(120000, [&] {
+            synced |= cluster.getStats().synced;
+            return synced && ! cluster.getStats().synced;
+        });
+        ClusterStats stats = cluster.getStats();
+        printf("member in slot %d: %lu moves, %lu late, clock offset %+ld us from a %lu us round trip\n",
+               settings.getInt("clusterSlot"), stats.moves, stats.lateStarts, (long) stats.offsetUs,
+               (unsigned long) stats.rttUs);
+        return 0;
+    }
+
+    clusterLoop(2000); // members join and take their clock samples
+    std::vector<ClusterMember> members = cluster.getMembers();
+    printf("cluster leader with %zu members:", members.size());
+    for (const ClusterMember &member : members) {
+        printf(" slot %d (%d modules)", member.slot, member.modules);
+    }
+    printf("\n\n");
+
+    const char *strings[] = {"HELLO CLUSTER WORLD", "SPLIT FLAP", "0123456789ABCDEFGHIJ", ""};
+    for (const char *str : strings) {
+        uint32_t previousMove = cluster.getStats().lastMove;
+        display.queueString(str, CommandSource::Web, CommandPriority::Text);
+        clusterLoop(20000, [previousMove] {
+            ClusterStats stats = cluster.getStats();
+            return stats.lastMove != previousMove && stats.reported == stats.participants;
+        });
+        ClusterStats stats = cluster.getStats();
+        String label = "\"" + String(str) + "\"";
+        printf("%-22s %d of %d controllers done, start spread %.2f ms, finish spread %.1f ms\n", label.c_str(),
+               stats.reported, stats.participants, stats.startSpreadUs / 1000.0, stats.finishSpreadUs / 1000.0);
+        clusterLoop(500);
+    }
+    ClusterStats stats = cluster.getStats();
+    printf("\n%lu moves, %lu resends, %lu late starts, largest start spread %.2f ms\n", stats.moves, stats.resends,
+           stats.lateStarts, stats.maxStartSpreadUs / 1000.0);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int moduleCount = 8;
+    unsigned long seed = 1;
+    bool verbose = false;
+    bool metrics = false;
+    const char *tracePath = nullptr;
+    int drumSteps = 0;
+    std::map<int, int> slips; // permille by module, -1 for all
+    std::map<int, int> magnets; // width in full steps by module, -1 for all
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--modules") == 0 && i + 1 < argc) {
+            moduleCount = constrain(atoi(argv[++i]), 1, MAX_MODULES);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+            String assignment = argv[++i];
+            int split = assignment.indexOf('=');
+            String key = assignment.substring(0, split);
+            String value = assignment.substring(split + 1);
+            char *end;
+            strtod(value.c_str(), &end);
+            if (value.isEmpty() || *end != '\0') {
+                settings.putString(key.c_str(), value);
+            } else if (value.indexOf('.') >= 0) {
+                settings.putFloat(key.c_str(), value.toFloat());
+            } else {
+                settings.putInt(key.c_str(), value.toInt());
+            }
+        } else if (strcmp(argv[i], "--charset") == 0 && i + 1 < argc) {
+            FILE *file = fopen(argv[++i], "r");
+            String json;
+            for (int c; file != nullptr && (c = fgetc(file)) != EOF;) {
+                json += (char) c;
+            }
+            if (file != nullptr) {
+                fclose(file);
+            }
+            String error;
+            if (! loadCustomCharset(json.c_str(), error)) {
+                printf("%s: %s\n", argv[i], error.c_str());
+                return 1;
+            }
+            settings.putInt("charset", CHARSET_CUSTOM);
+        } else if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc) {
+            ++i;
+            settings.putInt("clusterRole", (int) (strcmp(argv[i], "leader") == 0 ? ClusterRole::Leader
+                                                                                   : ClusterRole::Member));
+        } else if (strcmp(argv[i], "--drum-steps") == 0 && i + 1 < argc) {
+            drumSteps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slip") == 0 && i + 1 < argc) {
+            int module, permille;
+            if (sscanf(argv[++i], "%d:%d", &module, &permille) == 2) {
+                slips[module] = permille;
+            }
+        } else if (strcmp(argv[i], "--magnet") == 0 && i + 1 < argc) {
+            int module, width;
+            if (sscanf(argv[++i], "%d:%d", &module, &width) == 2) {
+                magnets[module] = width;
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            metrics = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        }
+    }
+
+    Serial.setQuiet(! verbose);
+    randomSeed(seed);
+
+    // Past eight modules the expanders are spread over the multiplexer channels, like a large board would be wired,
+    // and with a second bus the second half of the modules goes on it
+    settings.putInt("moduleCount", moduleCount);
+    bool twoBuses = settings.getInt("sda2Pin") >= 0 && settings.getInt("scl2Pin") >= 0;
+    std::vector<int> addresses = settings.getIntVector("moduleAddresses");
+    std::vector<int> buses(moduleCount, 0);
+    if ((int) addresses.size() < moduleCount || twoBuses) {
+        int firstBusModules = twoBuses ? (moduleCount + 1) / 2 : moduleCount;
+        addresses.clear();
+        for (int i = 0; i < moduleCount; i++) {
+            buses[i] = i < firstBusModules ? 0 : 1;
+            int indexOnBus = i < firstBusModules ? i : i - firstBusModules;
+            int busModules = i < firstBusModules ? firstBusModules : moduleCount - firstBusModules;
+            addresses.push_back(SplitFlapBus::getDefaultAddress(indexOnBus, busModules));
+        }
+        settings.putIntVector("moduleAddresses", addresses);
+        settings.putIntVector("moduleBuses", buses);
+    }
+    int stepsPerRot = settings.getInt("stepsPerRot");
+    for (int i = 0; i < moduleCount; i++) {
+        int drumStepsPerRot = drumSteps > 0 ? drumSteps : stepsPerRot;
+        VirtualPcf8575 &device = host::bus(buses[i]).addDevice(addresses[i], drumStepsPerRot, random(0, stepsPerRot));
+        device.drum.slipPermille = slips.count(i) ? slips[i] : slips.count(-1) ? slips[-1] : 0;
+        if (magnets.count(i) || magnets.count(-1)) {
+            device.drum.magnetWidth = 2 * (magnets.count(i) ? magnets[i] : magnets[-1]);
+        }
+        if (SplitFlapBus::getChannel(addresses[i]) != BUS_MUX_NONE) {
+            host::bus(buses[i]).addMux(BUS_MUX_ADDRESS);
+        }
+    }
+    for (int busNum = 0; busNum < MAX_BUSES; busNum++) {
+        host::bus(busNum).setIntPin(settings.getInt("hallIntPin"));
+    }
+
+    printf("Simulating %d modules on %d bus%s, seed %lu\n\n", moduleCount, twoBuses ? 2 : 1, twoBuses ? "es" : "",
+           seed);
+
+    report("init", [] { display.init(); });
+    report("home", [] { display.home(); });
+
+    for (int i = 0; i < display.getNumModules(); i++) {
+        driftReference[i] = drumDrift(i);
+    }
+    homed = true;
+
+    if (settings.getInt("clusterRole") != (int) ClusterRole::Off) {
+        return runCluster();
+    }
+
+    const char *strings[] = {"HELLO", "WORLD", "1234", "1235", "SPLITFLP", "", "ABCDEFGH", "ZZZZZZZZ"};
+    for (const char *str : strings) {
+        String label = "\"" + String(str) + "\"";
+        MotionPlan plan = display.planString(str);
+        uint64_t elapsedUs = report(label.c_str(), [str] { display.writeString(str); });
+        if (plan.busyMs > 0) {
+            printf("               planned %lu ms, %+.1f%% off\n", plan.busyMs,
+                   100.0 * ((double) plan.busyMs * 1000 - elapsedUs) / elapsedUs);
+        }
+    }
+
+    // Same kind of write as loop() issues, the longest gap between two ticks is how long loop() would be stalled
+    unsigned long ticks = 0;
+    uint64_t longestStallUs = 0;
+    report("async", [&] {
+        display.writeString("ASYNC", MAX_RPM, true, false);
+        uint64_t lastTick = host::nowUs();
+        while (display.isBusy()) {
+            display.tick();
+            ticks++;
+            longestStallUs = max(longestStallUs, host::nowUs() - lastTick);
+            lastTick = host::nowUs();
+        }
+    });
+    printf("               %lu loop iterations, longest stall %.2f ms\n", ticks, longestStallUs / 1000.0);
+
+    // A burst of MQTT messages and clock updates while a move is running, then an alert cutting into the next move
+    report("burst", [] {
+        display.queueString("CLOCK", CommandSource::Local, CommandPriority::Ambient);
+        display.tick();
+        for (int i = 0; i < 20; i++) {
+            display.queueString("MSG" + String(i), CommandSource::Mqtt, CommandPriority::Text, false);
+            display.queueString("12:" + String(10 + i), CommandSource::Local, CommandPriority::Ambient);
+            display.tick();
+        }
+        while (display.isBusy() || display.getQueueStats().depth > 0) {
+            display.tick();
+            if (display.getQueueStats().run == 2 && display.isBusy()) {
+                display.queueString("ALERT", CommandSource::Alert, CommandPriority::Alert);
+            }
+        }
+    });
+    CommandQueueStats queueStats = display.getQueueStats();
+    printf("               %lu queued, %lu coalesced, %lu dropped, %lu run, %lu preempted, max depth %d\n",
+           queueStats.queued, queueStats.coalesced, queueStats.dropped, queueStats.run, queueStats.preempted,
+           queueStats.maxDepth);
+
+    // Character lookups as writeString does them, once per module per character, timed on the host clock since they
+    // take no virtual time
+    const char *text = "Hello World 0123456789 split-flap display!";
+    int textLength = strlen(text);
+    unsigned long lookups = 0;
+    long checksum = 0;
+    auto lookupStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100000; i++) {
+        char c = text[i % textLength];
+        for (int j = 0; j < display.getNumModules(); j++) {
+            checksum += display.getModules()[j].getCharPosition(c);
+            lookups++;
+        }
+    }
+    double lookupNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - lookupStart).count();
+    SplitFlapModule::reportUnknownChars(display.getCharset());
+    printf("char lookup    %.1f ns per character, checksum %ld, %zu bytes per module\n", lookupNs / lookups,
+           checksum, sizeof(SplitFlapModule));
+
+    // loop() with nothing to display, as in time mode: the mode is looked up on every iteration and the time format
+    // every 250ms
+    settings.putInt("mode", 3);
+    Preferences::resetStats();
+    unsigned long loops = 0;
+    uint64_t loopStart = host::nowUs();
+    unsigned long lastFormatCheck = millis();
+    while (host::nowUs() - loopStart < 10 * 1000000ULL) {
+        display.tick();
+        if (settings.getInt("mode") == 3 && millis() - lastFormatCheck > 250) {
+            lastFormatCheck = millis();
+            settings.getString("timeFormat");
+        }
+        settings.tick();
+        yield();
+        loops++;
+    }
+    printf("idle loop      %.0f iterations per second, %lu NVS opens\n",
+           loops * 1e6 / (host::nowUs() - loopStart), Preferences::getStats().opens);
+
+    // A burst of API calls 200ms apart: /text switching to single input mode every time, and the calibration page
+    // nudging module offsets one step at a time and back
+    Preferences::resetStats();
+    JsonSettingsStats settingsBefore = settings.getStats();
+    for (int i = 0; i < 50; i++) {
+        settings.putInt("mode", 0);
+        std::vector<int> offsets = settings.getIntVector("moduleOffsets");
+        offsets[i % offsets.size()] += i < 25 ? 1 : -1;
+        settings.putIntVector("moduleOffsets", offsets);
+        delay(200);
+        settings.tick();
+    }
+    delay(SETTINGS_FLUSH_QUIET_MS);
+    settings.tick();
+    JsonSettingsStats settingsAfter = settings.getStats();
+    printf("api burst      %lu updates, %lu unchanged, %lu coalesced, %lu NVS writes in %lu commits\n",
+           settingsAfter.updates - settingsBefore.updates, settingsAfter.unchanged - settingsBefore.unchanged,
+           settingsAfter.coalesced - settingsBefore.coalesced, settingsAfter.writes - settingsBefore.writes,
+           settingsAfter.commits - settingsBefore.commits);
+
+    // Back-to-back updates a few seconds apart, like the time and multi-word modes, with and without a hold window. The
+    // last repeats the text on show, as the time mode does within a minute, and should leave the hold to run out
+    auto updates = [](const char *label) {
+        for (const char *str : {"1234", "1235", "1236", "1236"}) {
+            String rowLabel = String(label) + " \"" + str + "\"";
+            report(rowLabel.c_str(), [str] {
+                display.writeString(str);
+                delay(3000);
+                display.tick();
+            });
+        }
+    };
+    updates("cold");
+    display.setHoldTime(10);
+    updates("hold");
+
+    // Warm starts from the hold with modules parked over their magnets, each has to let go of the magnet it starts on
+    // and count from the next one it comes to, and how far the worst module was off afterwards
+    report("warm home", [] { display.home(); });
+    for (const char *str : {"NNNNNNNZ", "AAAAAAAA"}) {
+        String label = "warm \"" + String(str) + "\"";
+        report(label.c_str(), [str] { display.writeString(str); });
+    }
+    int warmError = 0;
+    for (int i = 0; i < display.getNumModules(); i++) {
+        warmError = max(warmError, abs(displayError(i)));
+    }
+    printf("               worst module %.1f steps off the drum\n",
+           warmError / (float) SplitFlapModule::getMicrosteps(settings.getInt("stepMode")));
+
+    // With drums that do not match stepsPerRot, every character of the drum in turn, first only recording the drift and
+    // then with the correction it settles on, and how far each module was off where it stopped
+    if (drumSteps > 0 || ! slips.empty()) {
+        auto passes = [](const char *label, int count) {
+            long totalError = 0;
+            int worstError = 0;
+            int moves = 0;
+            for (int pass = 0; pass < count; pass++) {
+                for (int c = 1; c < display.getCharsetSize(); c++) {
+                    String text;
+                    while ((int) text.length() < display.getNumModules()) {
+                        text += display.getCharset().chars[c];
+                    }
+                    display.writeString(text);
+                    display.tick();
+                    for (int i = 0; i < display.getNumModules(); i++) {
+                        int error = abs(displayError(i));
+                        totalError += error;
+                        worstError = max(worstError, error);
+                    }
+                    moves++;
+                }
+            }
+            float microsteps = SplitFlapModule::getMicrosteps(settings.getInt("stepMode"));
+            printf("%-14s %6d moves  error mean %.1f steps, worst %.1f\n", label, moves,
+                   totalError / microsteps / (moves * display.getNumModules()), worstError / microsteps);
+        };
+        display.setHoldTime(0);
+        display.setDriftCorrection(false);
+        passes("uncorrected", DRIFT_WINDOW);
+        display.setDriftCorrection(true);
+        display.tick();
+        passes("corrected", 2);
+    }
+
+    // With sensors that read their magnets wider or narrower, how far apart the modules are before and after
+    // calibrating, and what it found
+    if (! magnets.empty()) {
+        auto alignment = [](const char *label) {
+            float microsteps = SplitFlapModule::getMicrosteps(settings.getInt("stepMode"));
+            int lowest = INT_MAX;
+            int highest = INT_MIN;
+            for (int i = 0; i < display.getNumModules(); i++) {
+                lowest = min(lowest, alignmentError(i));
+                highest = max(highest, alignmentError(i));
+            }
+            printf("%-14s modules between %+.1f and %+.1f steps of the flaps, %.1f apart\n", label, lowest / microsteps,
+                   highest / microsteps, (highest - lowest) / microsteps);
+        };
+        display.setHoldTime(0);
+        alignment("uncalibrated");
+        report("calibrate", [] { display.calibrate(); });
+        alignment("calibrated");
+        const std::vector<ModuleCalibration> &calibration = display.getCalibration();
+        for (size_t i = 0; i < calibration.size(); i++) {
+            printf("  module %2zu   magnet %.1f steps wide, %.1f apart over %d passes, correction %+d -> %+d%s\n", i,
+                   calibration[i].width, calibration[i].spread, calibration[i].passes, calibration[i].oldCorrection,
+                   calibration[i].correction, calibration[i].calibrated ? "" : ", not calibrated");
+        }
+    }
+
+    MotionReport motionReport = display.getMotion().getReport();
+    const char *phaseNames[MOTION_PHASES] = {"idle", "wake-up", "settle", "stepping", "release", "hold"};
+    printf("\n%lu moves, %lu warm starts, %lu wake-ups skipped\ntime in phase", motionReport.moves,
+           motionReport.warmStarts, motionReport.skippedWakeUps);
+    for (int i = 0; i < MOTION_PHASES; i++) {
+        printf("  %s %.1f s", phaseNames[i], motionReport.phaseMs[i] / 1000.0);
+    }
+    printf("\n");
+    printf("hall sensors read %lu times in %lu passes, %lu on INT edges, longest INT latency %lu us\n",
+           motionReport.hallReads, motionReport.hallPasses, motionReport.hallEdges, motionReport.hallLatencyMaxUs);
+
+    unsigned long busWrites = 0;
+    unsigned long droppedWrites = 0;
+    for (int busNum = 0; busNum < display.getNumBuses(); busNum++) {
+        busWrites += display.getBus(busNum).getStats().writes;
+        droppedWrites += display.getBus(busNum).getStats().droppedWrites;
+    }
+    printf("bus %lu writes, %lu dropped by the shadow registers\n", busWrites, droppedWrites);
+
+    // How far the time between two steps of a module was off the nominal step period, over the whole run
+    printf("\nstep jitter ");
+    const unsigned long *stepJitter = display.getMotion().getStepJitter();
+    for (int i = 0; i < STEP_JITTER_BUCKETS; i++) {
+        if (i < STEP_JITTER_BUCKETS - 1) {
+            printf(" <%luus %lu", SplitFlapMotion::StepJitterBucketsUs[i], stepJitter[i]);
+        } else {
+            printf("  >=%luus %lu\n", SplitFlapMotion::StepJitterBucketsUs[i - 1], stepJitter[i]);
+        }
+    }
+
+    // How far the count was off at each magnet crossing, in full steps, and the modules that were corrected or flagged
+    std::vector<ModuleDrift> drift = display.getDrift();
+    float microsteps = SplitFlapModule::getMicrosteps(settings.getInt("stepMode"));
+    unsigned long crossings = 0;
+    unsigned long missed = 0;
+    float meanDrift = 0;
+    int worstDrift = 0;
+    int corrected = 0;
+    int flagged = 0;
+    for (const ModuleDrift &module : drift) {
+        crossings += module.crossings;
+        missed += module.missed;
+        meanDrift += module.mean / drift.size();
+        worstDrift = abs(module.worst) > abs(worstDrift) ? module.worst : worstDrift;
+        corrected += module.correction != 0;
+        flagged += module.trouble;
+    }
+    printf("magnet drift  %lu crossings, %lu missed, mean %+.1f steps, worst %+.1f, %d corrected, %d flagged, "
+           "%lu dropped\n", crossings, missed, meanDrift / microsteps, worstDrift / microsteps, corrected, flagged,
+           display.getDriftDropped());
+    for (size_t i = 0; i < drift.size(); i++) {
+        if (drift[i].correction != 0 || drift[i].trouble) {
+            printf("  module %2zu   mean %+.1f deviation %.1f worst %+.1f, corrected by %+.1f%s\n", i,
+                   drift[i].mean / microsteps, drift[i].deviation / microsteps, drift[i].worst / microsteps,
+                   drift[i].correction / microsteps, drift[i].trouble ? ", flagged" : "");
+        }
+    }
+
+    // In the small pieces the web server would ask for
+    if (metrics) {
+        printf("\n");
+        MetricsExporter exporter(display);
+        uint8_t buffer[256];
+        for (size_t length; (length = exporter.read(buffer, sizeof(buffer))) > 0;) {
+            fwrite(buffer, 1, length, stdout);
+        }
+    }
+
+    if (tracePath != nullptr) {
+#ifdef SPLITFLAP_TRACE
+        FILE *file = fopen(tracePath, "w");
+        if (file == nullptr) {
+            printf("%s: cannot write\n", tracePath);
+            return 1;
+        }
+        TraceExporter exporter;
+        uint8_t buffer[256];
+        for (size_t length; (length = exporter.read(buffer, sizeof(buffer))) > 0;) {
+            fwrite(buffer, 1, length, file);
+        }
+        fclose(file);
+#else
+        printf("\nTracing is not built in, build with -D SPLITFLAP_TRACE\n");
+#endif
+    }
+
+    return 0;
+}
@@ -35,6 +35,7 @@ document.addEventListener("alpine:init", () => {
 
         // Module calibration specific
         testingModule: null,
+        calibrating: false,
 
         get processing() {
             return (
@@ -55,6 +56,25 @@ document.addEventListener("alpine:init", () => {
             this.settings.moduleAddresses = arr.join(",");
         },
 
+        get busArray() {
+            // modules without a bus go on the one the firmware gives them: the second half on Wire1
+            const count = this.settings.moduleCount || 0;
+            const arr =
+                this.settings.moduleBuses?.split(",").map((s) => s.trim()) ||
+                [];
+            for (let i = 0; i < count; i++) {
+                if (arr[i] !== "0" && arr[i] !== "1") {
+                    arr[i] = i >= Math.ceil(count / 2) ? "1" : "0";
+                }
+            }
+            return arr.slice(0, count);
+        },
+        setBus(index, value) {
+            const arr = this.busArray;
+            arr[index] = value;
+            this.settings.moduleBuses = arr.join(",");
+        },
+
         get offsetArray() {
             return (
                 this.settings.moduleOffsets?.split(",").map((s) => s.trim()) ||
@@ -233,7 +253,7 @@ document.addEventListener("alpine:init", () => {
                 const data = await response.json();
                 if (data.type === "success") {
                     this.showDialog(
-                        `Module ${moduleIndex} test complete`,
+                        `Module ${moduleIndex} test started`,
                         "success",
                     );
                 } else {
@@ -247,6 +267,41 @@ document.addEventListener("alpine:init", () => {
             }
         },
 
+        async calibrateAll() {
+            this.calibrating = true;
+            try {
+                const response = await fetch("/api/calibrate", {
+                    method: "POST",
+                });
+                const data = await response.json();
+                if (data.type !== "success") {
+                    this.showDialog(data.message || "Calibration failed", "error");
+                    return;
+                }
+
+                // the display scans for a few seconds per pass, the results come with the new corrections
+                let result;
+                do {
+                    await new Promise((resolve) => setTimeout(resolve, 1000));
+                    result = await (await fetch("/api/calibrate")).json();
+                } while (result.running);
+
+                const calibrated = result.modules.filter((m) => m.calibrated);
+                this.loadSettings();
+                this.showDialog(
+                    `Calibrated ${calibrated.length} of ${result.modules.length} modules`,
+                    calibrated.length === result.modules.length
+                        ? "success"
+                        : "error",
+                );
+            } catch (error) {
+                console.error("Calibration failed:", error);
+                this.showDialog("Calibration failed", "error");
+            } finally {
+                this.calibrating = false;
+            }
+        },
+
         async updateModuleOffset(moduleIndex, delta) {
             const currentOffset = parseInt(this.offsetArray[moduleIndex]) || 0;
             const newOffset = currentOffset + delta;